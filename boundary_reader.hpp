@@ -0,0 +1,343 @@
+#ifndef SPLITTER_BOUNDARY_READER_HPP
+#define SPLITTER_BOUNDARY_READER_HPP
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include <geos/util/GEOSException.h>
+#include <geos/geom/MultiPolygon.h>
+#include <osmium/geometry/geos.hpp>
+
+#include "pbf_blocks.hpp"
+#include "ring_assembler.hpp"
+
+/*
+
+Boundary Reader (REL extracts)
+ - builds the multipolygons of boundary relations from the .pbf input itself
+ - a .pbf is sorted by type (nodes, ways, relations) and id, all versions of an
+   object follow each other. the first and last object of a blob are learned by
+   decoding it, so the blob holding an object is found by a binary search over
+   the blobs, decoding only the blobs it probes
+ - the last visible version of every object is used, so the boundaries match the
+   state at the end of the dump. an object of which all versions are deleted is an
+   error
+ - three steps, each reading only the blobs holding the wanted objects:
+   - the relations, their way-members with role inner become holes, all other
+     way-members outer rings
+   - the ways, for their node-ids
+   - the nodes, for their positions
+ - the ways of each role are joined at their end-nodes into closed rings, the
+   outer rings minus the inner rings are the extract, just like a .poly file
+   (see ring_assembler.hpp)
+
+*/
+
+class BoundaryReader {
+
+private:
+    // objects are sorted by type first, then by id
+    typedef std::pair<int, int64_t> key_t;
+
+    enum {
+        NODE = 0,
+        WAY = 1,
+        RELATION = 2
+    };
+
+    struct BlobRange {
+        bool known;
+        key_t first;
+        key_t last;
+    };
+
+    struct Boundary {
+        std::vector<int64_t> outer;
+        std::vector<int64_t> inner;
+    };
+
+    std::string filename;
+    PbfBlockReader reader;
+    std::vector<PbfBlockReader::BlobInfo> blobs;
+    std::vector<BlobRange> ranges;
+
+    // the blob currently decoded
+    long current;
+    PbfObjects objects;
+
+    std::map<int64_t, Boundary> boundaries;
+    std::map<int64_t, std::vector<int64_t> > way_nodes;
+    NodeLocations positions;
+
+    bool load(long blob) {
+        if(blob == current)
+            return true;
+
+        std::string data;
+        if(!reader.read_blob(blobs[blob], data) || !PbfBlockReader::decode_objects(data, objects))
+            return false;
+
+        current = blob;
+
+        // blobs without objects sort before everything
+        BlobRange &range = ranges[blob];
+        range.known = true;
+        range.first = range.last = key_t(-1, 0);
+        if(!objects.nodes.empty()) {
+            range.first = key_t(NODE, objects.nodes.front().id);
+            range.last = key_t(NODE, objects.nodes.back().id);
+        }
+        if(!objects.ways.empty()) {
+            if(objects.nodes.empty()) range.first = key_t(WAY, objects.ways.front().id);
+            range.last = key_t(WAY, objects.ways.back().id);
+        }
+        if(!objects.relations.empty()) {
+            if(objects.nodes.empty() && objects.ways.empty()) range.first = key_t(RELATION, objects.relations.front().id);
+            range.last = key_t(RELATION, objects.relations.back().id);
+        }
+        return true;
+    }
+
+    const BlobRange *range(long blob) {
+        if(!ranges[blob].known && !load(blob))
+            return NULL;
+        return &ranges[blob];
+    }
+
+    // load the blob holding the last version of an object, returns false if there is none
+    bool find(const key_t &key) {
+        // the last blob starting at or before the key
+        long lo = 0, hi = blobs.size() - 1, found = -1;
+        while(lo <= hi) {
+            long mid = (lo + hi) / 2;
+            const BlobRange *r = range(mid);
+            if(!r)
+                return false;
+
+            if(r->first <= key) {
+                found = mid;
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+
+        if(found < 0 || range(found)->last < key)
+            return false;
+
+        return load(found);
+    }
+
+    /**
+     * the last visible version of an object, valid until the next blob is loaded.
+     * the versions of an object may start in a blob before the one holding its
+     * last version, those blobs are searched backwards.
+     *
+     * this method returns NULL if the object is missing (deleted is false then)
+     * or all of its versions are deleted (deleted is true).
+     */
+    template <class TObject>
+    const TObject *last_visible(const key_t &key, std::vector<TObject> PbfObjects::*list, bool &deleted) {
+        deleted = false;
+        if(!find(key))
+            return NULL;
+
+        for(long blob = current; ; ) {
+            const std::vector<TObject> &versions = objects.*list;
+            const TObject *found = NULL;
+            for(int i = 0, l = versions.size(); i<l; i++) {
+                if(versions[i].id == key.second) {
+                    deleted = true;
+                    if(versions[i].visible)
+                        found = &versions[i];
+                }
+            }
+            if(found) {
+                deleted = false;
+                return found;
+            }
+
+            // only a blob starting with the object may have more versions before it
+            if(blob == 0 || ranges[blob].first != key || !load(--blob))
+                return NULL;
+        }
+    }
+
+    /**
+     * join ways at their end-nodes into closed rings of coordinates.
+     *
+     * this method returns false if a ring can't be closed or a node is missing.
+     */
+    bool build_rings(int64_t relation_id, const std::vector<int64_t> &ways, std::vector<geos::geom::Geometry*> &polygons) {
+        std::vector<RingAssembler::nodelist_t> pending, rings, open;
+        for(int i = 0, l = ways.size(); i<l; i++) {
+            std::map<int64_t, std::vector<int64_t> >::const_iterator it = way_nodes.find(ways[i]);
+            if(it == way_nodes.end()) {
+                std::cerr << "way " << ways[i] << " of relation " << relation_id << " is missing in " << filename << std::endl;
+                return false;
+            }
+            if(it->second.size() >= 2)
+                pending.push_back(it->second);
+        }
+
+        RingAssembler::join(pending, rings, open);
+        if(!open.empty()) {
+            std::cerr << "relation " << relation_id << " has an unclosed ring ending at node " << open.front().back() << std::endl;
+            return false;
+        }
+
+        for(int i = 0, l = rings.size(); i<l; i++) {
+            if(rings[i].size() < 4) {
+                std::cerr << "relation " << relation_id << " has a ring of less than 3 nodes" << std::endl;
+                return false;
+            }
+
+            int64_t missing;
+            geos::geom::Geometry *poly = RingAssembler::polygon(rings[i], positions, missing);
+            if(!poly) {
+                if(missing)
+                    std::cerr << "node " << missing << " of relation " << relation_id << " is missing in " << filename << std::endl;
+                return false;
+            }
+            polygons.push_back(poly);
+        }
+
+        return true;
+    }
+
+public:
+    BoundaryReader(const std::string &filename) : filename(filename), reader(filename), current(-1) {}
+
+    // request the geometry of a relation
+    void add(int64_t relation_id) {
+        boundaries[relation_id] = Boundary();
+    }
+
+    /**
+     * read the requested relations, their ways and nodes.
+     *
+     * this method returns false if the input can't be read or a relation is missing.
+     */
+    bool read() {
+        if(!reader.is_open())
+            return false;
+
+        PbfBlockReader::BlobInfo blob;
+        while(reader.next_blob(blob)) {
+            if(blob.type == "OSMData")
+                blobs.push_back(blob);
+        }
+
+        BlobRange unknown;
+        unknown.known = false;
+        ranges.assign(blobs.size(), unknown);
+
+        if(blobs.empty()) {
+            std::cerr << "no data-blobs found in " << filename << std::endl;
+            return false;
+        }
+
+        std::vector<int64_t> wanted_ways;
+        for(std::map<int64_t, Boundary>::iterator it = boundaries.begin(); it != boundaries.end(); ++it) {
+            bool deleted;
+            const PbfRelation *relation = last_visible(key_t(RELATION, it->first), &PbfObjects::relations, deleted);
+            if(!relation) {
+                std::cerr << "relation " << it->first << (deleted ? " has no visible version in " : " is missing in ") << filename << std::endl;
+                return false;
+            }
+
+            for(int i = 0, l = relation->members.size(); i<l; i++) {
+                const PbfMember &member = relation->members[i];
+                if(member.type != 'w')
+                    continue;
+
+                if(member.role == "inner")
+                    it->second.inner.push_back(member.ref);
+                else
+                    it->second.outer.push_back(member.ref);
+                wanted_ways.push_back(member.ref);
+            }
+        }
+
+        // sorted ids visit every blob once
+        std::sort(wanted_ways.begin(), wanted_ways.end());
+        wanted_ways.erase(std::unique(wanted_ways.begin(), wanted_ways.end()), wanted_ways.end());
+
+        std::vector<int64_t> wanted_nodes;
+        for(int i = 0, l = wanted_ways.size(); i<l; i++) {
+            bool deleted;
+            const PbfWay *way = last_visible(key_t(WAY, wanted_ways[i]), &PbfObjects::ways, deleted);
+            if(deleted) {
+                std::cerr << "way " << wanted_ways[i] << " has no visible version in " << filename << std::endl;
+                return false;
+            }
+
+            // missing ways are reported when their ring is built
+            if(!way)
+                continue;
+
+            way_nodes[way->id] = way->refs;
+            wanted_nodes.insert(wanted_nodes.end(), way->refs.begin(), way->refs.end());
+        }
+
+        std::sort(wanted_nodes.begin(), wanted_nodes.end());
+        wanted_nodes.erase(std::unique(wanted_nodes.begin(), wanted_nodes.end()), wanted_nodes.end());
+
+        for(int i = 0, l = wanted_nodes.size(); i<l; i++) {
+            bool deleted;
+            const PbfNode *node = last_visible(key_t(NODE, wanted_nodes[i]), &PbfObjects::nodes, deleted);
+            if(deleted) {
+                std::cerr << "node " << wanted_nodes[i] << " has no visible version in " << filename << std::endl;
+                return false;
+            }
+
+            // missing nodes are reported when their ring is built
+            if(node)
+                positions.add(node->id, node->x, node->y);
+        }
+        positions.sort();
+
+        std::cerr << "read " << boundaries.size() << " boundary relations with " << way_nodes.size() << " ways and "
+            << positions.size() << " nodes from " << filename << std::endl;
+        return true;
+    }
+
+    /**
+     * build the multipolygon of a relation, the caller owns the returned geometry.
+     *
+     * this method returns NULL if the relation's rings can't be built.
+     */
+    geos::geom::Geometry *geometry(int64_t relation_id) {
+        std::map<int64_t, Boundary>::const_iterator it = boundaries.find(relation_id);
+        if(it == boundaries.end())
+            return NULL;
+
+        std::vector<geos::geom::Geometry*> *outer = new std::vector<geos::geom::Geometry*>();
+        std::vector<geos::geom::Geometry*> *inner = new std::vector<geos::geom::Geometry*>();
+
+        if(!build_rings(relation_id, it->second.outer, *outer) || !build_rings(relation_id, it->second.inner, *inner)) {
+            RingAssembler::destroy(outer);
+            RingAssembler::destroy(inner);
+            return NULL;
+        }
+
+        if(outer->empty()) {
+            std::cerr << "relation " << relation_id << " has no outer ring" << std::endl;
+            RingAssembler::destroy(outer);
+            RingAssembler::destroy(inner);
+            return NULL;
+        }
+
+        // the outer rings minus the inner rings, like the polygons of a .poly file
+        geos::geom::Geometry *poly = RingAssembler::difference(outer, inner);
+        if(!poly)
+            std::cerr << "error creating multipolygon of relation " << relation_id << std::endl;
+
+        return poly;
+    }
+};
+
+#endif // SPLITTER_BOUNDARY_READER_HPP
@@ -0,0 +1,799 @@
+#ifndef SPLITTER_BROADCAST_HPP
+#define SPLITTER_BROADCAST_HPP
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+
+Broadcast Input (--broadcast and --attach)
+ - a producer process reads and decodes the input once and serializes the decoded
+   objects into a ring of slots in shared memory
+ - up to 64 consumer processes, each with its own config and trackers, attach to
+   the ring and read the objects from it instead of the input file
+ - the producer waits until all --consumers have attached, at most --attach-timeout
+   seconds, then the ring runs in lockstep: a slot is only overwritten after every
+   consumer has read it
+ - the input is broadcast once per round: twice for softcut consumers, which
+   read the input twice, once for hardcut. a consumer that needs fewer rounds
+   detaches early and is not waited for any more. when all consumers detached the
+   producer stops early and succeeds, it only fails if a consumer died
+ - every round starts with a record holding the bounds of the input and ends with
+   an end record, in between the objects are sent in input order. the consumer calls
+   the handler methods in the same order as the osmium reader does
+ - what is shared is reading and decompressing the input and parsing it into
+   objects. every consumer builds its own osmium objects from the records, the
+   cut handlers take them as shared_ptrs
+ - every process holds a lock on a byte of the shared memory file, the producer
+   byte 0, consumer i byte i+1. the kernel drops it when the process dies, so
+   the others notice a crash while waiting, also when its pid was reused, and a
+   crashed process doesn't block them forever
+ - the mutex of the ring is robust, a process dying while holding it only costs
+   the others the recovery of the lock
+ - the shared memory is removed when the producer exits. a segment left behind by
+   a producer that crashed is recognized by its unlocked byte and replaced by
+   the next producer of the same name
+
+*/
+
+class BroadcastRing {
+
+public:
+    static const int max_consumers = 64;
+    static const uint32_t slot_count = 8;
+    static const uint32_t slot_size = 8*1024*1024;
+
+    enum RecordType {
+        META = 'M',
+        NODE = 'n',
+        WAY = 'w',
+        RELATION = 'r',
+        END = 'E'
+    };
+
+private:
+    struct Header {
+        char magic[8];
+        int rounds;
+        pid_t producer;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+
+        int expected;
+        int attached;
+
+        // consumers which died instead of detaching
+        int died;
+
+        // slots written by the producer, slots read by each consumer
+        uint64_t published;
+        uint64_t consumed[max_consumers];
+        bool active[max_consumers];
+        pid_t consumer[max_consumers];
+    };
+
+    std::string name;
+    bool owner;
+    size_t size;
+    Header *header;
+    char *slots;
+
+    // the shared memory file, kept open for the lock of this process on it
+    int fd;
+
+    // the number of this consumer
+    int me;
+
+    static std::string shm_name(const std::string &name) {
+        return "/osm-history-splitter-" + name;
+    }
+
+    static size_t mapping_size() {
+        return sizeof(Header) + static_cast<size_t>(slot_count) * (sizeof(uint32_t) + slot_size);
+    }
+
+    char *slot(uint64_t seq) {
+        return slots + (seq % slot_count) * (sizeof(uint32_t) + slot_size);
+    }
+
+    // a process died holding the mutex. the ring is only changed by single
+    // counters and flags under it, so the state is usable as it is
+    void recover() {
+        std::cerr << "a process died holding the lock of broadcast " << name << ", recovering it" << std::endl;
+        pthread_mutex_consistent(&header->mutex);
+    }
+
+    void lock() {
+        if(EOWNERDEAD == pthread_mutex_lock(&header->mutex))
+            recover();
+    }
+
+    // wait on the condition for at most a second, so dead processes can be noticed
+    void timed_wait() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        if(EOWNERDEAD == pthread_cond_timedwait(&header->cond, &header->mutex, &ts))
+            recover();
+    }
+
+    static struct flock byte_lock(int index) {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = index;
+        fl.l_len = 1;
+        return fl;
+    }
+
+    // lock the byte of this process, it's held as long as fd is open
+    bool hold(int index) {
+        struct flock fl = byte_lock(index);
+        if(0 != fcntl(fd, F_OFD_SETLK, &fl)) {
+            std::cerr << "unable to lock broadcast " << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // is the byte locked by another process, a process that can't be checked counts as alive
+    static bool alive(int fd, int index) {
+        struct flock fl = byte_lock(index);
+        if(0 != fcntl(fd, F_OFD_GETLK, &fl))
+            return true;
+        return fl.l_type != F_UNLCK;
+    }
+
+    static int producer_byte() {
+        return 0;
+    }
+
+    static int consumer_byte(int consumer) {
+        return 1 + consumer;
+    }
+
+    // called with the mutex held
+    void drop_dead_consumers() {
+        for(int i = 0; i < header->attached; i++) {
+            if(header->active[i] && !alive(fd, consumer_byte(i))) {
+                std::cerr << "consumer " << header->consumer[i] << " of broadcast " << name << " died" << std::endl;
+                header->active[i] = false;
+                header->died++;
+            }
+        }
+    }
+
+    // called with the mutex held, the slot the producer may write next is free
+    bool slot_free() const {
+        for(int i = 0; i < header->attached; i++) {
+            if(header->active[i] && header->consumed[i] + slot_count <= header->published)
+                return false;
+        }
+        return true;
+    }
+
+public:
+    BroadcastRing(const std::string &name) : name(name), owner(false), size(mapping_size()), header(NULL), slots(NULL), fd(-1), me(-1) {}
+
+    ~BroadcastRing() {
+        detach();
+    }
+
+    // stop taking part in the broadcast, the producer doesn't wait for this consumer any more
+    void detach() {
+        if(header) {
+            if(me >= 0) {
+                lock();
+                header->active[me] = false;
+                pthread_cond_broadcast(&header->cond);
+                pthread_mutex_unlock(&header->mutex);
+            }
+
+            munmap(header, size);
+            header = NULL;
+        }
+
+        // closing the file drops the lock of this process
+        if(fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        if(owner) {
+            shm_unlink(shm_name(name).c_str());
+            owner = false;
+        }
+    }
+
+    /**
+     * remove the shared memory of an earlier producer of the name which died
+     * without removing it.
+     *
+     * this method returns false if the memory belongs to a running producer
+     * or can't be checked.
+     */
+    bool remove_stale() {
+        int old_fd = shm_open(shm_name(name).c_str(), O_RDWR, 0600);
+        if(old_fd < 0)
+            return errno == ENOENT;
+
+        struct stat st;
+        void *mem = MAP_FAILED;
+        if(0 == fstat(old_fd, &st) && static_cast<size_t>(st.st_size) >= size)
+            mem = mmap(NULL, size, PROT_READ, MAP_SHARED, old_fd, 0);
+        bool running = alive(old_fd, producer_byte());
+        close(old_fd);
+
+        if(mem == MAP_FAILED) {
+            std::cerr << "broadcast " << name << " exists but is not initialized, remove /dev/shm" << shm_name(name) << " if no producer is starting" << std::endl;
+            return false;
+        }
+
+        const Header *old = static_cast<const Header *>(mem);
+        bool initialized = 0 == memcmp(old->magic, "OSHRING1", 8);
+        pid_t producer = old->producer;
+        munmap(mem, size);
+
+        if(!initialized) {
+            std::cerr << "broadcast " << name << " exists but is not initialized, remove /dev/shm" << shm_name(name) << " if no producer is starting" << std::endl;
+            return false;
+        }
+        if(running) {
+            std::cerr << "broadcast " << name << " is run by process " << producer << std::endl;
+            return false;
+        }
+
+        std::cerr << "removing broadcast " << name << " left behind by process " << producer << std::endl;
+        return 0 == shm_unlink(shm_name(name).c_str()) || errno == ENOENT;
+    }
+
+    /**
+     * create the ring for a number of consumers and wait until all of them
+     * attached, at most timeout seconds.
+     *
+     * this method returns false if the shared memory can't be created or not
+     * all consumers attached in time.
+     */
+    bool create(int consumers, int rounds, int timeout) {
+        if(consumers < 1 || consumers > max_consumers) {
+            std::cerr << "a broadcast needs between 1 and " << max_consumers << " consumers" << std::endl;
+            return false;
+        }
+
+        fd = shm_open(shm_name(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0 && errno == EEXIST && remove_stale())
+            fd = shm_open(shm_name(name).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if(fd < 0) {
+            std::cerr << "unable to create broadcast " << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        owner = true;
+
+        if(0 != ftruncate(fd, size)) {
+            std::cerr << "unable to size broadcast " << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if(!hold(producer_byte()))
+            return false;
+
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mem == MAP_FAILED) {
+            std::cerr << "unable to map broadcast " << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        header = static_cast<Header *>(mem);
+        slots = static_cast<char *>(mem) + sizeof(Header);
+
+        pthread_mutexattr_t mattr;
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->mutex, &mattr);
+        pthread_mutexattr_destroy(&mattr);
+
+        pthread_condattr_t cattr;
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&header->cond, &cattr);
+        pthread_condattr_destroy(&cattr);
+
+        header->rounds = rounds;
+        header->producer = getpid();
+        header->expected = consumers;
+        header->attached = 0;
+        header->died = 0;
+        header->published = 0;
+
+        // the magic is written last, consumers wait for it
+        __sync_synchronize();
+        memcpy(header->magic, "OSHRING1", 8);
+
+        std::cerr << "waiting for " << consumers << " consumers to attach to broadcast " << name << std::endl;
+        time_t deadline = time(NULL) + timeout;
+        lock();
+        while(header->attached < header->expected && time(NULL) < deadline) {
+            timed_wait();
+            drop_dead_consumers();
+        }
+
+        int attached = header->attached;
+
+        // consumers still coming are turned away
+        header->expected = attached;
+        pthread_mutex_unlock(&header->mutex);
+
+        if(attached < consumers) {
+            std::cerr << "only " << attached << " of " << consumers << " consumers attached to broadcast " << name << " within " << timeout << " seconds" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // the number of consumers which died instead of detaching
+    int died() {
+        lock();
+        int n = header->died;
+        pthread_mutex_unlock(&header->mutex);
+        return n;
+    }
+
+    /**
+     * attach to the ring of a producer as the next consumer, waiting for it to
+     * be created. the consumer needs the input broadcast rounds times.
+     *
+     * this method returns false if the ring can't be attached.
+     */
+    bool attach(int rounds) {
+        fd = -1;
+        for(int i = 0; i < 600 && fd < 0; i++) {
+            fd = shm_open(shm_name(name).c_str(), O_RDWR, 0600);
+            if(fd < 0) {
+                if(errno != ENOENT) break;
+                if(i == 0) std::cerr << "waiting for broadcast " << name << std::endl;
+                usleep(100*1000);
+            }
+        }
+        if(fd < 0) {
+            std::cerr << "unable to attach to broadcast " << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        // the producer sizes the memory before it initializes it
+        struct stat st;
+        while(0 == fstat(fd, &st) && static_cast<size_t>(st.st_size) < size) {
+            usleep(10*1000);
+        }
+
+        void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mem == MAP_FAILED) {
+            std::cerr << "unable to map broadcast " << name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        header = static_cast<Header *>(mem);
+        slots = static_cast<char *>(mem) + sizeof(Header);
+
+        for(int i = 0; i < 6000 && 0 != memcmp(header->magic, "OSHRING1", 8); i++) {
+            usleep(10*1000);
+        }
+        if(0 != memcmp(header->magic, "OSHRING1", 8)) {
+            std::cerr << "broadcast " << name << " was never initialized by its producer" << std::endl;
+            munmap(header, size);
+            header = NULL;
+            return false;
+        }
+        __sync_synchronize();
+
+        lock();
+        bool ok = true;
+        if(!alive(fd, producer_byte())) {
+            std::cerr << "producer " << header->producer << " of broadcast " << name << " died" << std::endl;
+            ok = false;
+        } else if(header->rounds < rounds) {
+            std::cerr << "broadcast " << name << " sends the input " << header->rounds << " times, but " << rounds << " are needed" << std::endl;
+            ok = false;
+        } else if(header->attached >= header->expected) {
+            std::cerr << "broadcast " << name << " already has all its " << header->expected << " consumers" << std::endl;
+            ok = false;
+        } else if(!hold(consumer_byte(header->attached))) {
+            ok = false;
+        } else {
+            me = header->attached++;
+            header->consumed[me] = 0;
+            header->active[me] = true;
+            header->consumer[me] = getpid();
+            pthread_cond_broadcast(&header->cond);
+        }
+        pthread_mutex_unlock(&header->mutex);
+        return ok;
+    }
+
+    /**
+     * the producer waits for the next free slot and returns its buffer.
+     *
+     * this method returns NULL if no consumer is left.
+     */
+    char *next_free() {
+        lock();
+        while(!slot_free()) {
+            timed_wait();
+            drop_dead_consumers();
+        }
+
+        bool any = false;
+        for(int i = 0; i < header->attached; i++) {
+            if(header->active[i]) any = true;
+        }
+        pthread_mutex_unlock(&header->mutex);
+
+        return any ? slot(header->published) + sizeof(uint32_t) : NULL;
+    }
+
+    // the producer publishes the slot returned by next_free() with len bytes
+    void publish(uint32_t len) {
+        memcpy(slot(header->published), &len, sizeof(len));
+
+        lock();
+        header->published++;
+        pthread_cond_broadcast(&header->cond);
+        pthread_mutex_unlock(&header->mutex);
+    }
+
+    /**
+     * the consumer waits for the next slot and returns its buffer and length.
+     *
+     * this method returns NULL if the producer died.
+     */
+    const char *next_published(uint32_t &len) {
+        lock();
+        while(header->consumed[me] >= header->published) {
+            timed_wait();
+            if(header->consumed[me] >= header->published && !alive(fd, producer_byte())) {
+                pthread_mutex_unlock(&header->mutex);
+                std::cerr << "producer of broadcast " << name << " died" << std::endl;
+                return NULL;
+            }
+        }
+        pthread_mutex_unlock(&header->mutex);
+
+        const char *s = slot(header->consumed[me]);
+        memcpy(&len, s, sizeof(len));
+        return s + sizeof(uint32_t);
+    }
+
+    // the consumer is done with the slot returned by next_published()
+    void release() {
+        lock();
+        header->consumed[me]++;
+        pthread_cond_broadcast(&header->cond);
+        pthread_mutex_unlock(&header->mutex);
+    }
+};
+
+// writes and reads the values of the records, in the byte order of the machine
+class BroadcastCodec {
+
+private:
+    std::string &buf;
+
+public:
+    BroadcastCodec(std::string &buf) : buf(buf) {}
+
+    template <class T> void put(T value) {
+        buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void put_string(const char *s) {
+        uint32_t len = s ? strlen(s) : 0;
+        put(len);
+        buf.append(s ? s : "", len);
+    }
+
+    template <class T> static T get(const char *&pos) {
+        T value;
+        memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+
+    static std::string get_string(const char *&pos) {
+        uint32_t len = get<uint32_t>(pos);
+        std::string s(pos, len);
+        pos += len;
+        return s;
+    }
+};
+
+// decodes the input on the producer side and sends the objects to the ring
+class BroadcastProducer : public Osmium::Handler::Base {
+
+private:
+    BroadcastRing *ring;
+
+    // records collected for the next slot
+    std::string pending;
+
+    // no consumer left, the rest of the input is skipped
+    bool stopped;
+
+    void flush() {
+        if(pending.empty() || stopped)
+            return;
+
+        char *slot = ring->next_free();
+        if(!slot) {
+            std::cerr << "no consumer left, stopping the broadcast" << std::endl;
+            stopped = true;
+            pending.clear();
+            return;
+        }
+
+        memcpy(slot, pending.data(), pending.size());
+        ring->publish(pending.size());
+        pending.clear();
+    }
+
+    // start a record, sending the collected ones if the record might not fit any more
+    void begin(BroadcastRing::RecordType type, size_t estimate) {
+        if(pending.size() + estimate > BroadcastRing::slot_size)
+            flush();
+        if(stopped)
+            pending.clear();
+        pending.push_back(static_cast<char>(type));
+    }
+
+    // the record just written has to fit into a slot
+    void end() {
+        if(pending.size() > BroadcastRing::slot_size) {
+            std::cerr << "an object is too large for a broadcast slot of " << BroadcastRing::slot_size << " bytes" << std::endl;
+            exit(1);
+        }
+    }
+
+    void put_object(BroadcastCodec &codec, const Osmium::OSM::Object &object) {
+        codec.put<int64_t>(object.id());
+        codec.put<uint32_t>(object.version());
+        codec.put<int64_t>(object.changeset());
+        codec.put<int64_t>(object.uid());
+        codec.put<int64_t>(object.timestamp());
+        codec.put<uint8_t>(object.visible());
+        codec.put_string(object.user());
+
+        codec.put<uint32_t>(object.tags().size());
+        for(Osmium::OSM::TagList::const_iterator it = object.tags().begin(); it != object.tags().end(); ++it) {
+            codec.put_string(it->key());
+            codec.put_string(it->value());
+        }
+    }
+
+    static size_t estimate_tags(const Osmium::OSM::Object &object) {
+        size_t bytes = 256;
+        for(Osmium::OSM::TagList::const_iterator it = object.tags().begin(); it != object.tags().end(); ++it) {
+            bytes += 8 + strlen(it->key()) + strlen(it->value());
+        }
+        return bytes;
+    }
+
+public:
+    BroadcastProducer(BroadcastRing *ring) : ring(ring), stopped(false) {}
+
+    bool abandoned() const {
+        return stopped;
+    }
+
+    void init(Osmium::OSM::Meta& meta) {
+        BroadcastCodec codec(pending);
+        begin(BroadcastRing::META, 64);
+
+        Osmium::OSM::Bounds &bounds = meta.bounds();
+        codec.put<uint8_t>(bounds.defined());
+        codec.put<int32_t>(bounds.defined() ? bounds.bottom_left().x() : 0);
+        codec.put<int32_t>(bounds.defined() ? bounds.bottom_left().y() : 0);
+        codec.put<int32_t>(bounds.defined() ? bounds.top_right().x() : 0);
+        codec.put<int32_t>(bounds.defined() ? bounds.top_right().y() : 0);
+        codec.put<uint8_t>(meta.has_multiple_object_versions());
+    }
+
+    void node(const shared_ptr<Osmium::OSM::Node const>& node) {
+        BroadcastCodec codec(pending);
+        begin(BroadcastRing::NODE, estimate_tags(*node));
+        put_object(codec, *node);
+
+        const Osmium::OSM::Position pos = node->position();
+        codec.put<uint8_t>(pos.defined());
+        codec.put<int32_t>(pos.defined() ? pos.x() : 0);
+        codec.put<int32_t>(pos.defined() ? pos.y() : 0);
+        end();
+    }
+
+    void way(const shared_ptr<Osmium::OSM::Way const>& way) {
+        BroadcastCodec codec(pending);
+        begin(BroadcastRing::WAY, estimate_tags(*way) + 8 * way->nodes().size());
+        put_object(codec, *way);
+
+        codec.put<uint32_t>(way->nodes().size());
+        for(Osmium::OSM::WayNodeList::const_iterator it = way->nodes().begin(); it != way->nodes().end(); ++it) {
+            codec.put<int64_t>(it->ref());
+        }
+        end();
+    }
+
+    void relation(const shared_ptr<Osmium::OSM::Relation const>& relation) {
+        size_t estimate = estimate_tags(*relation);
+        for(Osmium::OSM::RelationMemberList::const_iterator it = relation->members().begin(); it != relation->members().end(); ++it) {
+            estimate += 16 + strlen(it->role());
+        }
+
+        BroadcastCodec codec(pending);
+        begin(BroadcastRing::RELATION, estimate);
+        put_object(codec, *relation);
+
+        codec.put<uint32_t>(relation->members().size());
+        for(Osmium::OSM::RelationMemberList::const_iterator it = relation->members().begin(); it != relation->members().end(); ++it) {
+            codec.put<char>(it->type());
+            codec.put<int64_t>(it->ref());
+            codec.put_string(it->role());
+        }
+        end();
+    }
+
+    // the end of a round
+    void final() {
+        begin(BroadcastRing::END, 1);
+        flush();
+    }
+};
+
+// reads the objects of one round from the ring and calls a handler the way the osmium reader does
+class BroadcastInput {
+
+private:
+    template <class TObject>
+    static void get_object(const char *&pos, TObject &object) {
+        object.id(BroadcastCodec::get<int64_t>(pos));
+        object.version(BroadcastCodec::get<uint32_t>(pos));
+        object.changeset(BroadcastCodec::get<int64_t>(pos));
+        object.uid(BroadcastCodec::get<int64_t>(pos));
+        object.timestamp(static_cast<time_t>(BroadcastCodec::get<int64_t>(pos)));
+        object.visible(BroadcastCodec::get<uint8_t>(pos) != 0);
+        object.user(BroadcastCodec::get_string(pos).c_str());
+
+        uint32_t tags = BroadcastCodec::get<uint32_t>(pos);
+        for(uint32_t i = 0; i < tags; i++) {
+            std::string key = BroadcastCodec::get_string(pos);
+            std::string value = BroadcastCodec::get_string(pos);
+            object.tags().add(key.c_str(), value.c_str());
+        }
+    }
+
+    static Osmium::OSM::Position position(int32_t x, int32_t y) {
+        return Osmium::OSM::Position(Osmium::OSM::Position::fix_to_double(x), Osmium::OSM::Position::fix_to_double(y));
+    }
+
+    // call the after- and before-methods when the type of the objects changes
+    template <class THandler>
+    static void switch_type(THandler &handler, char &last, char type) {
+        if(last == type)
+            return;
+
+        switch(last) {
+            case BroadcastRing::NODE: handler.after_nodes(); break;
+            case BroadcastRing::WAY: handler.after_ways(); break;
+            case BroadcastRing::RELATION: handler.after_relations(); break;
+        }
+        switch(type) {
+            case BroadcastRing::NODE: handler.before_nodes(); break;
+            case BroadcastRing::WAY: handler.before_ways(); break;
+            case BroadcastRing::RELATION: handler.before_relations(); break;
+        }
+        last = type;
+    }
+
+public:
+    /**
+     * read one round of the broadcast into a handler.
+     *
+     * this method returns false if the producer died.
+     */
+    template <class THandler>
+    static bool read(BroadcastRing &ring, THandler &handler) {
+        char last = '\0';
+
+        while(1) {
+            uint32_t len;
+            const char *pos = ring.next_published(len);
+            if(!pos)
+                return false;
+
+            const char *end = pos + len;
+            while(pos < end) {
+                char type = *pos++;
+                switch(type) {
+                    case BroadcastRing::META: {
+                        bool defined = BroadcastCodec::get<uint8_t>(pos) != 0;
+                        int32_t blx = BroadcastCodec::get<int32_t>(pos), bly = BroadcastCodec::get<int32_t>(pos);
+                        int32_t trx = BroadcastCodec::get<int32_t>(pos), try_ = BroadcastCodec::get<int32_t>(pos);
+                        bool history = BroadcastCodec::get<uint8_t>(pos) != 0;
+
+                        Osmium::OSM::Bounds bounds;
+                        if(defined)
+                            bounds.extend(position(blx, bly)).extend(position(trx, try_));
+
+                        Osmium::OSM::Meta meta(bounds);
+                        meta.has_multiple_object_versions(history);
+                        handler.init(meta);
+                        break;
+                    }
+                    case BroadcastRing::NODE: {
+                        switch_type(handler, last, type);
+                        shared_ptr<Osmium::OSM::Node> node(new Osmium::OSM::Node());
+                        get_object(pos, *node);
+
+                        bool defined = BroadcastCodec::get<uint8_t>(pos) != 0;
+                        int32_t x = BroadcastCodec::get<int32_t>(pos), y = BroadcastCodec::get<int32_t>(pos);
+                        if(defined)
+                            node->position(position(x, y));
+
+                        handler.node(shared_ptr<Osmium::OSM::Node const>(node));
+                        break;
+                    }
+                    case BroadcastRing::WAY: {
+                        switch_type(handler, last, type);
+                        shared_ptr<Osmium::OSM::Way> way(new Osmium::OSM::Way());
+                        get_object(pos, *way);
+
+                        uint32_t count = BroadcastCodec::get<uint32_t>(pos);
+                        for(uint32_t i = 0; i < count; i++) {
+                            way->add_node(BroadcastCodec::get<int64_t>(pos));
+                        }
+
+                        handler.way(shared_ptr<Osmium::OSM::Way const>(way));
+                        break;
+                    }
+                    case BroadcastRing::RELATION: {
+                        switch_type(handler, last, type);
+                        shared_ptr<Osmium::OSM::Relation> relation(new Osmium::OSM::Relation());
+                        get_object(pos, *relation);
+
+                        uint32_t count = BroadcastCodec::get<uint32_t>(pos);
+                        for(uint32_t i = 0; i < count; i++) {
+                            char member_type = BroadcastCodec::get<char>(pos);
+                            int64_t ref = BroadcastCodec::get<int64_t>(pos);
+                            std::string role = BroadcastCodec::get_string(pos);
+                            relation->add_member(member_type, ref, role.c_str());
+                        }
+
+                        handler.relation(shared_ptr<Osmium::OSM::Relation const>(relation));
+                        break;
+                    }
+                    case BroadcastRing::END:
+                        switch_type(handler, last, '\0');
+                        ring.release();
+                        handler.final();
+                        return true;
+                    default:
+                        std::cerr << "unknown record in broadcast slot" << std::endl;
+                        exit(1);
+                }
+            }
+            ring.release();
+        }
+    }
+};
+
+#endif // SPLITTER_BROADCAST_HPP
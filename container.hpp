@@ -0,0 +1,397 @@
+#ifndef SPLITTER_CONTAINER_HPP
+#define SPLITTER_CONTAINER_HPP
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "tempfiles.hpp"
+
+/*
+
+Container Output (--container)
+ - instead of one output file per extract, the compressed blocks of all extracts
+   are appended to one container file, so thousands of tiny extracts don't need
+   thousands of open output files and the disk sees one sequential stream
+ - every block is a record tagged with the stream of its extract:
+   - open:  starts a stream, the payload is the name of the output file
+   - block: the next compressed block of the stream
+   - close: the stream is complete
+ - a record is appended with a single write to a file opened with O_APPEND, so the
+   passes of the scheduler can share one container
+ - a stream is numbered by the offset of its open record in the container, which
+   no other record of any process can have. the records of many streams are
+   interleaved in the order their blocks were written
+
+Demux (--demux)
+ - scans the record headers of the container, skipping the payloads
+ - writes one output after the other by copying the blocks of its stream in large
+   reads and writes, so only one output file is open at any time. blocks close to
+   each other are read with a single read, the records of other streams between
+   them are dropped in memory
+ - streams without a close record are reported and not written
+
+the blocks are complete pbf-blobs, bzip2-streams or gzip-members, so the
+concatenated blocks of a stream are the same file the splitter would have written.
+
+*/
+
+class Container {
+
+public:
+    enum RecordType {
+        OPEN = 'O',
+        BLOCK = 'B',
+        CLOSE = 'C'
+    };
+
+    // type, 3 bytes padding, 4 bytes length, 8 bytes stream (0 in open records), all big-endian
+    static const size_t header_size = 16;
+
+    static const char *magic() {
+        return "OSHCONT2";
+    }
+
+    static void encode_header(char *buf, char type, uint32_t len, uint64_t stream) {
+        memset(buf, 0, header_size);
+        buf[0] = type;
+        for(int i = 0; i < 4; i++) {
+            buf[4+i] = static_cast<char>((len >> (8 * (3-i))) & 0xff);
+        }
+        for(int i = 0; i < 8; i++) {
+            buf[8+i] = static_cast<char>((stream >> (8 * (7-i))) & 0xff);
+        }
+    }
+
+    static void decode_header(const char *buf, char &type, uint32_t &len, uint64_t &stream) {
+        const unsigned char *b = reinterpret_cast<const unsigned char *>(buf);
+        type = buf[0];
+        len = 0;
+        for(int i = 0; i < 4; i++) {
+            len = (len << 8) | b[4+i];
+        }
+        stream = 0;
+        for(int i = 0; i < 8; i++) {
+            stream = (stream << 8) | b[8+i];
+        }
+    }
+};
+
+// appends the records of all sinks to the container
+class ContainerWriter {
+
+private:
+    std::string filename;
+    int fd;
+    pthread_mutex_t mutex;
+
+public:
+    /**
+     * create or truncate the container and write its magic, before any
+     * pass is started.
+     *
+     * this method returns false if the container can't be written.
+     */
+    static bool create(const std::string &filename) {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            std::cerr << "unable to create container " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        bool ok = write(fd, Container::magic(), 8) == 8;
+        if(close(fd) != 0 || !ok) {
+            std::cerr << "error writing container " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    ContainerWriter(const std::string &filename) : filename(filename) {
+        fd = open(filename.c_str(), O_WRONLY | O_APPEND);
+        if(fd < 0) {
+            std::cerr << "unable to open container " << filename << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~ContainerWriter() {
+        if(close(fd) != 0) {
+            std::cerr << "error closing container " << filename << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        pthread_mutex_destroy(&mutex);
+    }
+
+    /**
+     * start a stream for an output file, its number is the offset of its open
+     * record, so it is unique across all passes writing to the container.
+     */
+    uint64_t open_stream(const std::string &name) {
+        return append(Container::OPEN, 0, name);
+    }
+
+    /**
+     * append one record with a single write, so records of other processes
+     * can't interleave with it.
+     *
+     * this method returns the offset of the record in the container.
+     */
+    uint64_t append(Container::RecordType type, uint64_t stream, const std::string &data) {
+        char header[Container::header_size];
+        Container::encode_header(header, type, data.size(), stream);
+
+        struct iovec iov[2];
+        iov[0].iov_base = header;
+        iov[0].iov_len = Container::header_size;
+        iov[1].iov_base = const_cast<char *>(data.data());
+        iov[1].iov_len = data.size();
+
+        // the descriptor is this process' own, after the write it points behind the record
+        pthread_mutex_lock(&mutex);
+        ssize_t w;
+        do {
+            w = writev(fd, iov, 2);
+        } while(w < 0 && errno == EINTR);
+        off_t end = w < 0 ? -1 : lseek(fd, 0, SEEK_CUR);
+        pthread_mutex_unlock(&mutex);
+
+        if(w != static_cast<ssize_t>(Container::header_size + data.size()) || end < 0) {
+            std::cerr << "error writing to container " << filename << ": " << (w < 0 || end < 0 ? strerror(errno) : "short write") << std::endl;
+            TempFiles::fail_thread();
+        }
+        return end - w;
+    }
+};
+
+// splits a container into the output files of its streams
+class ContainerDemux {
+
+private:
+    struct Block {
+        off_t offset;
+        uint32_t size;
+    };
+
+    struct Stream {
+        std::string name;
+        std::vector<Block> blocks;
+        bool closed;
+
+        Stream() : closed(false) {}
+    };
+
+    // bytes copied per read and write
+    static const size_t copy_size = 8*1024*1024;
+
+    // records of other streams up to this size between two blocks are read along
+    static const off_t max_gap = 64*1024;
+
+    std::string filename;
+    int fd;
+
+    std::map<uint64_t, Stream> streams;
+
+    // streams in the order of their open records
+    std::vector<uint64_t> order;
+
+    bool read_at(char *buf, size_t len, off_t offset) {
+        size_t pos = 0;
+        while(pos < len) {
+            ssize_t r = pread(fd, buf + pos, len - pos, offset + pos);
+            if(r < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "error reading container " << filename << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            if(r == 0) {
+                std::cerr << "container " << filename << " is truncated" << std::endl;
+                return false;
+            }
+            pos += r;
+        }
+        return true;
+    }
+
+    static bool write_full(int out, const char *buf, size_t len) {
+        size_t pos = 0;
+        while(pos < len) {
+            ssize_t w = write(out, buf + pos, len - pos);
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                return false;
+            }
+            pos += w;
+        }
+        return true;
+    }
+
+    bool scan() {
+        off_t size = lseek(fd, 0, SEEK_END);
+
+        char buf[Container::header_size];
+        if(size < 8 || !read_at(buf, 8, 0) || 0 != memcmp(buf, Container::magic(), 8)) {
+            std::cerr << filename << " is no container" << std::endl;
+            return false;
+        }
+
+        off_t offset = 8;
+        while(offset < size) {
+            if(offset + static_cast<off_t>(Container::header_size) > size || !read_at(buf, Container::header_size, offset)) {
+                std::cerr << "container " << filename << " ends within a record" << std::endl;
+                return false;
+            }
+
+            char type;
+            uint32_t len;
+            uint64_t stream;
+            Container::decode_header(buf, type, len, stream);
+            off_t record = offset;
+            offset += Container::header_size;
+
+            if(offset + static_cast<off_t>(len) > size) {
+                std::cerr << "container " << filename << " ends within a record" << std::endl;
+                return false;
+            }
+
+            switch(type) {
+                case Container::OPEN: {
+                    std::string name(len, '\0');
+                    if(len > 0 && !read_at(&name[0], len, offset))
+                        return false;
+
+                    streams[record].name = name;
+                    order.push_back(record);
+                    break;
+                }
+                case Container::BLOCK: {
+                    Block block;
+                    block.offset = offset;
+                    block.size = len;
+                    streams[stream].blocks.push_back(block);
+                    break;
+                }
+                case Container::CLOSE:
+                    streams[stream].closed = true;
+                    break;
+                default:
+                    std::cerr << "unknown record type in container " << filename << " at offset " << (offset - Container::header_size) << std::endl;
+                    return false;
+            }
+
+            offset += len;
+        }
+        return true;
+    }
+
+    // copy the blocks of a stream into its output, neighbouring blocks are read together
+    bool write_stream(const Stream &s, std::vector<char> &buf) {
+        int out = open(s.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(out < 0) {
+            std::cerr << "unable to open output file " << s.name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        size_t filled = 0;
+        for(int i = 0, l = s.blocks.size(); i<l; ) {
+            if(filled + s.blocks[i].size > buf.size()) {
+                if(!write_full(out, &buf[0], filled)) {
+                    std::cerr << "error writing to " << s.name << ": " << strerror(errno) << std::endl;
+                    close(out);
+                    return false;
+                }
+                filled = 0;
+
+                if(s.blocks[i].size > buf.size())
+                    buf.resize(s.blocks[i].size);
+            }
+
+            // the run of blocks read together, from start to end
+            off_t start = s.blocks[i].offset;
+            off_t end = start + s.blocks[i].size;
+            int next = i + 1;
+            while(next < l && s.blocks[next].offset - end <= max_gap &&
+                    static_cast<size_t>(s.blocks[next].offset + s.blocks[next].size - start) <= buf.size() - filled) {
+                end = s.blocks[next].offset + s.blocks[next].size;
+                next++;
+            }
+
+            if(!read_at(&buf[filled], end - start, start)) {
+                close(out);
+                return false;
+            }
+
+            // move the blocks together over the records in between
+            for(; i < next; i++) {
+                memmove(&buf[filled], &buf[filled + (s.blocks[i].offset - start)], s.blocks[i].size);
+                filled += s.blocks[i].size;
+                start += s.blocks[i].size;
+            }
+        }
+
+        if((filled > 0 && !write_full(out, &buf[0], filled)) || close(out) != 0) {
+            std::cerr << "error writing to " << s.name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    ContainerDemux(const std::string &filename) : filename(filename), fd(-1) {}
+
+    ~ContainerDemux() {
+        if(fd >= 0)
+            close(fd);
+    }
+
+    /**
+     * write the output files of all complete streams.
+     *
+     * this method returns false if the container can't be read, an
+     * output can't be written or a stream is incomplete.
+     */
+    bool run() {
+        fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0) {
+            std::cerr << "unable to open container " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if(!scan())
+            return false;
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        bool ok = true;
+        int written = 0;
+        std::vector<char> buf(copy_size);
+        for(int i = 0, l = order.size(); i<l; i++) {
+            const Stream &s = streams[order[i]];
+            if(!s.closed) {
+                std::cerr << "output " << s.name << " is incomplete in the container, not writing it" << std::endl;
+                ok = false;
+                continue;
+            }
+
+            if(!write_stream(s, buf))
+                return false;
+            written++;
+        }
+
+        std::cerr << "wrote " << written << " of " << order.size() << " outputs from " << filename << std::endl;
+        return ok;
+    }
+};
+
+#endif // SPLITTER_CONTAINER_HPP
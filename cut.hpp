@@ -1,11 +1,196 @@
 #ifndef SPLITTER_CUT_HPP
 #define SPLITTER_CUT_HPP
 
+#include <algorithm>
+#include <sstream>
 #include <geos/io/WKTWriter.h>
 #include <osmium/handler/progress.hpp>
 #include <osmium/output.hpp>
 #include "geometryreader.hpp"
 #include "growing_bitset.hpp"
+#include "prepared_polygon.hpp"
+#include "object_filter.hpp"
+#include "parallel_compression.hpp"
+#include "shards.hpp"
+#include "watchdog.hpp"
+
+// compile-time debug switches for the cut handlers; main() picks one of them
+// once, so the release instantiation carries no logging branches at all
+struct DebugOn {
+    static const bool enabled = true;
+};
+
+struct DebugOff {
+    static const bool enabled = false;
+};
+
+// options given on a config line after the extract specification
+class ExtractOptions {
+
+public:
+    static const int DEFAULT_COMPRESSION = -1;
+
+    // compression level of the output: DEFAULT_COMPRESSION lets the codec decide,
+    // 0 writes uncompressed pbf-blobs, 1-9 are zlib or bzip2 levels
+    int compression_level;
+
+    // test polygons with the PreparedPolygon instead of the geos locator
+    bool prepared_locator;
+
+    // object types and tags to write
+    ObjectFilter filter;
+
+    // the file this extract is cut from instead of the input, usually the
+    // output of another extract of the same config (used by the scheduler)
+    std::string from;
+
+    // tracker memory of this extract in MB as measured by an earlier run,
+    // 0 lets the scheduler estimate it
+    size_t memory;
+
+    // the file the ways are written to with the locations of their nodes, empty for none
+    std::string locations;
+
+    // number of output shards with equal object counts, 0 for a single output
+    int shards;
+
+    // size of the output shards in MB, 0 for a single output
+    size_t shard_size;
+
+    ExtractOptions() : compression_level(DEFAULT_COMPRESSION), prepared_locator(false), memory(0), shards(0), shard_size(0) {}
+
+    // parse a single key=value option
+    bool parse(const char *option) {
+        const char *value = strchr(option, '=');
+        if(!value) {
+            std::cerr << "option " << option << " is not of the form key=value" << std::endl;
+            return false;
+        }
+
+        std::string key(option, value - option);
+        value++;
+
+        if(key == "compression")
+            return parse_compression(value);
+
+        if(key == "types")
+            return filter.parse_types(value);
+
+        if(key == "filter")
+            return filter.parse_tags(value);
+
+        if(key == "from") {
+            from = value;
+            return true;
+        }
+
+        if(key == "locations") {
+            if(!*value) {
+                std::cerr << "locations= needs a file name" << std::endl;
+                return false;
+            }
+            locations = value;
+            return true;
+        }
+
+        if(key == "shards") {
+            char *end;
+            shards = strtol(value, &end, 10);
+            if(*end || shards < 1) {
+                std::cerr << "shards=" << value << " is not a number of shards" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        if(key == "shard-size") {
+            char *end;
+            shard_size = strtoul(value, &end, 10);
+            if(*end || shard_size == 0) {
+                std::cerr << "shard-size=" << value << " is not a size in MB" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        if(key == "memory") {
+            char *end;
+            memory = strtoul(value, &end, 10);
+            if(*end || memory == 0) {
+                std::cerr << "memory=" << value << " is not a size in MB" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        if(key == "locator") {
+            if(0 == strcmp(value, "geos")) {
+                prepared_locator = false;
+                return true;
+            }
+            if(0 == strcmp(value, "prepared")) {
+                prepared_locator = true;
+                return true;
+            }
+            std::cerr << "unknown locator " << value << ", use geos or prepared" << std::endl;
+            return false;
+        }
+
+        std::cerr << "unknown option " << key << std::endl;
+        return false;
+    }
+
+    // check the options against the output file of the extract
+    bool check(const std::string &name) const {
+        CompressionJob::Format format;
+        std::string plain_name;
+
+        if(compression_level != DEFAULT_COMPRESSION) {
+            if(!CompressingSink::detect_format(name, format, plain_name)) {
+                std::cerr << "output " << name << " is not compressed, compression can't be selected" << std::endl;
+                return false;
+            }
+
+            if(compression_level == 0 && format != CompressionJob::PBF_BLOB) {
+                std::cerr << "output " << name << ": only .pbf outputs can be written uncompressed" << std::endl;
+                return false;
+            }
+        }
+
+        if(shards > 0 && shard_size > 0) {
+            std::cerr << "output " << name << ": use either shards= or shard-size=" << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    bool parse_compression(const char *value) {
+        if(0 == strcmp(value, "none")) {
+            compression_level = 0;
+            return true;
+        }
+
+        if(0 == strcmp(value, "default")) {
+            compression_level = DEFAULT_COMPRESSION;
+            return true;
+        }
+
+        if(value[0] >= '1' && value[0] <= '9' && value[1] == '\0') {
+            compression_level = value[0] - '0';
+            return true;
+        }
+
+        if(0 == strcmp(value, "lz4") || 0 == strcmp(value, "zstd")) {
+            std::cerr << "compression " << value << " can't be read by the osmium pbf-reader, use none or a zlib level 1-9 instead" << std::endl;
+            return false;
+        }
+
+        std::cerr << "unknown compression " << value << ", use none, default or a level 1-9" << std::endl;
+        return false;
+    }
+};
 
 // information about a single extract
 class ExtractInfo {
@@ -13,89 +198,379 @@ class ExtractInfo {
 public:
     enum ExtractMode {
         LOCATOR = 1,
-        BOUNDS = 2
+        BOUNDS = 2,
+        PREPARED = 3,
+        GRID = 4
     };
 
     std::string name;
+    unsigned int id;
+    ExtractOptions options;
     geos::algorithm::locate::IndexedPointInAreaLocator *locator;
+    PreparedPolygon *prepared;
     Osmium::OSM::Bounds bounds;
     Osmium::Output::Base *writer;
+    CompressingSink *sink;
     ExtractMode mode;
 
-    ExtractInfo(std::string name) : locator(NULL), writer(NULL) {
+    // the fixed-point cell of a GRID extract, including the minimum and excluding the maximum
+    // (one past the edge of the world for the cells on it)
+    int32_t cell_min_x, cell_min_y, cell_max_x, cell_max_y;
+
+    // the numa node the extract was created on, -1 if it's not placed
+    int numa_node;
+
+    // the shards of an extract with shards= or shard-size=, writer and sink belong to the current one
+    ShardedOutput *shards;
+
+    ExtractInfo(std::string name) : id(0), locator(NULL), prepared(NULL), writer(NULL), sink(NULL),
+        cell_min_x(0), cell_min_y(0), cell_max_x(0), cell_max_y(0), numa_node(Numa::preferred()), shards(NULL) {
         this->name = name;
     }
 
     ~ExtractInfo() {
         if(locator) delete locator;
+        if(prepared) delete prepared;
         if(writer) delete writer;
+
+        // after the writer closed the fifo, wait for the sink to finish
+        if(sink) delete sink;
+
+        if(shards) {
+            shards->write_manifest();
+            delete shards;
+        }
     }
 
-    bool contains(const shared_ptr<Osmium::OSM::Node const>& node) {
+    // the writer for the next object, a sharded output is rolled over to its next shard first
+    Osmium::Output::Base *output(char type, osm_object_id_t id) {
+        if(shards && shards->next(type, id, sink ? sink->bytes_written() : 0)) {
+            writer->final();
+            delete writer;
+            if(sink) delete sink;
+            writer = NULL;
+            sink = NULL;
+
+            shards->opener->open_shard(this, shards->filename(), shards->bounds);
+        }
+        return writer;
+    }
+
+    // test against a BOUNDS extract, used by the bounds_extracts loops
+    bool contains_bounds(const shared_ptr<Osmium::OSM::Node const>& node) const {
+        return
+            (node->lon() > bounds.bottom_left().lon()) &&
+            (node->lat() > bounds.bottom_left().lat()) &&
+            (node->lon() < bounds.top_right().lon()) &&
+            (node->lat() < bounds.top_right().lat());
+    }
+
+    // test against a LOCATOR extract, used by the locator_extracts loops
+    bool contains_locator(const shared_ptr<Osmium::OSM::Node const>& node) const {
+        // BOUNDARY 1
+        // EXTERIOR 2
+        // INTERIOR 0
+
+        geos::geom::Coordinate c = geos::geom::Coordinate(node->lon(), node->lat(), DoubleNotANumber);
+        return (0 == locator->locate(&c));
+    }
+
+    // test against a PREPARED extract, used by the prepared_extracts loops
+    bool contains_prepared(const shared_ptr<Osmium::OSM::Node const>& node) const {
+        return prepared->contains(node->position().x(), node->position().y());
+    }
+
+    // test against a GRID cell, the node loops look the cell up instead
+    bool contains_grid(const shared_ptr<Osmium::OSM::Node const>& node) const {
+        int32_t x = node->position().x(), y = node->position().y();
+        return x >= cell_min_x && x < cell_max_x && y >= cell_min_y && y < cell_max_y;
+    }
+
+    bool contains(const shared_ptr<Osmium::OSM::Node const>& node) const {
         if(mode == BOUNDS) {
-            return
-                (node->lon() > bounds.bottom_left().lon()) &&
-                (node->lat() > bounds.bottom_left().lat()) &&
-                (node->lon() < bounds.top_right().lon()) &&
-                (node->lat() < bounds.top_right().lat());
+            return contains_bounds(node);
         }
         else if(mode == LOCATOR) {
-            // BOUNDARY 1
-            // EXTERIOR 2
-            // INTERIOR 0
-
-            geos::geom::Coordinate c = geos::geom::Coordinate(node->lon(), node->lat(), DoubleNotANumber);
-            return (0 == locator->locate(&c));
+            return contains_locator(node);
+        }
+        else if(mode == PREPARED) {
+            return contains_prepared(node);
+        }
+        else if(mode == GRID) {
+            return contains_grid(node);
         }
 
         return false;
     }
 };
 
+// a regular grid of extracts. the cells are half-open, so every node inside
+// the grid is in exactly one cell, which is computed from its position. at the
+// edge of the world (lon 180, lat 90) nothing lies beyond, so there the last
+// column and row include their maximum
+template <class TExtractInfo>
+class ExtractGrid {
+
+public:
+    // fixed-point corners of the grid and size of a cell
+    int32_t min_x, min_y, max_x, max_y;
+    int64_t step_x, step_y;
+
+    // the first position right of and above the grid
+    int64_t end_x, end_y;
+
+    int cols, rows;
+
+    // the cells row by row, from the south-west corner
+    std::vector<TExtractInfo*> cells;
+
+    // the cell containing a position, NULL outside of the grid
+    TExtractInfo *cell(int32_t x, int32_t y) const {
+        if(x < min_x || y < min_y || x >= end_x || y >= end_y)
+            return NULL;
+
+        // a position on an inclusive maximum belongs to the last column or row
+        int col = std::min(static_cast<int64_t>(cols - 1), (static_cast<int64_t>(x) - min_x) / step_x);
+        int row = std::min(static_cast<int64_t>(rows - 1), (static_cast<int64_t>(y) - min_y) / step_y);
+        return cells[row * cols + col];
+    }
+};
+
 // information about the cutting algorithm
 template <class TExtractInfo>
-class CutInfo {
+class CutInfo : public ShardOpener {
 
 protected:
+    CutInfo() : compression_pool(NULL), sink_threads(NULL), compress_threads(0), output_memory(256*1024*1024), pool_outputs(false), container(NULL), write_batch(0), io_direct(false), open_writers(true),
+        watchdog(NULL), numa_nodes(0), numa_lines(0) {}
+
     ~CutInfo() {
         for(int i=0, l = extracts.size(); i<l; i++) {
-            extracts[i]->writer->final();
+            if(extracts[i]->writer)
+                extracts[i]->writer->final();
             delete extracts[i];
         }
+
+        if(compression_pool) {
+            std::cerr << "peak output buffer memory: " << (compression_pool->peak_buffer_memory() / (1024*1024)) << " MB" << std::endl;
+            delete sink_threads;
+            delete compression_pool;
+            TempFiles::remove(fifo_dir);
+        }
+
+        if(container)
+            delete container;
+
+        for(int i = 0, l = grids.size(); i<l; i++) {
+            delete grids[i];
+        }
+    }
+
+    // whether a name pattern gives every cell of a grid a name of its own
+    static bool names_cells(const std::string &pattern, int cols, int rows) {
+        bool names_x = pattern.find("{x}") != std::string::npos || pattern.find("{lon}") != std::string::npos;
+        bool names_y = pattern.find("{y}") != std::string::npos || pattern.find("{lat}") != std::string::npos;
+        return (cols <= 1 || names_x) && (rows <= 1 || names_y);
+    }
+
+    // replace {x}, {y}, {lon} and {lat} in the name pattern of a grid
+    static std::string cell_name(const std::string &pattern, int col, int row, double lon, double lat) {
+        std::string name = pattern;
+        const char *keys[] = {"{x}", "{y}", "{lon}", "{lat}"};
+        for(int i = 0; i < 4; i++) {
+            std::ostringstream value;
+            if(i == 0) value << col;
+            else if(i == 1) value << row;
+            else value << (i == 2 ? lon : lat);
+
+            size_t pos;
+            while((pos = name.find(keys[i])) != std::string::npos) {
+                name.replace(pos, strlen(keys[i]), value.str());
+            }
+        }
+        return name;
+    }
+
+    // pool compressing the outputs, threads reading the fifos to it and directory holding them
+    CompressionPool *compression_pool;
+    SinkThreads *sink_threads;
+    std::string fifo_dir;
+
+    // create, initialize and attach the writer of an extract
+    void open_writer(TExtractInfo *ex, Osmium::OSM::Bounds &bounds) {
+        if(ex->options.shards > 0 || ex->options.shard_size > 0) {
+            if(container) {
+                std::cerr << "output " << ex->name << " can't be sharded into a container" << std::endl;
+                exit(1);
+            }
+
+            ex->shards = new ShardedOutput(this, ex->name, ex->options.shards, static_cast<uint64_t>(ex->options.shard_size) * 1024 * 1024, bounds);
+            open_shard(ex, ex->shards->filename(), bounds);
+            return;
+        }
+
+        open_shard(ex, ex->name, bounds);
+    }
+
+    // create, initialize and attach a writer of an extract on a file
+    void open_shard(ExtractInfo *ex, const std::string &filename, Osmium::OSM::Bounds &bounds) {
+        std::cerr << "opening writer for " << filename.c_str() << std::endl;
+
+        CompressionJob::Format format;
+        std::string plain_name;
+        Osmium::Output::Base *writer;
+
+        // batched and direct writes are done by the sinks
+        // the sink counts the bytes of a shard of shard-size=
+        bool counted = ex->shards && ex->options.shard_size > 0;
+        bool parallel = compress_threads > 0 || container || write_batch > 0 || io_direct || pool_outputs || counted || ex->options.compression_level != ExtractOptions::DEFAULT_COMPRESSION;
+        bool detected = CompressingSink::detect_format(filename, format, plain_name);
+        if(container && !detected) {
+            std::cerr << "output " << filename << " can't be written into a container, only .pbf, .bz2 and .gz outputs can" << std::endl;
+            exit(1);
+        }
+
+        // an uncompressed output is passed through its sink, so its blocks are capped or counted as well
+        if((pool_outputs || counted) && !detected) {
+            format = CompressionJob::PLAIN;
+            plain_name = filename;
+            detected = true;
+        }
+
+        if(parallel && detected) {
+            if(!compression_pool) {
+                if(!TempFiles::create_directory(fifo_dir, true)) {
+                    std::cerr << "unable to create directory for output fifos: " << strerror(errno) << std::endl;
+                    exit(1);
+                }
+                compression_pool = new CompressionPool(compress_threads > 0 ? compress_threads : 1, output_memory);
+                sink_threads = new SinkThreads(compress_threads > 0 ? compress_threads : 1, numa_nodes);
+            }
+
+            // the writer writes uncompressed into the fifo, named so that osmium detects the format
+            std::ostringstream fifo;
+            fifo << fifo_dir << "/" << ex->id << "-" << plain_name.substr(plain_name.find_last_of('/') + 1);
+
+            ex->sink = new CompressingSink(compression_pool, sink_threads, format, ex->options.compression_level, fifo.str(), filename, container, write_batch, io_direct);
+
+            Osmium::OSMFile outfile(fifo.str());
+            writer = Osmium::Output::Factory::instance().create_output(outfile);
+
+            if(format == CompressionJob::PBF_BLOB) {
+                dynamic_cast<Osmium::Output::PBF*>(writer)->use_compression(false);
+            }
+        } else {
+            Osmium::OSMFile outfile(filename);
+            writer = Osmium::Output::Factory::instance().create_output(outfile);
+        }
+
+        Osmium::OSM::Meta meta(bounds);
+        writer->init(meta);
+
+        // the writer has opened the fifo
+        if(ex->sink)
+            ex->sink->start(ex->numa_node);
+
+        ex->writer = writer;
     }
 
 public:
+    // all extracts, in config order
     std::vector<TExtractInfo*> extracts;
 
+    // the same extracts split by mode, so the node loops don't need to
+    // switch on the mode for every single node
+    std::vector<TExtractInfo*> bounds_extracts;
+    std::vector<TExtractInfo*> locator_extracts;
+    std::vector<TExtractInfo*> prepared_extracts;
+
+    // the cells of GRID extracts are only in extracts and their grid
+    std::vector<ExtractGrid<TExtractInfo>*> grids;
+
+    // every cell is an extract with an open output, more cells than this are a typo
+    static const int64_t max_grid_cells = 1000000;
+
+    typedef TExtractInfo extract_info_t;
+
+    // number of threads compressing .pbf, .bz2 and .gz outputs and of threads
+    // reading their fifos, 0 lets every writer compress its output itself
+    // unless its compression was selected
+    int compress_threads;
 
-    TExtractInfo *addExtract(std::string name, double minlon, double minlat, double maxlon, double maxlat) {
-        std::cerr << "opening writer for " << name.c_str() << std::endl;
-        Osmium::OSMFile outfile(name);
-        Osmium::Output::Base *writer = Osmium::Output::Factory::instance().create_output(outfile);
+    // bytes of output blocks all compressing writers may hold together
+    size_t output_memory;
 
+    // write every output through a sink, so output_memory covers the uncompressed outputs as well
+    bool pool_outputs;
+
+    // container all outputs are appended to instead of their own files, if any, owned by the CutInfo
+    ContainerWriter *container;
+
+    // bytes per write of the compressed outputs, 0 writes every block on its own
+    size_t write_batch;
+
+    // write the compressed outputs with O_DIRECT
+    bool io_direct;
+
+    // create the output files, the planner only needs the geometries
+    bool open_writers;
+
+    // the watchdog asking to move the trackers to files, if any, not owned by the CutInfo
+    MemoryWatchdog *watchdog;
+
+    // move the trackers of all extracts to files once the watchdog asks for it,
+    // called by the cuts between two objects
+    void check_pressure() {
+        if(!watchdog || !watchdog->spill_pending())
+            return;
+
+        for(int i = 0, l = extracts.size(); i<l; i++) {
+            if(!extracts[i]->spill_trackers(watchdog->directory()))
+                std::cerr << "unable to move all trackers of " << extracts[i]->name << " to " << watchdog->directory() << std::endl;
+        }
+        watchdog->spill_done();
+        std::cerr << "memory pressure: moved the trackers to " << watchdog->directory() << std::endl;
+    }
+
+    // numa nodes the config lines are spread over, 0 leaves the placement to the kernel
+    int numa_nodes;
+    int numa_lines;
+
+    // allocate everything of the next config line on the next numa node, until end_line()
+    void begin_line(const std::string &name) {
+        if(numa_nodes > 0) {
+            int node = numa_lines++ % numa_nodes;
+            std::cerr << "placing " << name << " on numa node " << node << std::endl;
+            Numa::prefer(node);
+        }
+    }
+
+    void end_line() {
+        if(numa_nodes > 0)
+            Numa::prefer(-1);
+    }
+
+    TExtractInfo *addExtract(std::string name, double minlon, double minlat, double maxlon, double maxlat, const ExtractOptions &options = ExtractOptions()) {
         const Osmium::OSM::Position min(minlat, minlon);
         const Osmium::OSM::Position max(maxlat, maxlon);
 
         Osmium::OSM::Bounds bounds;
         bounds.extend(min).extend(max);
 
-        Osmium::OSM::Meta meta(bounds);
-        writer->init(meta);
-
         TExtractInfo *ex = new TExtractInfo(name);
-        ex->writer = writer;
+        ex->options = options;
         ex->bounds = bounds;
         ex->mode = ExtractInfo::BOUNDS;
+        ex->id = extracts.size();
+        if(open_writers)
+            open_writer(ex, bounds);
 
         extracts.push_back(ex);
+        bounds_extracts.push_back(ex);
         return ex;
     }
 
-    TExtractInfo *addExtract(std::string name, geos::geom::Geometry *poly) {
-        std::cerr << "opening writer for " << name.c_str() << std::endl;
-        Osmium::OSMFile outfile(name);
-        Osmium::Output::Base *writer = Osmium::Output::Factory::instance().create_output(outfile);
-
+    TExtractInfo *addExtract(std::string name, geos::geom::Geometry *poly, const ExtractOptions &options = ExtractOptions()) {
         const geos::geom::Envelope *env = poly->getEnvelopeInternal();
         const Osmium::OSM::Position min(env->getMinX(), env->getMinY());
         const Osmium::OSM::Position max(env->getMaxX(), env->getMaxY());
@@ -103,33 +578,241 @@ public:
         Osmium::OSM::Bounds bounds;
         bounds.extend(min).extend(max);
 
-        Osmium::OSM::Meta meta(bounds);
-        writer->init(meta);
-
         TExtractInfo *ex = new TExtractInfo(name);
-        ex->writer = writer;
-        ex->locator = new geos::algorithm::locate::IndexedPointInAreaLocator(*poly);
-        ex->mode = ExtractInfo::LOCATOR;
+        ex->options = options;
+        if(options.prepared_locator) {
+            ex->prepared = new PreparedPolygon(poly);
+            ex->mode = ExtractInfo::PREPARED;
+        } else {
+            ex->locator = new geos::algorithm::locate::IndexedPointInAreaLocator(*poly);
+            ex->mode = ExtractInfo::LOCATOR;
+        }
+        ex->id = extracts.size();
+        if(open_writers)
+            open_writer(ex, bounds);
 
         Osmium::Geometry::geos_geometry_factory()->destroyGeometry(poly);
 
         extracts.push_back(ex);
+        if(ex->mode == ExtractInfo::PREPARED)
+            prepared_extracts.push_back(ex);
+        else
+            locator_extracts.push_back(ex);
         return ex;
     }
+
+    /**
+     * add one extract per cell of a grid, named by a pattern with {x} and {y}
+     * (the column and row) or {lon} and {lat} (the south-west corner of the cell).
+     *
+     * this method returns false if the grid or the pattern is invalid.
+     */
+    bool addGrid(const std::string &pattern, double minlon, double minlat, double maxlon, double maxlat, double dx, double dy, const ExtractOptions &options = ExtractOptions()) {
+        if(dx <= 0 || dy <= 0 || maxlon <= minlon || maxlat <= minlat) {
+            std::cerr << "grid " << pattern << " needs a positive cell size and minimum below maximum" << std::endl;
+            return false;
+        }
+
+        if(minlon < -180 || maxlon > 180 || minlat < -90 || maxlat > 90) {
+            std::cerr << "grid " << pattern << " needs to lie within -180,-90,180,90" << std::endl;
+            return false;
+        }
+
+        ExtractGrid<TExtractInfo> *grid = new ExtractGrid<TExtractInfo>();
+        grid->min_x = Osmium::OSM::Position::double_to_fix(minlon);
+        grid->min_y = Osmium::OSM::Position::double_to_fix(minlat);
+        grid->max_x = Osmium::OSM::Position::double_to_fix(maxlon);
+        grid->max_y = Osmium::OSM::Position::double_to_fix(maxlat);
+
+        // a cell wider than the grid is the whole grid, 360 degrees don't fit into an int32
+        int64_t width = static_cast<int64_t>(grid->max_x) - grid->min_x;
+        int64_t height = static_cast<int64_t>(grid->max_y) - grid->min_y;
+        grid->step_x = std::max(static_cast<int64_t>(1), std::min(width, static_cast<int64_t>(llround(dx * PreparedPolygon::coordinate_precision))));
+        grid->step_y = std::max(static_cast<int64_t>(1), std::min(height, static_cast<int64_t>(llround(dy * PreparedPolygon::coordinate_precision))));
+
+        // the last column and row may be narrower
+        int64_t cols = (width + grid->step_x - 1) / grid->step_x;
+        int64_t rows = (height + grid->step_y - 1) / grid->step_y;
+        if(cols * rows > max_grid_cells) {
+            std::cerr << "grid " << pattern << " has " << cols << " x " << rows << " cells, more than " << max_grid_cells << std::endl;
+            delete grid;
+            return false;
+        }
+        grid->cols = cols;
+        grid->rows = rows;
+
+        grid->end_x = grid->max_x == Osmium::OSM::Position::double_to_fix(180) ? static_cast<int64_t>(grid->max_x) + 1 : grid->max_x;
+        grid->end_y = grid->max_y == Osmium::OSM::Position::double_to_fix(90) ? static_cast<int64_t>(grid->max_y) + 1 : grid->max_y;
+
+        if(!names_cells(pattern, grid->cols, grid->rows)) {
+            std::cerr << "grid " << pattern << " needs {x} or {lon} and {y} or {lat} in its name to name every cell differently" << std::endl;
+            delete grid;
+            return false;
+        }
+
+        // the cells would overwrite each others way-locations
+        if(!options.locations.empty() && !names_cells(options.locations, grid->cols, grid->rows)) {
+            std::cerr << "grid " << pattern << " needs {x} or {lon} and {y} or {lat} in locations=" << options.locations << " to name the file of every cell differently" << std::endl;
+            delete grid;
+            return false;
+        }
+
+        std::cerr << "grid " << pattern << ": " << grid->cols << " x " << grid->rows << " cells" << std::endl;
+
+        for(int row = 0; row < grid->rows; row++) {
+            for(int col = 0; col < grid->cols; col++) {
+                // all within the grid, which lies within the int32 range of the world
+                int32_t cell_x = grid->min_x + col * grid->step_x;
+                int32_t cell_y = grid->min_y + row * grid->step_y;
+                double lon = Osmium::OSM::Position::fix_to_double(cell_x);
+                double lat = Osmium::OSM::Position::fix_to_double(cell_y);
+
+                TExtractInfo *ex = new TExtractInfo(cell_name(pattern, col, row, lon, lat));
+
+                ex->options = options;
+                if(!options.locations.empty())
+                    ex->options.locations = cell_name(options.locations, col, row, lon, lat);
+                ex->mode = ExtractInfo::GRID;
+                ex->cell_min_x = cell_x;
+                ex->cell_min_y = cell_y;
+                ex->cell_max_x = col == grid->cols - 1 ? grid->end_x : cell_x + grid->step_x;
+                ex->cell_max_y = row == grid->rows - 1 ? grid->end_y : cell_y + grid->step_y;
+
+                const Osmium::OSM::Position min(lon, lat);
+                const Osmium::OSM::Position max(
+                    Osmium::OSM::Position::fix_to_double(std::min(ex->cell_max_x, grid->max_x)),
+                    Osmium::OSM::Position::fix_to_double(std::min(ex->cell_max_y, grid->max_y)));
+                ex->bounds.extend(min).extend(max);
+
+                ex->id = extracts.size();
+                if(open_writers)
+                    open_writer(ex, ex->bounds);
+
+                extracts.push_back(ex);
+                grid->cells.push_back(ex);
+            }
+        }
+
+        grids.push_back(grid);
+        return true;
+    }
 };
 
-template <class TCutInfo>
+// remembers the id and the waynodes of the last way-version, the input is sorted
+// by id and version, so a version whose waynodes didn't change can reuse what
+// was computed for the one before it
+class WayNodesMemo {
+
+private:
+    bool remembered;
+    osm_object_id_t id;
+    std::vector<osm_object_id_t> nodes;
+
+public:
+    WayNodesMemo() : remembered(false), id(0) {}
+
+    // does the way-version have the id and the waynodes of the last one, remembers it if not
+    bool unchanged(const shared_ptr<Osmium::OSM::Way const>& way) {
+        const Osmium::OSM::WayNodeList& waynodes = way->nodes();
+        int l = waynodes.size();
+
+        if(remembered && way->id() == id && static_cast<int>(nodes.size()) == l) {
+            int i = 0;
+            while(i<l && nodes[i] == waynodes[i].ref())
+                i++;
+
+            if(i == l)
+                return true;
+        }
+
+        remembered = true;
+        id = way->id();
+        nodes.clear();
+        for(int i = 0; i<l; i++) {
+            nodes.push_back(waynodes[i].ref());
+        }
+        return false;
+    }
+};
+
+template <class TCutInfo, class TDebug>
 class Cut : public Osmium::Handler::Base {
 
 protected:
 
+    static const bool debug = TDebug::enabled;
+
     Osmium::Handler::Progress pg;
     TCutInfo *info;
 
+    typedef typename TCutInfo::extract_info_t extract_info_t;
+
+    // the extracts the last tested node-version is inside and its position. the
+    // membership only depends on the position, so the many versions that only
+    // change tags reuse it instead of being tested again
+    std::vector<extract_info_t*> last_node_extracts;
+    Osmium::OSM::Position last_node_position;
+    bool last_node_tested;
+
+    // call handler->node_inside() for every extract the node-version is inside,
+    // walking each list of extracts with the test specialized for its mode
+    template <class THandler>
+    void dispatch_node(THandler *handler, const shared_ptr<Osmium::OSM::Node const>& node) {
+        // deleted versions have no meaningful position and are inside no extract
+        if(!node->visible()) {
+            if(debug) std::cerr << "node " << node->id() << " v" << node->version() << " is deleted, skipping the spatial tests" << std::endl;
+            return;
+        }
+
+        if(last_node_tested && node->position() == last_node_position) {
+            if(debug) std::cerr << "node " << node->id() << " v" << node->version() << " did not move, reusing the extracts of the last version" << std::endl;
+        } else {
+            test_node(node);
+        }
+
+        for(int i = 0, l = last_node_extracts.size(); i<l; i++) {
+            handler->node_inside(last_node_extracts[i], node);
+        }
+    }
+
+    // find the extracts the node-version is inside and remember them with its position
+    void test_node(const shared_ptr<Osmium::OSM::Node const>& node) {
+        last_node_extracts.clear();
+        last_node_position = node->position();
+        last_node_tested = true;
+
+        // walk over all bboxes
+        for(int i = 0, l = info->bounds_extracts.size(); i<l; i++) {
+            extract_info_t *extract = info->bounds_extracts[i];
+            if(extract->contains_bounds(node))
+                last_node_extracts.push_back(extract);
+        }
+
+        // walk over all grids, the cell of a node is computed instead of searched
+        for(int i = 0, l = info->grids.size(); i<l; i++) {
+            extract_info_t *extract = info->grids[i]->cell(node->position().x(), node->position().y());
+            if(extract)
+                last_node_extracts.push_back(extract);
+        }
+
+        // walk over all geos-located polygons
+        for(int i = 0, l = info->locator_extracts.size(); i<l; i++) {
+            extract_info_t *extract = info->locator_extracts[i];
+            if(extract->contains_locator(node))
+                last_node_extracts.push_back(extract);
+        }
+
+        // walk over all prepared polygons
+        for(int i = 0, l = info->prepared_extracts.size(); i<l; i++) {
+            extract_info_t *extract = info->prepared_extracts[i];
+            if(extract->contains_prepared(node))
+                last_node_extracts.push_back(extract);
+        }
+    }
+
 public:
 
-    bool debug;
-    Cut(TCutInfo *info) : info(info) {}
+    Cut(TCutInfo *info) : info(info), last_node_tested(false) {}
 };
 
 #endif // SPLITTER_CUT_HPP
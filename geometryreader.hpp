@@ -2,107 +2,299 @@
 #define OSMIUMEX_GEOMBUILDER_HPP
 
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <map>
+#include <set>
+
 #include <geos/util/GEOSException.h>
 #include <geos/geom/MultiPolygon.h>
-#include <osmium/storage/byid/fixed_array.hpp>
-#include <osmium/handler/coordinates_for_ways.hpp>
-#include <osmium/geometry/point.hpp>
 #include <osmium/geometry/geos.hpp>
 
-
-typedef Osmium::Storage::ById::FixedArray<Osmium::OSM::Position> storage_array_t;
-typedef Osmium::Handler::CoordinatesForWays<storage_array_t, storage_array_t> cfw_handler_t;
+#include "ring_assembler.hpp"
+
+/*
+
+OSM extracts
+ - the nodes of the .osm file are kept in a sparse sorted id -> location store
+   (see ring_assembler.hpp), so files using high node ids take no more memory
+   than files using low ones
+ - relations tagged type=multipolygon or type=boundary become polygons with
+   holes: their ways with role inner are joined into the inner rings, all other
+   ways into the outer rings
+ - the ways which are no member of such a relation are joined into rings as
+   well, so an outline may be split over many ways. ways that can't be closed
+   are reported and left out
+ - the polygons of all relations and rings together are the extract
+ - all OSM files of a config are parsed in parallel, one file per thread. every
+   thread reads its file with its own osmium input into its own reader, no
+   osmium state is shared between the threads
+ - geos is only used on the main thread: the geometry of an OSM extract is built
+   from its parsed file when the extract is added, after begin_line placed the
+   thread on the node of the extract (see numa.hpp)
+
+*/
 
 namespace OsmiumExtension {
 
     class OsmGeometryReader : public Osmium::Handler::Base {
-        std::vector<geos::geom::Geometry*> outer;
-        storage_array_t store_pos;
-        storage_array_t store_neg;
-        cfw_handler_t* handler_cfw;
+
+        struct Multipolygon {
+            std::vector<int64_t> outer;
+            std::vector<int64_t> inner;
+        };
+
+        std::string filename;
+        NodeLocations locations;
+        std::map<int64_t, RingAssembler::nodelist_t> way_nodes;
+        std::map<int64_t, Multipolygon> multipolygons;
 
     private:
-            geos::geom::Geometry *polygonFromWay(const shared_ptr<Osmium::OSM::Way>& way) const {
-                if (!way->is_closed()) {
-                    std::cerr << "can't build way polygon geometry of unclosed way, leave it as NULL" << std::endl;
-                    return NULL;
+            // join ways into rings and append their polygons, returns false if a node is missing
+            bool addRings(const std::vector<RingAssembler::nodelist_t> &ways, std::vector<geos::geom::Geometry*> &polygons) const {
+                std::vector<RingAssembler::nodelist_t> rings, open;
+                RingAssembler::join(ways, rings, open);
+
+                for (int i = 0, l = open.size(); i<l; i++) {
+                    std::cerr << "unclosed ring from node " << open[i].front() << " to node " << open[i].back() << " in " << filename << ", leave it out" << std::endl;
                 }
-                try {
-                    std::vector<geos::geom::Coordinate> *c = new std::vector<geos::geom::Coordinate>;
-                    const Osmium::OSM::WayNodeList nodes = way->nodes();
-                    for (osm_sequence_id_t i=0; i < nodes.size(); ++i) {
-                        c->push_back(Osmium::Geometry::create_geos_coordinate(nodes[i].position()));
+
+                for (int i = 0, l = rings.size(); i<l; i++) {
+                    int64_t missing;
+                    geos::geom::Geometry *poly = RingAssembler::polygon(rings[i], locations, missing);
+                    if (!poly) {
+                        if (missing) {
+                            std::cerr << "node " << missing << " is missing in " << filename << std::endl;
+                            return false;
+                        }
+                        std::cerr << "ring from node " << rings[i].front() << " in " << filename << " is no valid polygon, leave it out" << std::endl;
+                        continue;
                     }
-                    geos::geom::CoordinateSequence *cs = Osmium::Geometry::geos_geometry_factory()->getCoordinateSequenceFactory()->create(c);
-                    geos::geom::LinearRing *ring = Osmium::Geometry::geos_geometry_factory()->createLinearRing(cs);
-                    return (geos::geom::Geometry *) Osmium::Geometry::geos_geometry_factory()->createPolygon(ring, NULL);
-                } catch (const geos::util::GEOSException& exc) {
-                    std::cerr << "error building way geometry, leave it as NULL" << std::endl;
-                    return NULL;
+                    polygons.push_back(poly);
                 }
+                return true;
             }
 
-    public:
-        OsmGeometryReader() : Base(), store_pos(5000), store_neg(1000) {
-            handler_cfw = new cfw_handler_t(store_pos, store_neg);
-        }
-
-        virtual ~OsmGeometryReader() {
-            delete handler_cfw;
-
-            geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
-            for (uint32_t i=0; i < outer.size(); i++) {
-                f->destroyGeometry(outer[i]);
+            // the node-lists of the ways, missing ways are reported and left out
+            void wayNodes(const std::vector<int64_t> &ids, std::vector<RingAssembler::nodelist_t> &ways) const {
+                for (int i = 0, l = ids.size(); i<l; i++) {
+                    std::map<int64_t, RingAssembler::nodelist_t>::const_iterator it = way_nodes.find(ids[i]);
+                    if (it == way_nodes.end()) {
+                        std::cerr << "way " << ids[i] << " is missing in " << filename << std::endl;
+                        continue;
+                    }
+                    if (it->second.size() >= 2)
+                        ways.push_back(it->second);
+                }
             }
-            outer.clear();
-        }
 
-        void init(Osmium::OSM::Meta& meta) {
-            handler_cfw->init(meta);
-        }
+    public:
+        OsmGeometryReader(const std::string &filename) : Base(), filename(filename) {}
 
         void node(const shared_ptr<Osmium::OSM::Node const>& node) {
-            handler_cfw->node(node);
+            if (node->visible())
+                locations.add(node->id(), node->position().x(), node->position().y());
         }
 
-        void way(const shared_ptr<Osmium::OSM::Way>& way) {
-            handler_cfw->way(way);
+        void after_nodes() {
+            locations.sort();
+        }
 
-            if (!way->is_closed()) {
-                std::cerr << "open way " << way->id() << " in osm-input" << std::endl;
+        // the last version of a way wins
+        void way(const shared_ptr<Osmium::OSM::Way const>& way) {
+            if (!way->visible()) {
+                way_nodes.erase(way->id());
                 return;
             }
 
-            geos::geom::Geometry *geom = polygonFromWay(way);
-            if(!geom) {
-                std::cerr << "error creating polygon from way" << std::endl;
-                return;
+            RingAssembler::nodelist_t &nodes = way_nodes[way->id()];
+            nodes.clear();
+            const Osmium::OSM::WayNodeList& waynodes = way->nodes();
+            for (int i = 0, l = waynodes.size(); i<l; i++) {
+                nodes.push_back(waynodes[i].ref());
             }
-            outer.push_back(geom);
         }
 
-        void after_nodes() {
-            handler_cfw->after_nodes();
-        }
+        void relation(const shared_ptr<Osmium::OSM::Relation const>& relation) {
+            const char *type = relation->tags().get_tag_by_key("type");
+            if (!relation->visible() || !type || (strcmp(type, "multipolygon") && strcmp(type, "boundary"))) {
+                multipolygons.erase(relation->id());
+                return;
+            }
 
-        void final() {
-            handler_cfw->final();
+            Multipolygon &mp = multipolygons[relation->id()];
+            mp.outer.clear();
+            mp.inner.clear();
+
+            const Osmium::OSM::RelationMemberList& members = relation->members();
+            for (int i = 0, l = members.size(); i<l; i++) {
+                if (members[i].type() != 'w')
+                    continue;
+
+                if (0 == strcmp(members[i].role(), "inner"))
+                    mp.inner.push_back(members[i].ref());
+                else
+                    mp.outer.push_back(members[i].ref());
+            }
         }
 
+        /**
+         * build the geometry of all multipolygons and rings, the caller owns it.
+         *
+         * this method returns NULL if a node is missing or no polygon could be built.
+         */
         geos::geom::Geometry *buildGeom() const {
             // shorthand to the geometry factory
             geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
+            std::vector<geos::geom::Geometry*> *polygons = new std::vector<geos::geom::Geometry*>();
+            std::set<int64_t> members;
+
+            for (std::map<int64_t, Multipolygon>::const_iterator it = multipolygons.begin(); it != multipolygons.end(); ++it) {
+                std::vector<RingAssembler::nodelist_t> outer_ways, inner_ways;
+                wayNodes(it->second.outer, outer_ways);
+                wayNodes(it->second.inner, inner_ways);
+                members.insert(it->second.outer.begin(), it->second.outer.end());
+                members.insert(it->second.inner.begin(), it->second.inner.end());
+
+                std::vector<geos::geom::Geometry*> *outer = new std::vector<geos::geom::Geometry*>();
+                std::vector<geos::geom::Geometry*> *inner = new std::vector<geos::geom::Geometry*>();
+                if (!addRings(outer_ways, *outer) || !addRings(inner_ways, *inner)) {
+                    RingAssembler::destroy(outer);
+                    RingAssembler::destroy(inner);
+                    RingAssembler::destroy(polygons);
+                    return NULL;
+                }
+
+                if (outer->empty()) {
+                    std::cerr << "relation " << it->first << " in " << filename << " has no outer ring, leave it out" << std::endl;
+                    RingAssembler::destroy(outer);
+                    RingAssembler::destroy(inner);
+                    continue;
+                }
+
+                geos::geom::Geometry *mp = RingAssembler::difference(outer, inner);
+                if (!mp) {
+                    std::cerr << "error creating multipolygon of relation " << it->first << " in " << filename << std::endl;
+                    RingAssembler::destroy(polygons);
+                    return NULL;
+                }
+
+                // the polygons of the difference become polygons of the whole geometry
+                for (size_t i = 0, l = mp->getNumGeometries(); i<l; i++) {
+                    polygons->push_back(mp->getGeometryN(i)->clone());
+                }
+                f->destroyGeometry(mp);
+            }
+
+            std::vector<RingAssembler::nodelist_t> loose;
+            for (std::map<int64_t, RingAssembler::nodelist_t>::const_iterator it = way_nodes.begin(); it != way_nodes.end(); ++it) {
+                if (!members.count(it->first) && it->second.size() >= 2)
+                    loose.push_back(it->second);
+            }
+            if (!addRings(loose, *polygons)) {
+                RingAssembler::destroy(polygons);
+                return NULL;
+            }
+
+            if (polygons->empty()) {
+                std::cerr << "no polygon found in " << filename << std::endl;
+                RingAssembler::destroy(polygons);
+                return NULL;
+            }
+
+            // the multipolygon takes over the polygons only when it is created
             geos::geom::MultiPolygon *outerPoly;
             try {
-                outerPoly = f->createMultiPolygon(outer);
+                outerPoly = f->createMultiPolygon(polygons);
             } catch(geos::util::GEOSException e) {
                 std::cerr << "error creating multipolygon: " << e.what() << std::endl;
+                RingAssembler::destroy(polygons);
                 return NULL;
             }
+
+            std::cerr << "read " << multipolygons.size() << " multipolygon relations, " << way_nodes.size() << " ways and "
+                << locations.size() << " nodes from " << filename << std::endl;
             return outerPoly;
         }
     };
 
+    // the .osm files of a config, parsed in parallel and built into geometries one by one
+    class OsmFileReader {
+
+        // the distinct files and their readers
+        std::vector<std::string> files;
+        std::vector<OsmGeometryReader*> readers;
+
+        // the distinct file of every requested file
+        std::vector<size_t> index;
+
+        size_t next;
+        pthread_mutex_t mutex;
+
+        // parse the next unread file until all are read, the threads share nothing but next
+        static void *parse(void *arg) {
+            OsmFileReader *self = static_cast<OsmFileReader*>(arg);
+            while (true) {
+                pthread_mutex_lock(&self->mutex);
+                size_t n = self->next++;
+                pthread_mutex_unlock(&self->mutex);
+
+                if (n >= self->files.size())
+                    return NULL;
+
+                Osmium::OSMFile infile(self->files[n]);
+                Osmium::Input::read(infile, *self->readers[n]);
+            }
+        }
+
+    public:
+        // a file named more than once is read once
+        OsmFileReader(const std::vector<std::string> &requested) : next(0) {
+            std::map<std::string, size_t> first;
+            for (size_t i = 0, l = requested.size(); i<l; i++) {
+                std::pair<std::map<std::string, size_t>::iterator, bool> ins = first.insert(std::make_pair(requested[i], files.size()));
+                if (ins.second) {
+                    files.push_back(requested[i]);
+                    readers.push_back(new OsmGeometryReader(requested[i]));
+                }
+                index.push_back(ins.first->second);
+            }
+        }
+
+        ~OsmFileReader() {
+            for (int i = 0, l = readers.size(); i<l; i++) {
+                delete readers[i];
+            }
+        }
+
+        // parse all files, one file per thread
+        void read() {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            size_t threads = std::min(files.size(), static_cast<size_t>(cpus > 0 ? cpus : 1));
+
+            pthread_mutex_init(&mutex, NULL);
+            std::vector<pthread_t> workers(threads);
+            for (size_t i = 0; i < threads; i++) {
+                pthread_create(&workers[i], NULL, &OsmFileReader::parse, this);
+            }
+            for (size_t i = 0; i < threads; i++) {
+                pthread_join(workers[i], NULL);
+            }
+            pthread_mutex_destroy(&mutex);
+        }
+
+        /**
+         * build the geometry of the i-th requested file, the caller owns it.
+         * a file named more than once gets a geometry of its own every time.
+         *
+         * this method returns NULL if no polygon can be built.
+         */
+        geos::geom::Geometry *geometry(size_t i) const {
+            return readers[index[i]]->buildGeom();
+        }
+    };
+
     class GeometryReader {
 
         /// maximum length of a line in a .poly file
@@ -274,9 +466,15 @@ namespace OsmiumExtension {
             return poly;
         } // fromPolyFile
 
+        /**
+         * read an .osm file and build a geos Geometry from its multipolygon
+         * relations and the rings of its other ways.
+         *
+         * this method returns NULL if no polygon can be built.
+         */
         static geos::geom::Geometry *fromOsmFile(const std::string &file) {
             Osmium::OSMFile infile(file);
-            OsmiumExtension::OsmGeometryReader reader;
+            OsmiumExtension::OsmGeometryReader reader(file);
             Osmium::Input::read(infile, reader);
             geos::geom::Geometry *geom = reader.buildGeom();
 
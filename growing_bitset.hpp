@@ -1,47 +1,171 @@
 #ifndef GROWING_BITSET_HPP
 #define GROWING_BITSET_HPP
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include <iostream>
+#include <string>
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <new>
+
+#include "numa.hpp"
 
 class growing_bitset
 {
 private:
-    typedef std::vector<bool> bitvec_t;
-    typedef bitvec_t* bitvec_ptr_t;
-    typedef std::vector< bitvec_ptr_t > bitmap_t;
+    typedef uint64_t word_t;
+    typedef word_t* segment_ptr_t;
+    typedef std::vector< segment_ptr_t > bitmap_t;
 
+    static const size_t word_bits = 64;
+    static const size_t hugepage_size = 2*1024*1024;
 
-    static const size_t segment_size = 50*1024*1024;
     bitmap_t bitmap;
 
-    bitvec_ptr_t find_segment (size_t segment) {
+    // the numa node the segments are bound to, -1 leaves them to the kernel
+    int node;
+
+    // the directory segments are backed by files in after spill(), empty before
+    std::string spill_dir;
+
+    static bool &hugepages_enabled() {
+        static bool enabled = false;
+        return enabled;
+    }
+
+    // map a segment backed by an unlinked file in the spill directory. with bits
+    // given, they are copied into the file first. the file is always mapped at a
+    // new address, so a failure leaves the segment the bits came from untouched
+    segment_ptr_t map_file(const word_t *bits) {
+        size_t bytes = segment_size / 8;
+        std::string path = spill_dir + "/tracker-XXXXXX";
+        std::vector<char> tmpl(path.begin(), path.end());
+        tmpl.push_back('\0');
+
+        int fd = mkstemp(&tmpl[0]);
+        if(fd < 0) {
+            std::cerr << "unable to create tracker file in " << spill_dir << ": " << strerror(errno) << std::endl;
+            return NULL;
+        }
+        unlink(&tmpl[0]);
+
+        bool ok = ftruncate(fd, bytes) == 0;
+        const char *src = reinterpret_cast<const char*>(bits);
+        for(size_t pos = 0; ok && bits && pos < bytes; ) {
+            ssize_t w = pwrite(fd, src + pos, bytes - pos, pos);
+            if(w < 0 && errno == EINTR) continue;
+            ok = w > 0;
+            if(ok) pos += w;
+        }
+        if(!ok)
+            std::cerr << "unable to write tracker file in " << spill_dir << ": " << strerror(errno) << std::endl;
+
+        void *mem = MAP_FAILED;
+        if(ok) {
+            mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(mem == MAP_FAILED)
+                std::cerr << "unable to map tracker file in " << spill_dir << ": " << strerror(errno) << std::endl;
+        }
+
+        // the mapping keeps the file
+        close(fd);
+        return mem == MAP_FAILED ? NULL : static_cast<segment_ptr_t>(mem);
+    }
+
+    // segments are mapped anonymously, so they start zeroed and untouched and
+    // can be bound to a node and backed by huge pages before the first set()
+    segment_ptr_t allocate_segment() {
+        size_t bytes = segment_size / 8;
+        void *mem;
+
+        if(!spill_dir.empty()) {
+            segment_ptr_t ptr = map_file(NULL);
+            if(!ptr)
+                throw std::bad_alloc();
+            return ptr;
+        }
+
+        if(hugepages_enabled()) {
+            // align to a huge page by mapping a bit more and cutting off both ends
+            size_t mapped = bytes + hugepage_size;
+            char *raw = static_cast<char*>(mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if(raw == MAP_FAILED)
+                throw std::bad_alloc();
+
+            char *aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + hugepage_size - 1) & ~(hugepage_size - 1));
+            if(aligned > raw)
+                munmap(raw, aligned - raw);
+            munmap(aligned + bytes, (raw + mapped) - (aligned + bytes));
+
+            madvise(aligned, bytes, MADV_HUGEPAGE);
+            mem = aligned;
+        } else {
+            mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(mem == MAP_FAILED)
+                throw std::bad_alloc();
+        }
+
+        if(node >= 0)
+            Numa::bind(mem, bytes, node);
+
+        return static_cast<segment_ptr_t>(mem);
+    }
+
+    segment_ptr_t find_segment (size_t segment) {
         if (segment >= bitmap.size()) {
             bitmap.resize(segment+1);
         }
 
-        bitvec_ptr_t ptr = bitmap.at(segment);
+        segment_ptr_t ptr = bitmap.at(segment);
         if(!ptr) {
-            bitmap[segment] = ptr = new std::vector<bool>(segment_size);
+            bitmap[segment] = ptr = allocate_segment();
         }
 
         return ptr;
     }
 
-    bitvec_ptr_t find_segment (size_t segment) const {
+    segment_ptr_t find_segment (size_t segment) const {
         if (segment >= bitmap.size()) {
             return NULL;
         }
 
-        return bitmap.at(segment);
+        return bitmap[segment];
+    }
+
+    // the word holding the bit of an id, NULL if its segment was never set
+    const word_t *word(const osm_object_id_t pos) const {
+        size_t
+            segment = static_cast<osm_object_id_t>(pos) / static_cast<osm_object_id_t>(segment_size),
+            segmented_pos = static_cast<osm_object_id_t>(pos) % static_cast<osm_object_id_t>(segment_size);
+
+        segment_ptr_t words = find_segment(segment);
+        if(!words) return NULL;
+        return words + segmented_pos / word_bits;
     }
 
 public:
+    // number of ids per segment, segments are allocated as a whole on the first set()
+    static const size_t segment_size = 50*1024*1024;
+
+    // back the segments allocated from now on with transparent huge pages
+    static void hugepages(bool enabled) {
+        hugepages_enabled() = enabled;
+    }
+
+    // a bitset created while a numa node is preferred keeps its segments on that node
+    growing_bitset() : node(Numa::preferred()) {}
+
     ~growing_bitset() {
         for (bitmap_t::iterator it=bitmap.begin(), end=bitmap.end(); it != end; it++) {
-            bitvec_ptr_t ptr = (*it);
-            if(ptr) delete ptr;
+            segment_ptr_t ptr = (*it);
+            if(ptr) munmap(ptr, segment_size / 8);
         }
     }
 
@@ -50,24 +174,95 @@ public:
             segment = static_cast<osm_object_id_t>(pos) / static_cast<osm_object_id_t>(segment_size),
             segmented_pos = static_cast<osm_object_id_t>(pos) % static_cast<osm_object_id_t>(segment_size);
 
-        bitvec_ptr_t bitvec = find_segment(segment);
-        bitvec->at(segmented_pos) = true;
+        segment_ptr_t words = find_segment(segment);
+        words[segmented_pos / word_bits] |= static_cast<word_t>(1) << (segmented_pos % word_bits);
     }
 
     bool get(const osm_object_id_t pos) const {
-        size_t
-            segment = static_cast<osm_object_id_t>(pos) / static_cast<osm_object_id_t>(segment_size),
-            segmented_pos = static_cast<osm_object_id_t>(pos) % static_cast<osm_object_id_t>(segment_size);
+        const word_t *w = word(pos);
+        if(!w) return false;
+        return (*w >> (static_cast<size_t>(pos) % word_bits)) & 1;
+    }
+
+    /**
+     * look up many ids at once, hits[i] is set to the bit of ids[i]. the words
+     * a few ids ahead are prefetched so the lookups don't wait on each others
+     * cache-misses, sorted ids also walk the segments front to back.
+     */
+    void get_many(const std::vector<osm_object_id_t> &ids, std::vector<char> &hits) const {
+        static const size_t distance = 16;
 
-        bitvec_ptr_t bitvec = find_segment(segment);
-        if(!bitvec) return false;
-        return (bool)bitvec->at(segmented_pos);
+        size_t n = ids.size();
+        hits.resize(n);
+        for(size_t i = 0; i < n; i++) {
+            if(i + distance < n) {
+                const word_t *ahead = word(ids[i + distance]);
+                if(ahead) __builtin_prefetch(ahead);
+            }
+            hits[i] = get(ids[i]);
+        }
+    }
+
+    // number of ids set in this bitset or, if given, in the other one
+    uint64_t count(const growing_bitset *other = NULL) const {
+        size_t segments = std::max(bitmap.size(), other ? other->bitmap.size() : 0);
+        uint64_t n = 0;
+        for (size_t seg = 0; seg < segments; seg++) {
+            segment_ptr_t a = find_segment(seg);
+            segment_ptr_t b = other ? other->find_segment(seg) : NULL;
+            if(!a && !b) continue;
+
+            for (size_t i = 0, l = segment_size / word_bits; i < l; i++) {
+                n += __builtin_popcountll((a ? a[i] : 0) | (b ? b[i] : 0));
+            }
+        }
+        return n;
+    }
+
+    // bytes allocated for the bit-vectors
+    size_t memory_usage() const {
+        size_t segments = 0;
+        for (bitmap_t::const_iterator it=bitmap.begin(), end=bitmap.end(); it != end; it++) {
+            if(*it) segments++;
+        }
+        return segments * (segment_size / 8);
+    }
+
+    /**
+     * move all segments into files in dir, later segments are created there too.
+     * the kernel writes file-backed pages back to their file and drops them
+     * instead of swapping them.
+     *
+     * this method returns false if a segment can't be moved, it stays in memory
+     * with all its bits then. a moved segment is only unmapped once its copy in
+     * the file is mapped.
+     */
+    bool spill(const std::string &dir) {
+        if(!spill_dir.empty())
+            return true;
+
+        spill_dir = dir;
+        bool ok = true;
+        for (bitmap_t::iterator it=bitmap.begin(), end=bitmap.end(); it != end; it++) {
+            if(!*it)
+                continue;
+
+            segment_ptr_t moved = map_file(*it);
+            if(!moved) {
+                ok = false;
+                continue;
+            }
+
+            munmap(*it, segment_size / 8);
+            *it = moved;
+        }
+        return ok;
     }
 
     void clear() {
         for (bitmap_t::iterator it=bitmap.begin(), end=bitmap.end(); it != end; it++) {
-            bitvec_ptr_t ptr = (*it);
-            ptr->clear();
+            segment_ptr_t ptr = (*it);
+            if(ptr) memset(ptr, 0, segment_size / 8);
         }
     }
 };
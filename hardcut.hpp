@@ -2,6 +2,7 @@
 #define SPLITTER_HARDCUT_HPP
 
 #include "cut.hpp"
+#include "probe_batch.hpp"
 
 /*
 
@@ -44,6 +45,15 @@ Hardcut Algorithm
      - if the relation pointer is not NULL
        - write the relation to this bboxes writer
 
+history
+ - deleted node-versions are inside no extract, a node-version at the position of
+   the node-version before it is inside the same extracts without being tested again
+ - a way-version with the waynodes of the version before it reuses their cut
+
+batches
+ - ways and relations are cut in batches, the references of a batch are looked up
+   in the trackers of a bbox sorted and together (see probe_batch.hpp)
+
 features:
  - single pass
  - ways are cropped at bbox boundaries
@@ -57,6 +67,9 @@ disadvantages:
  - relations referring to relations that come later in the file are missing this valid references
  - ways that have only one node inside the bbox are missing from the output
  - only versions of an object that are inside the bboxes are in thr extract, some versions may be missing
+ - the filter of an extract (filter= option) only applies to ways and relations, because nodes
+   are written before the ways referring to them are known. for the same reason types= has to
+   include nodes, so the written ways stay reference-complete.
 
 */
 
@@ -67,23 +80,128 @@ public:
     growing_bitset way_tracker;
 
     HardcutExtractInfo(std::string name) : ExtractInfo(name) {}
+
+    /**
+     * check the options of an extract against the hardcut. the nodes are written
+     * before the ways referring to them are known, so nodes can't be left out.
+     *
+     * this method returns false if the hardcut can't write the extract.
+     */
+    static bool check_options(const std::string &name, const ExtractOptions &options) {
+        if(!options.filter.accepts_nodes()) {
+            std::cerr << "output " << name << ": the hardcut writes the nodes before the ways using them are known, types= needs n" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // bytes allocated by the trackers
+    size_t tracker_memory() const {
+        return node_tracker.memory_usage() + way_tracker.memory_usage();
+    }
+
+    // move the trackers into files in dir
+    bool spill_trackers(const std::string &dir) {
+        bool nodes = node_tracker.spill(dir);
+        bool ways = way_tracker.spill(dir);
+        return nodes && ways;
+    }
 };
 
 class HardcutInfo : public CutInfo<HardcutExtractInfo> {
 
 };
 
-class Hardcut : public Cut<HardcutInfo> {
+template <class TDebug>
+class Hardcut : public Cut<HardcutInfo, TDebug> {
 
 protected:
 
+    using Cut<HardcutInfo, TDebug>::debug;
+    using Cut<HardcutInfo, TDebug>::pg;
+    using Cut<HardcutInfo, TDebug>::info;
+
     std::vector<Osmium::OSM::Node*> current_node_vector;
 
     osm_object_id_t last_id;
 
+    // the way- and relation-versions waiting to be cut, their references are probed together
+    WayBatch way_batch;
+    RelationBatch relation_batch;
+    WayNodesMemo way_memo;
+
+    // scratch space for the waynodes and members that survive the cut, reused
+    // for every object so the inner loops don't allocate. the waynodes are kept
+    // for the next way-version if it has the same waynodes
+    std::vector<osm_object_id_t> cut_way_nodes;
+    std::vector<int> cut_relation_members;
+
+    // the cutted objects handed to the writers. writers don't keep them
+    // around, so as long as nobody else holds a reference they are reset
+    // and reused instead of allocating a fresh object for every extract.
+    shared_ptr<Osmium::OSM::Way> cut_way;
+    shared_ptr<Osmium::OSM::Relation> cut_relation;
+
+    // create a way with all meta-data and tags but without waynodes
+    shared_ptr<Osmium::OSM::Way> prepare_cut_way(const shared_ptr<Osmium::OSM::Way const>& way) {
+        if(cut_way && cut_way.use_count() == 1) {
+            cut_way->tags().clear();
+            cut_way->nodes().clear();
+        } else {
+            cut_way = shared_ptr<Osmium::OSM::Way>(new Osmium::OSM::Way());
+        }
+
+        cut_way->id(way->id());
+        cut_way->version(way->version());
+        cut_way->uid(way->uid());
+        cut_way->changeset(way->changeset());
+        cut_way->timestamp(way->timestamp());
+        cut_way->visible(way->visible());
+        cut_way->user(way->user());
+        for(Osmium::OSM::TagList::const_iterator it = way->tags().begin(); it != way->tags().end(); ++it) {
+            cut_way->tags().add(it->key(), it->value());
+        }
+
+        return cut_way;
+    }
+
+    // create a relation with all meta-data and tags but without members
+    shared_ptr<Osmium::OSM::Relation> prepare_cut_relation(const shared_ptr<Osmium::OSM::Relation const>& relation) {
+        if(cut_relation && cut_relation.use_count() == 1) {
+            cut_relation->tags().clear();
+            cut_relation->members().clear();
+        } else {
+            cut_relation = shared_ptr<Osmium::OSM::Relation>(new Osmium::OSM::Relation());
+        }
+
+        cut_relation->id(relation->id());
+        cut_relation->version(relation->version());
+        cut_relation->uid(relation->uid());
+        cut_relation->changeset(relation->changeset());
+        cut_relation->timestamp(relation->timestamp());
+        cut_relation->visible(relation->visible());
+        cut_relation->user(relation->user());
+        for(Osmium::OSM::TagList::const_iterator it = relation->tags().begin(); it != relation->tags().end(); ++it) {
+            cut_relation->tags().add(it->key(), it->value());
+        }
+
+        return cut_relation;
+    }
+
 public:
 
-    Hardcut(HardcutInfo *info) : Cut<HardcutInfo>(info) {}
+    Hardcut(HardcutInfo *info) : Cut<HardcutInfo, TDebug>(info) {}
+
+    // the node-version is inside the extract
+    void node_inside(HardcutExtractInfo *extract, const shared_ptr<Osmium::OSM::Node const>& node) {
+        // write the node to the writer of this bbox, the filter can't be applied to nodes
+        // because the ways referring to them are not known yet
+        if(debug) std::cerr << "node " << node->id() << " v" << node->version() << " is inside bbox[" << extract->id << "], writing it out" << std::endl;
+        extract->output('n', node->id())->node(node);
+
+        // record its id in the bboxes node-id-tracker
+        extract->node_tracker.set(node->id());
+    }
 
     void init(Osmium::OSM::Meta& meta) {
         std::cerr << "hardcut init" << std::endl;
@@ -101,22 +219,10 @@ public:
     void node(const shared_ptr<Osmium::OSM::Node const>& node) {
         if(debug) std::cerr << "hardcut node " << node->id() << " v" << node->version() << std::endl;
         else pg.node(node);
+        info->check_pressure();
 
-        // walk over all bboxes
-        for(int i = 0, l = info->extracts.size(); i<l; i++) {
-            // shorthand
-            HardcutExtractInfo *extract = info->extracts[i];
-
-            // if the node-version is in the bbox
-            if(extract->contains(node)) {
-                // write the node to the writer of this bbox
-                if(debug) std::cerr << "node " << node->id() << " v" << node->version() << " is inside bbox[" << i << "], writing it out" << std::endl;
-                extract->writer->node(node);
-
-                // record its id in the bboxes node-id-tracker
-                extract->node_tracker.set(node->id());
-            }
-        }
+        // walk over all bboxes the node-version is in
+        this->dispatch_node(this, node);
 
         // record the last id
         last_id = node->id();
@@ -133,74 +239,109 @@ public:
         last_id = 0;
     }
 
-    // walk over all way-versions
+    // walk over all way-versions, collecting them into batches
     void way(const shared_ptr<Osmium::OSM::Way const>& way) {
         if(debug) std::cerr << "hardcut way " << way->id() << " v" << way->version() << std::endl;
         else pg.way(way);
+        info->check_pressure();
+
+        way_batch.add(way, way_memo.unchanged(way));
+        if(way_batch.full())
+            cut_ways();
+
+        // record the last id
+        last_id = way->id();
+    }
+
+    // probe the waynodes of all collected way-versions at once, then cut them bbox by bbox
+    void cut_ways() {
+        if(way_batch.empty())
+            return;
+
+        way_batch.nodes.prepare(info->extracts.size());
 
         // walk over all bboxes
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
             // shorthand
             HardcutExtractInfo *extract = info->extracts[i];
 
-            // create a new way NULL pointer
-            shared_ptr<Osmium::OSM::Way> newway;
+            // look up all waynodes of the batch in the node-id-tracker of this bbox
+            way_batch.nodes.probe(extract->node_tracker);
+
+            // the node-trackers don't change while reading ways, so unchanged waynodes are cut the same way
+            bool cut_valid = false;
 
-            // walk over all waynodes
-            for(osm_sequence_id_t ii = 0, ll = way->nodes().size(); ii < ll; ii++) {
+            // walk over all way-versions of the batch
+            for(int w = 0, wl = way_batch.size(); w < wl; w++) {
                 // shorthand
-                osm_object_id_t node_id = way->get_node_id(ii);
-
-                // if the waynode is in the node-id-tracker of this bbox
-                if(extract->node_tracker.get(node_id)) {
-                    // if the new way pointer is NULL
-                    if(!newway) {
-                        // create a new way with all meta-data and tags but without waynodes
-                        if(debug) std::cerr << "creating cutted way " << way->id() << " v" << way->version() << " for bbox[" << i << "]" << std::endl;
-                        newway = shared_ptr<Osmium::OSM::Way>(new Osmium::OSM::Way());
-                        newway->id(way->id());
-                        newway->version(way->version());
-                        newway->uid(way->uid());
-                        newway->changeset(way->changeset());
-                        newway->timestamp(way->timestamp());
-                        newway->visible(way->visible());
-                        newway->user(way->user());
-                        for(Osmium::OSM::TagList::const_iterator it = way->tags().begin(); it != way->tags().end(); ++it) {
-                            newway->tags().add(it->key(), it->value());
+                const shared_ptr<Osmium::OSM::Way const>& way = way_batch.ways[w];
+
+                if(!way_batch.same_nodes(w)) {
+                    cut_valid = false;
+                } else if(cut_valid) {
+                    if(debug) std::cerr << "waynodes of way " << way->id() << " v" << way->version() << " did not change, reusing the cut of the last version" << std::endl;
+                }
+
+                // skip ways rejected by the filter of this bbox
+                if(extract->options.filter.active() && !extract->options.filter.matches(*way)) {
+                    continue;
+                }
+
+                // collect the waynodes inside this bbox, unless the last version already did
+                if(!cut_valid) {
+                    cut_way_nodes.clear();
+
+                    // walk over all waynodes
+                    uint32_t ref = way_batch.first_node(w);
+                    for(osm_sequence_id_t ii = 0, ll = way->nodes().size(); ii < ll; ii++, ref++) {
+                        // if the waynode is in the node-id-tracker of this bbox
+                        if(way_batch.nodes.hit(ref)) {
+                            // shorthand
+                            osm_object_id_t node_id = way->get_node_id(ii);
+
+                            // add the waynode to the new way
+                            if(debug) std::cerr << "adding node-id " << node_id << " to cutted way " << way->id() << " v" << way->version() << " for bbox[" << i << "]" << std::endl;
+                            cut_way_nodes.push_back(node_id);
                         }
                     }
+                    cut_valid = true;
+                }
 
-                    // add the waynode to the new way
-                    if(debug) std::cerr << "adding node-id " << node_id << " to cutted way " << way->id() << " v" << way->version() << " for bbox[" << i << "]" << std::endl;
-                    newway->add_node(node_id);
+                // if no waynode is inside this bbox
+                if(cut_way_nodes.empty()) {
+                    continue;
                 }
-            }
 
-            // if the way pointer is not NULL
-            if(newway.get()) {
-                // enable way-writing for this bbox
                 if(debug) std::cerr << "way " << way->id() << " v" << way->version() << " is in bbox[" << i << "]" << std::endl;
 
-                // check for short ways
-                if(newway->nodes().size() < 2) {
-                    if(debug) std::cerr << "way " << way->id() << " v" << way->version() << " in bbox[" << i << "] would only be " << newway->nodes().size() << " nodes long, skipping" << std::endl;
+                // check for short ways before building the cutted way
+                if(cut_way_nodes.size() < 2) {
+                    if(debug) std::cerr << "way " << way->id() << " v" << way->version() << " in bbox[" << i << "] would only be " << cut_way_nodes.size() << " nodes long, skipping" << std::endl;
                     continue;
                 }
 
+                // create a new way with all meta-data and tags and the collected waynodes
+                if(debug) std::cerr << "creating cutted way " << way->id() << " v" << way->version() << " for bbox[" << i << "]" << std::endl;
+                shared_ptr<Osmium::OSM::Way> newway = prepare_cut_way(way);
+                for(std::vector<osm_object_id_t>::const_iterator it = cut_way_nodes.begin(); it != cut_way_nodes.end(); ++it) {
+                    newway->add_node(*it);
+                }
+
                 // write the way to the writer of this bbox
                 if(debug) std::cerr << "way " << way->id() << " v" << way->version() << " is inside bbox[" << i << "], writing it out" << std::endl;
-                extract->writer->way(newway);
+                extract->output('w', way->id())->way(newway);
 
                 // record its id in the bboxes way-id-tracker
                 extract->way_tracker.set(way->id());
             }
         }
 
-        // record the last id
-        last_id = way->id();
+        way_batch.clear();
     }
 
     void after_ways() {
+        cut_ways();
+
         if(debug) {
             std::cerr << "after ways" << std::endl <<
                 std::endl << std::endl << "===== RELATIONS =====" << std::endl << std::endl;
@@ -211,59 +352,85 @@ public:
         last_id = 0;
     }
 
-    // walk over all relation-versions
+    // walk over all relation-versions, collecting them into batches
     void relation(const shared_ptr<Osmium::OSM::Relation const>& relation) {
         if(debug) std::cerr << "hardcut relation " << relation->id() << " v" << relation->version() << std::endl;
         else pg.relation(relation);
+        info->check_pressure();
+
+        relation_batch.add(relation);
+        if(relation_batch.full())
+            cut_relations();
+
+        // record the last id
+        last_id = relation->id();
+    }
+
+    // probe the members of all collected relation-versions at once, then cut them bbox by bbox
+    void cut_relations() {
+        if(relation_batch.empty())
+            return;
+
+        relation_batch.prepare(info->extracts.size());
 
         // walk over all bboxes
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
             // shorthand
             HardcutExtractInfo *extract = info->extracts[i];
 
-            // create a new relation NULL pointer
-            shared_ptr<Osmium::OSM::Relation> newrelation;
-
-            // walk over all relation members
-            for(Osmium::OSM::RelationMemberList::const_iterator it = relation->members().begin(); it != relation->members().end(); ++it) {
-                // if the relation members is in the node-id-tracker or the way-id-tracker of this bbox
-                if((it->type() == 'n' && extract->node_tracker.get(it->ref())) || (it->type() == 'w' && extract->way_tracker.get(it->ref()))) {
-                    // if the new way pointer is NULL
-                    if(!newrelation) {
-                        // create a new relation with all meta-data and tags but without waynodes
-                        if(debug) std::cerr << "creating cutted relation " << relation->id() << " v" << relation->version() << " for bbox[" << i << "]" << std::endl;
-                        newrelation = shared_ptr<Osmium::OSM::Relation>(new Osmium::OSM::Relation());
-                        newrelation->id(relation->id());
-                        newrelation->version(relation->version());
-                        newrelation->uid(relation->uid());
-                        newrelation->changeset(relation->changeset());
-                        newrelation->timestamp(relation->timestamp());
-                        newrelation->visible(relation->visible());
-                        newrelation->user(relation->user());
-                        for(Osmium::OSM::TagList::const_iterator it = relation->tags().begin(); it != relation->tags().end(); ++it) {
-                            newrelation->tags().add(it->key(), it->value());
-                        }
+            // look up all members of the batch in the node-id-tracker and the way-id-tracker of this bbox
+            relation_batch.nodes.probe(extract->node_tracker);
+            relation_batch.ways.probe(extract->way_tracker);
+
+            // walk over all relation-versions of the batch
+            for(int r = 0, rl = relation_batch.size(); r < rl; r++) {
+                // shorthand
+                const shared_ptr<Osmium::OSM::Relation const>& relation = relation_batch.relations[r];
+                const Osmium::OSM::RelationMemberList& members = relation->members();
+
+                // skip relations rejected by the filter of this bbox
+                if(extract->options.filter.active() && !extract->options.filter.matches(*relation)) {
+                    continue;
+                }
+
+                // collect the members inside this bbox
+                cut_relation_members.clear();
+
+                // walk over all relation members
+                for(int ii = 0, ll = members.size(); ii < ll; ii++) {
+                    // if the relation members is in the node-id-tracker or the way-id-tracker of this bbox
+                    if(relation_batch.hit(r, ii)) {
+                        // add the member to the new relation
+                        if(debug) std::cerr << "adding member " << members[ii].type() << " id " << members[ii].ref() << " to cutted relation " << relation->id() << " v" << relation->version() << "for bbox[" << i << "]" << std::endl;
+                        cut_relation_members.push_back(ii);
                     }
+                }
 
-                    // add the member to the new relation
-                    if(debug) std::cerr << "adding member " << it->type() << " id " << it->ref() << " to cutted relation " << relation->id() << " v" << relation->version() << "for bbox[" << i << "]" << std::endl;
-                    newrelation->add_member(it->type(), it->ref(), it->role());
+                // if no member is inside this bbox
+                if(cut_relation_members.empty()) {
+                    continue;
                 }
-            }
 
-            // if the relation pointer is not NULL
-            if(newrelation.get()) {
-                // write the way to the writer of this bbox
+                // create a new relation with all meta-data and tags and the collected members
+                if(debug) std::cerr << "creating cutted relation " << relation->id() << " v" << relation->version() << " for bbox[" << i << "]" << std::endl;
+                shared_ptr<Osmium::OSM::Relation> newrelation = prepare_cut_relation(relation);
+                for(std::vector<int>::const_iterator it = cut_relation_members.begin(); it != cut_relation_members.end(); ++it) {
+                    const Osmium::OSM::RelationMember& member = members[*it];
+                    newrelation->add_member(member.type(), member.ref(), member.role());
+                }
+
+                // write the relation to the writer of this bbox
                 if(debug) std::cerr << "relation " << relation->id() << " v" << relation->version() << " is inside bbox[" << i << "], writing it out" << std::endl;
-                extract->writer->relation(newrelation);
+                extract->output('r', relation->id())->relation(newrelation);
             }
         }
 
-        // record the last id
-        last_id = relation->id();
+        relation_batch.clear();
     }
 
     void after_relations() {
+        cut_relations();
+
         if(debug) {
             std::cerr << "after relation" << std::endl;
         } else {
@@ -274,6 +441,10 @@ public:
     }
 
     void final() {
+        // in case the input ended without calling after_ways() or after_relations()
+        cut_ways();
+        cut_relations();
+
         if(!debug) {
             pg.final();
         }
@@ -0,0 +1,547 @@
+#ifndef SPLITTER_IO_HPP
+#define SPLITTER_IO_HPP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "tempfiles.hpp"
+
+/*
+
+I/O Layer
+ - Input Pump (--readahead)
+   - like the stdin spool, stdin is replaced by a pipe and osmium reads the pipe
+   - a reader-thread reads the input in large aligned blocks into a queue holding
+     up to --readahead bytes, a writer-thread moves them into the pipe, so reading
+     the disk, decoding and cutting overlap
+   - the input is read with POSIX_FADV_SEQUENTIAL, with --io-direct it bypasses the
+     page cache, so reading a planet doesn't evict everything else
+ - Batched Writes (--write-batch)
+   - the compressed blocks of an output are collected and written in large batches
+     instead of one write per block
+   - with --io-direct the outputs are written past the page cache, the unaligned
+     tail of a file is written normally when it is closed
+ - the input pump and the stdin spool replace stdin with the same StdinPipe, a
+   reader which stops early shows up as EPIPE because main() ignores SIGPIPE
+ - all reads and writes are counted per device, the bytes and the time spent in
+   read() and write() are reported at the end
+
+*/
+
+// bytes and time of all reads and writes, by device
+class IoStats {
+
+private:
+    struct Device {
+        unsigned long long read_bytes;
+        unsigned long long written_bytes;
+        double read_seconds;
+        double write_seconds;
+
+        Device() : read_bytes(0), written_bytes(0), read_seconds(0), write_seconds(0) {}
+    };
+
+    pthread_mutex_t mutex;
+    std::map<dev_t, Device> devices;
+
+    IoStats() {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    // the name of a block device, like nvme0n1p1, or major:minor
+    static std::string device_name(dev_t dev) {
+        char path[64], target[256];
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+
+        ssize_t len = readlink(path, target, sizeof(target) - 1);
+        if(len > 0) {
+            target[len] = '\0';
+            const char *base = strrchr(target, '/');
+            return base ? base + 1 : target;
+        }
+
+        snprintf(path, sizeof(path), "%u:%u", major(dev), minor(dev));
+        return path;
+    }
+
+public:
+    static IoStats &instance() {
+        static IoStats stats;
+        return stats;
+    }
+
+    static double now() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+
+    static dev_t device_of(int fd) {
+        struct stat st;
+        return 0 == fstat(fd, &st) ? st.st_dev : 0;
+    }
+
+    void add_read(dev_t dev, size_t bytes, double seconds) {
+        pthread_mutex_lock(&mutex);
+        devices[dev].read_bytes += bytes;
+        devices[dev].read_seconds += seconds;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void add_write(dev_t dev, size_t bytes, double seconds) {
+        pthread_mutex_lock(&mutex);
+        devices[dev].written_bytes += bytes;
+        devices[dev].write_seconds += seconds;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void report() {
+        pthread_mutex_lock(&mutex);
+        for(std::map<dev_t, Device>::const_iterator it = devices.begin(); it != devices.end(); ++it) {
+            const Device &d = it->second;
+            std::cerr << "device " << device_name(it->first) << ":";
+            if(d.read_bytes > 0) {
+                std::cerr << " read " << (d.read_bytes / (1024*1024)) << " MB in " << d.read_seconds << " s";
+                if(d.read_seconds > 0) std::cerr << " (" << static_cast<int>(d.read_bytes / (1024*1024) / d.read_seconds) << " MB/s)";
+            }
+            if(d.written_bytes > 0) {
+                std::cerr << " written " << (d.written_bytes / (1024*1024)) << " MB in " << d.write_seconds << " s";
+                if(d.write_seconds > 0) std::cerr << " (" << static_cast<int>(d.written_bytes / (1024*1024) / d.write_seconds) << " MB/s)";
+            }
+            std::cerr << std::endl;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+// a buffer aligned for O_DIRECT
+class AlignedBuffer {
+
+private:
+    char *data;
+    size_t capacity;
+
+    AlignedBuffer(const AlignedBuffer &);
+    AlignedBuffer &operator=(const AlignedBuffer &);
+
+public:
+    static const size_t alignment = 4096;
+
+    size_t size;
+
+    AlignedBuffer(size_t capacity) : data(NULL), capacity(capacity), size(0) {
+        void *mem;
+        if(0 != posix_memalign(&mem, alignment, capacity)) {
+            std::cerr << "unable to allocate " << capacity << " bytes of aligned memory" << std::endl;
+            TempFiles::fail_thread();
+        }
+        data = static_cast<char *>(mem);
+    }
+
+    ~AlignedBuffer() {
+        free(data);
+    }
+
+    char *get() {
+        return data;
+    }
+
+    size_t free_space() const {
+        return capacity - size;
+    }
+};
+
+// replaces stdin by a pipe, so osmium reads what a feeder-thread writes into it
+class StdinPipe {
+
+private:
+    int saved_stdin;
+    int write_fd;
+
+public:
+    StdinPipe() : saved_stdin(-1), write_fd(-1) {}
+
+    /**
+     * let the read end of a new pipe take the place of stdin, the real stdin
+     * is kept for real_stdin() and put back by restore(). pipe_size is a hint for
+     * the capacity of the pipe, 0 keeps the default.
+     *
+     * this method returns false and leaves stdin alone if that fails.
+     */
+    bool replace_stdin(size_t pipe_size) {
+        int fds[2];
+        if(0 != pipe(fds)) {
+            std::cerr << "unable to create pipe: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+#ifdef F_SETPIPE_SZ
+        // a larger pipe means fewer context switches, it's only a hint
+        if(pipe_size > 0)
+            fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(pipe_size));
+#endif
+
+        saved_stdin = dup(0);
+        if(saved_stdin < 0 || dup2(fds[0], 0) < 0) {
+            std::cerr << "unable to replace stdin by a pipe: " << strerror(errno) << std::endl;
+            if(saved_stdin >= 0)
+                close(saved_stdin);
+            saved_stdin = -1;
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        close(fds[0]);
+        write_fd = fds[1];
+        return true;
+    }
+
+    // the real stdin, while the pipe takes its place
+    int real_stdin() const {
+        return saved_stdin;
+    }
+
+    /**
+     * write everything into the pipe, from the feeder-thread. SIGPIPE is
+     * ignored by main(), so a reader which stopped early shows up as EPIPE.
+     *
+     * this method returns false if the reader went away.
+     */
+    bool write(const char *data, size_t len) {
+        size_t pos = 0;
+        while(pos < len) {
+            ssize_t w = ::write(write_fd, data + pos, len - pos);
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                if(errno == EPIPE) return false;
+                std::cerr << "error writing input into the pipe: " << strerror(errno) << std::endl;
+                TempFiles::fail_thread();
+            }
+            pos += w;
+        }
+        return true;
+    }
+
+    // end of the input, from the feeder-thread
+    void close_writer() {
+        if(write_fd >= 0)
+            close(write_fd);
+        write_fd = -1;
+    }
+
+    // close the read end, so a feeder-thread still writing stops with EPIPE
+    void close_reader() {
+        close(0);
+    }
+
+    // put the real stdin back, after the feeder-thread finished
+    void restore() {
+        if(saved_stdin >= 0) {
+            if(dup2(saved_stdin, 0) < 0)
+                std::cerr << "unable to restore stdin: " << strerror(errno) << std::endl;
+            close(saved_stdin);
+        }
+        saved_stdin = -1;
+    }
+
+    /**
+     * start a feeder-thread.
+     *
+     * this method returns false if the thread can't be created.
+     */
+    static bool start_thread(pthread_t &thread, void *(*main)(void *), void *arg) {
+        int err = pthread_create(&thread, NULL, main, arg);
+        if(err != 0) {
+            std::cerr << "unable to start thread: " << strerror(err) << std::endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+// reads the input ahead on its own threads and feeds it to osmium through stdin
+class InputPump {
+
+private:
+    std::string filename;
+    size_t readahead;
+    bool direct;
+
+    static const size_t block_size = 4*1024*1024;
+
+    pthread_t reader;
+    pthread_t writer;
+
+    int in_fd;
+    StdinPipe pipe;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::deque<AlignedBuffer*> queue;
+    bool eof;
+    bool cancelled;
+
+    void read_all() {
+        dev_t dev = IoStats::device_of(in_fd);
+        size_t max_blocks = readahead / block_size > 0 ? readahead / block_size : 1;
+
+        while(1) {
+            AlignedBuffer *buf = new AlignedBuffer(block_size);
+
+            double start = IoStats::now();
+            while(buf->free_space() > 0) {
+                ssize_t r = ::read(in_fd, buf->get() + buf->size, buf->free_space());
+                if(r < 0) {
+                    if(errno == EINTR) continue;
+                    std::cerr << "error reading " << filename << ": " << strerror(errno) << std::endl;
+                    TempFiles::fail_thread();
+                }
+                if(r == 0) break;
+                buf->size += r;
+            }
+            IoStats::instance().add_read(dev, buf->size, IoStats::now() - start);
+
+            bool last = buf->free_space() > 0;
+
+            pthread_mutex_lock(&mutex);
+            while(queue.size() >= max_blocks && !cancelled) {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            if(cancelled) {
+                pthread_mutex_unlock(&mutex);
+                delete buf;
+                break;
+            }
+            queue.push_back(buf);
+            eof = last;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+
+            if(last)
+                break;
+        }
+
+        close(in_fd);
+    }
+
+    void write_all() {
+        bool piping = true;
+
+        while(1) {
+            pthread_mutex_lock(&mutex);
+            while(queue.empty() && !eof) {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            if(queue.empty()) {
+                pthread_mutex_unlock(&mutex);
+                break;
+            }
+            AlignedBuffer *buf = queue.front();
+            queue.pop_front();
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+
+            // if the reader stopped early, keep on draining the queue
+            if(piping && !pipe.write(buf->get(), buf->size))
+                piping = false;
+            delete buf;
+        }
+
+        pipe.close_writer();
+    }
+
+    static void *reader_main(void *arg) {
+        static_cast<InputPump *>(arg)->read_all();
+        return NULL;
+    }
+
+    static void *writer_main(void *arg) {
+        static_cast<InputPump *>(arg)->write_all();
+        return NULL;
+    }
+
+public:
+    InputPump(const std::string &filename, size_t readahead, bool direct) :
+        filename(filename), readahead(readahead), direct(direct), in_fd(-1), eof(false), cancelled(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    ~InputPump() {
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&cond);
+    }
+
+    /**
+     * replace stdin with the pipe and start reading the input from its beginning.
+     *
+     * this method returns false if the input can't be opened.
+     */
+    bool start() {
+        in_fd = -1;
+        if(direct) {
+            // not every filesystem supports O_DIRECT, fall back to the page cache
+            in_fd = open(filename.c_str(), O_RDONLY | O_DIRECT);
+            if(in_fd < 0 && errno == EINVAL)
+                std::cerr << "O_DIRECT is not supported for " << filename << ", reading through the page cache" << std::endl;
+        }
+        if(in_fd < 0)
+            in_fd = open(filename.c_str(), O_RDONLY);
+        if(in_fd < 0) {
+            std::cerr << "unable to open " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        if(!pipe.replace_stdin(1024*1024)) {
+            close(in_fd);
+            return false;
+        }
+        eof = false;
+        cancelled = false;
+
+        if(!StdinPipe::start_thread(reader, &InputPump::reader_main, this)) {
+            close(in_fd);
+            pipe.close_reader();
+            pipe.close_writer();
+            pipe.restore();
+            return false;
+        }
+
+        if(!StdinPipe::start_thread(writer, &InputPump::writer_main, this)) {
+            // stop the reader, it may wait for room in the queue
+            pthread_mutex_lock(&mutex);
+            cancelled = true;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+            pthread_join(reader, NULL);
+            for(int i = 0, l = queue.size(); i<l; i++) {
+                delete queue[i];
+            }
+            queue.clear();
+
+            pipe.close_reader();
+            pipe.close_writer();
+            pipe.restore();
+            return false;
+        }
+        return true;
+    }
+
+    // wait for the threads after osmium finished reading and restore stdin
+    void finish() {
+        pipe.close_reader();
+        pthread_join(reader, NULL);
+        pthread_join(writer, NULL);
+        pipe.restore();
+    }
+};
+
+// collects writes into large batches, optionally written with O_DIRECT
+class BatchedWriter {
+
+private:
+    std::string filename;
+    int fd;
+    bool direct;
+    dev_t dev;
+    AlignedBuffer buf;
+
+    void write_raw(const char *data, size_t len) {
+        double start = IoStats::now();
+        size_t pos = 0;
+        while(pos < len) {
+            ssize_t w = ::write(fd, data + pos, len - pos);
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "error writing to " << filename << ": " << strerror(errno) << std::endl;
+                TempFiles::fail_thread();
+            }
+            pos += w;
+        }
+        IoStats::instance().add_write(dev, len, IoStats::now() - start);
+    }
+
+    // write the aligned part of the batch and keep the rest
+    void flush_aligned() {
+        size_t len = direct ? buf.size - buf.size % AlignedBuffer::alignment : buf.size;
+        if(len == 0)
+            return;
+
+        write_raw(buf.get(), len);
+        memmove(buf.get(), buf.get() + len, buf.size - len);
+        buf.size -= len;
+    }
+
+public:
+    /**
+     * open the output file, with O_DIRECT if requested and supported.
+     * the batch size is rounded up to the alignment of O_DIRECT.
+     */
+    BatchedWriter(const std::string &filename, size_t batch_size, bool direct) :
+        filename(filename), fd(-1), direct(direct), dev(0),
+        buf((batch_size + AlignedBuffer::alignment - 1) / AlignedBuffer::alignment * AlignedBuffer::alignment + AlignedBuffer::alignment) {
+
+        if(direct) {
+            fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+            if(fd < 0 && errno == EINVAL) {
+                std::cerr << "O_DIRECT is not supported for " << filename << ", writing through the page cache" << std::endl;
+                this->direct = false;
+            }
+        }
+        if(fd < 0)
+            fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0) {
+            std::cerr << "unable to open output file " << filename << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        dev = IoStats::device_of(fd);
+    }
+
+    void write(const char *data, size_t len) {
+        while(len > 0) {
+            size_t n = std::min(len, buf.free_space());
+            memcpy(buf.get() + buf.size, data, n);
+            buf.size += n;
+            data += n;
+            len -= n;
+
+            if(buf.free_space() == 0)
+                flush_aligned();
+        }
+    }
+
+    // write the rest, the unaligned tail without O_DIRECT, and close the file
+    void close() {
+        flush_aligned();
+        if(buf.size > 0) {
+            if(direct)
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            write_raw(buf.get(), buf.size);
+            buf.size = 0;
+        }
+
+        if(::close(fd) != 0) {
+            std::cerr << "error closing output file " << filename << ": " << strerror(errno) << std::endl;
+            TempFiles::fail_thread();
+        }
+    }
+};
+
+#endif // SPLITTER_IO_HPP
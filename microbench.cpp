@@ -0,0 +1,317 @@
+/*
+
+Microbenchmarks for the hot spots of the splitter
+ - points/second through ExtractInfo::contains for every containment strategy,
+   using the real polygons from the clipbounds directory
+ - set/get throughput and memory of the growing_bitset at realistic id distributions,
+   probing one id after the other and in sorted batches like the way- and relation-phases
+
+the results are printed as tab-separated lines to stdout, one measurement per line:
+  benchmark  subject  strategy  value  unit
+
+progress and errors go to stderr, so the output can be redirected into a file and
+compared between machines and strategies.
+
+usage: microbench [-n POINTS] [-i IDS] [-m MAXID] [POLYFILE|DIRECTORY...]
+       (defaults to the clipbounds directory)
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define OSMIUM_MAIN
+#define OSMIUM_WITH_PBF_INPUT
+#define OSMIUM_WITH_XML_INPUT
+#define OSMIUM_WITH_PBF_OUTPUT
+#define OSMIUM_WITH_XML_OUTPUT
+#include <osmium.hpp>
+#include <osmium/output/pbf.hpp>
+#include <osmium/output/xml.hpp>
+
+#include <geos/geom/MultiPolygon.h>
+#include <geos/algorithm/locate/IndexedPointInAreaLocator.h>
+
+#include "cut.hpp"
+#include "probe_batch.hpp"
+
+// monotonic time in seconds
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 64 bit xorshift, fast enough not to show up in the measurements
+class Random {
+    uint64_t state;
+
+public:
+    Random(uint64_t seed) : state(seed ? seed : 88172645463325252ULL) {}
+
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    double uniform(double min, double max) {
+        return min + (max - min) * (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+void result(const char *benchmark, const std::string &subject, const char *strategy, double value, const char *unit) {
+    printf("%s\t%s\t%s\t%.1f\t%s\n", benchmark, subject.c_str(), strategy, value, unit);
+    fflush(stdout);
+}
+
+// collect all .poly files below a path
+void find_polyfiles(const std::string &path, std::vector<std::string> &files) {
+    struct stat st;
+    if(0 != stat(path.c_str(), &st)) {
+        std::cerr << "unable to stat " << path << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    if(!S_ISDIR(st.st_mode)) {
+        files.push_back(path);
+        return;
+    }
+
+    DIR *dir = opendir(path.c_str());
+    if(!dir) {
+        std::cerr << "unable to open directory " << path << std::endl;
+        return;
+    }
+
+    std::vector<std::string> entries;
+    while(struct dirent *ent = readdir(dir)) {
+        std::string entry = ent->d_name;
+        if(entry == "." || entry == "..")
+            continue;
+        entries.push_back(entry);
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end());
+    for(std::vector<std::string>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        std::string full = path + "/" + *it;
+        if(0 == stat(full.c_str(), &st) && S_ISDIR(st.st_mode))
+            find_polyfiles(full, files);
+        else if(it->size() > 5 && 0 == it->compare(it->size()-5, 5, ".poly"))
+            files.push_back(full);
+    }
+}
+
+// points/second through one containment strategy
+template <class TTest>
+void bench_contains(const std::string &subject, const char *strategy, const std::vector< shared_ptr<Osmium::OSM::Node const> > &points, TTest test) {
+    int inside = 0;
+
+    double start = now();
+    for(int i = 0, l = points.size(); i<l; i++) {
+        if(test(points[i]))
+            inside++;
+    }
+    double duration = now() - start;
+
+    result("contains", subject, strategy, points.size() / duration, "points/s");
+    result("contains-inside", subject, strategy, 100.0 * inside / points.size(), "percent");
+}
+
+struct ContainsBounds {
+    const ExtractInfo *extract;
+    ContainsBounds(const ExtractInfo *extract) : extract(extract) {}
+    bool operator()(const shared_ptr<Osmium::OSM::Node const>& node) const {
+        return extract->contains_bounds(node);
+    }
+};
+
+struct ContainsPrepared {
+    const ExtractInfo *extract;
+    ContainsPrepared(const ExtractInfo *extract) : extract(extract) {}
+    bool operator()(const shared_ptr<Osmium::OSM::Node const>& node) const {
+        return extract->contains_prepared(node);
+    }
+};
+
+struct ContainsLocator {
+    const ExtractInfo *extract;
+    ContainsLocator(const ExtractInfo *extract) : extract(extract) {}
+    bool operator()(const shared_ptr<Osmium::OSM::Node const>& node) const {
+        return extract->contains_locator(node);
+    }
+};
+
+void bench_polygon(const std::string &file, int npoints, Random &rnd) {
+    geos::geom::Geometry *geom = OsmiumExtension::GeometryReader::fromPolyFile(file);
+    if(!geom) {
+        std::cerr << "error creating geometry from poly-file " << file << std::endl;
+        return;
+    }
+
+    const geos::geom::Envelope *env = geom->getEnvelopeInternal();
+
+    // random points inside the envelope, so the mix of inside and outside points
+    // depends on the shape of the polygon
+    std::vector< shared_ptr<Osmium::OSM::Node const> > points;
+    points.reserve(npoints);
+    for(int i = 0; i < npoints; i++) {
+        shared_ptr<Osmium::OSM::Node> node(new Osmium::OSM::Node());
+        node->id(i+1);
+        node->position(Osmium::OSM::Position(
+            rnd.uniform(env->getMinX(), env->getMaxX()),
+            rnd.uniform(env->getMinY(), env->getMaxY())
+        ));
+        points.push_back(node);
+    }
+
+    ExtractInfo extract(file);
+    extract.bounds.extend(Osmium::OSM::Position(env->getMinX(), env->getMinY())).extend(Osmium::OSM::Position(env->getMaxX(), env->getMaxY()));
+
+    double start = now();
+    extract.locator = new geos::algorithm::locate::IndexedPointInAreaLocator(*geom);
+    // newer geos versions build the index lazily, the first lookup pays for it
+    extract.contains_locator(points[0]);
+    result("prepare", file, "LOCATOR", (now() - start) * 1000, "ms");
+
+    start = now();
+    extract.prepared = new PreparedPolygon(geom);
+    result("prepare", file, "PREPARED", (now() - start) * 1000, "ms");
+    result("prepare-tiles", file, "PREPARED", 100.0 * extract.prepared->resolved_tiles(), "percent");
+
+    bench_contains(file, "BOUNDS", points, ContainsBounds(&extract));
+    bench_contains(file, "LOCATOR", points, ContainsLocator(&extract));
+    bench_contains(file, "PREPARED", points, ContainsPrepared(&extract));
+
+    Osmium::Geometry::geos_geometry_factory()->destroyGeometry(geom);
+}
+
+void bench_bitset(const char *distribution, const std::vector<osm_object_id_t> &ids) {
+    growing_bitset bitset;
+
+    double start = now();
+    for(int i = 0, l = ids.size(); i<l; i++) {
+        bitset.set(ids[i]);
+    }
+    double duration = now() - start;
+    result("bitset-set", distribution, "growing_bitset", ids.size() / duration, "ids/s");
+
+    int hits = 0;
+    start = now();
+    for(int i = 0, l = ids.size(); i<l; i++) {
+        // probe the id and its neighbour, so sparse distributions also measure misses
+        if(bitset.get(ids[i]))
+            hits++;
+        if(bitset.get(ids[i] + 1))
+            hits++;
+    }
+    duration = now() - start;
+    result("bitset-get", distribution, "growing_bitset", 2 * ids.size() / duration, "ids/s");
+
+    // the same probes in batches, including sorting them and scattering the results back
+    ProbeSet batch;
+    start = now();
+    for(int i = 0, l = ids.size(); i<l; i++) {
+        batch.add(ids[i]);
+        batch.add(ids[i] + 1);
+
+        if(batch.size() >= 256*1024 || i == l-1) {
+            batch.prepare(ProbeSet::sort_threshold);
+            batch.probe(bitset);
+            for(uint32_t ref = 0, refs = batch.size(); ref < refs; ref++) {
+                if(batch.hit(ref))
+                    hits++;
+            }
+            batch.clear();
+        }
+    }
+    duration = now() - start;
+    result("bitset-get", distribution, "batched", 2 * ids.size() / duration, "ids/s");
+
+    result("bitset-memory", distribution, "growing_bitset", bitset.memory_usage() / (1024.0 * 1024.0), "MB");
+
+    // keep the compiler from dropping the probes
+    if(hits < 0) std::cerr << hits;
+}
+
+int main(int argc, char *argv[]) {
+    int npoints = 1000000;
+    int nids = 10000000;
+    osm_object_id_t maxid = 2000000000;
+
+    while (1) {
+        int c = getopt(argc, argv, "n:i:m:");
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'n':
+                npoints = atoi(optarg);
+                break;
+            case 'i':
+                nids = atoi(optarg);
+                break;
+            case 'm':
+                maxid = atoll(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-n POINTS] [-i IDS] [-m MAXID] [POLYFILE|DIRECTORY...]" << std::endl;
+                return 1;
+        }
+    }
+
+    std::vector<std::string> files;
+    if(optind == argc) {
+        find_polyfiles("clipbounds", files);
+    }
+    for(int i = optind; i < argc; i++) {
+        find_polyfiles(argv[i], files);
+    }
+
+    Random rnd(42);
+
+    printf("benchmark\tsubject\tstrategy\tvalue\tunit\n");
+
+    for(int i = 0, l = files.size(); i<l; i++) {
+        std::cerr << "polygon " << (i+1) << "/" << l << ": " << files[i] << std::endl;
+        bench_polygon(files[i], npoints, rnd);
+    }
+
+    std::cerr << "bitsets with " << nids << " ids up to " << maxid << std::endl;
+    std::vector<osm_object_id_t> ids(nids);
+
+    // ids of a small extract: uniformly spread over the whole id-space
+    for(int i = 0; i < nids; i++) {
+        ids[i] = rnd.next() % maxid;
+    }
+    bench_bitset("random", ids);
+
+    // ids of a country: clustered runs with gaps, in file order
+    osm_object_id_t id = 0;
+    for(int i = 0; i < nids; i++) {
+        if(rnd.next() % 64 == 0)
+            id += rnd.next() % (maxid / (nids / 64 + 1) + 1);
+        id++;
+        ids[i] = id % maxid;
+    }
+    bench_bitset("clustered", ids);
+
+    // ids of a continent: dense and sequential
+    for(int i = 0; i < nids; i++) {
+        ids[i] = i;
+    }
+    bench_bitset("sequential", ids);
+
+    return 0;
+}
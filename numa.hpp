@@ -0,0 +1,151 @@
+#ifndef SPLITTER_NUMA_HPP
+#define SPLITTER_NUMA_HPP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include <iostream>
+
+/*
+
+NUMA Placement (--numa)
+ - the nodes and their cpus are read from /sys/devices/system/node, the memory
+   policy is set with the raw system calls, so libnuma is not needed
+ - a single split places the extracts of each config line on the next node, round
+   robin. while the line is read the process prefers that node, so its geometry
+   and locator are allocated there. its tracker segments are bound to the node
+   when they are allocated and its output is served by a sink thread pinned to
+   the node's cpus
+ - the cut itself is a single thread walking all extracts, it's not pinned and
+   pays remote latency for the extracts of the other nodes
+ - with --threads every pass is bound to the node running the fewest passes, so
+   the cut, the trackers and the sinks of a pass share one node
+
+*/
+
+class Numa {
+
+private:
+    // from linux/mempolicy.h
+    static const int MPOL_DEFAULT_POLICY = 0;
+    static const int MPOL_PREFERRED_POLICY = 1;
+
+    static const int max_nodes = 1024;
+    static const int mask_words = max_nodes / (8 * sizeof(unsigned long));
+
+    static int &preferred_node() {
+        static int node = -1;
+        return node;
+    }
+
+    static void node_mask(int node, unsigned long *mask) {
+        memset(mask, 0, mask_words * sizeof(unsigned long));
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    }
+
+public:
+    // number of nodes, 0 if the system doesn't tell
+    static int nodes() {
+        static int count = -1;
+        if(count < 0) {
+            count = 0;
+            char path[64];
+            while(count < max_nodes) {
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", count);
+                if(0 != access(path, F_OK))
+                    break;
+                count++;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * the cpus of a node, from its cpulist (ie. 0-11,24-35).
+     *
+     * this method returns false if the cpulist can't be read.
+     */
+    static bool cpus(int node, cpu_set_t &set) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen(path, "r");
+        if(!fp)
+            return false;
+
+        CPU_ZERO(&set);
+        int first, last;
+        char sep;
+        while(fscanf(fp, "%d", &first) == 1) {
+            last = first;
+            sep = fgetc(fp);
+            if(sep == '-') {
+                if(fscanf(fp, "%d", &last) != 1)
+                    break;
+                sep = fgetc(fp);
+            }
+            for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                CPU_SET(cpu, &set);
+            }
+            if(sep != ',')
+                break;
+        }
+        fclose(fp);
+        return CPU_COUNT(&set) > 0;
+    }
+
+    // the node new allocations of this process prefer, -1 if none
+    static int preferred() {
+        return preferred_node();
+    }
+
+    // prefer the node for all following allocations, -1 returns to the default policy
+    static void prefer(int node) {
+        unsigned long mask[mask_words];
+        long ret;
+        if(node < 0) {
+            ret = syscall(SYS_set_mempolicy, MPOL_DEFAULT_POLICY, NULL, 0);
+        } else {
+            node_mask(node, mask);
+            ret = syscall(SYS_set_mempolicy, MPOL_PREFERRED_POLICY, mask, max_nodes + 1);
+        }
+
+        if(ret != 0)
+            std::cerr << "unable to set the memory policy for numa node " << node << ": " << strerror(errno) << std::endl;
+        preferred_node() = node;
+    }
+
+    // place the not yet touched pages of a mapping on the node
+    static void bind(void *addr, size_t len, int node) {
+        unsigned long mask[mask_words];
+        node_mask(node, mask);
+        if(0 != syscall(SYS_mbind, addr, len, MPOL_PREFERRED_POLICY, mask, max_nodes + 1, 0))
+            std::cerr << "unable to bind memory to numa node " << node << ": " << strerror(errno) << std::endl;
+    }
+
+    // run the thread on the cpus of the node only
+    static void pin(pthread_t thread, int node) {
+        cpu_set_t set;
+        if(!cpus(node, set)) {
+            std::cerr << "unable to read the cpus of numa node " << node << std::endl;
+            return;
+        }
+
+        int ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if(ret != 0)
+            std::cerr << "unable to pin thread to numa node " << node << ": " << strerror(ret) << std::endl;
+    }
+
+    // run the calling process and all threads it starts later on the node, with its memory there
+    static void bind_process(int node) {
+        pin(pthread_self(), node);
+        prefer(node);
+    }
+};
+
+#endif // SPLITTER_NUMA_HPP
@@ -0,0 +1,146 @@
+#ifndef SPLITTER_OBJECT_FILTER_HPP
+#define SPLITTER_OBJECT_FILTER_HPP
+
+#include <string.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+
+Object Filter
+ - types=nwr selects the object types of an extract
+ - filter=key=value,key=*,... selects objects having at least one of the tags,
+   * matches any value
+ - both are compiled when the config is read, tags are compared by their first
+   character before a string-compare, so most tags of an object are rejected
+   without calling strcmp
+ - the keys of the tags are not hashed or interned: osmium gives every object
+   its own copies of the strings, so a tag would have to be hashed before it's
+   compared. with the few conditions of a filter that costs more than it saves,
+   hashing only caught up at 8 conditions
+
+*/
+
+class ObjectFilter {
+
+private:
+    struct Condition {
+        std::string key;
+        std::string value;
+        bool any_value;
+    };
+
+    std::vector<Condition> conditions;
+
+    bool nodes;
+    bool ways;
+    bool relations;
+
+    static bool equals(const std::string &expected, const char *actual) {
+        return actual[0] == expected[0] && 0 == strcmp(actual, expected.c_str());
+    }
+
+public:
+    ObjectFilter() : nodes(true), ways(true), relations(true) {}
+
+    // parse the value of a types= option
+    bool parse_types(const char *value) {
+        nodes = ways = relations = false;
+
+        for(const char *c = value; *c; c++) {
+            switch(*c) {
+                case 'n':
+                    nodes = true;
+                    break;
+                case 'w':
+                    ways = true;
+                    break;
+                case 'r':
+                    relations = true;
+                    break;
+                default:
+                    std::cerr << "unknown object type " << *c << " in types=" << value << ", use n, w and r" << std::endl;
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    // parse the value of a filter= option
+    bool parse_tags(const char *value) {
+        std::string spec(value);
+        size_t start = 0;
+
+        while(start <= spec.size()) {
+            size_t end = spec.find(',', start);
+            if(end == std::string::npos)
+                end = spec.size();
+
+            std::string cond = spec.substr(start, end - start);
+            size_t eq = cond.find('=');
+            if(eq == std::string::npos || eq == 0 || eq == cond.size() - 1) {
+                std::cerr << "filter condition " << cond << " is not of the form key=value or key=*" << std::endl;
+                return false;
+            }
+
+            Condition c;
+            c.key = cond.substr(0, eq);
+            c.value = cond.substr(eq + 1);
+            c.any_value = (c.value == "*");
+            conditions.push_back(c);
+
+            start = end + 1;
+        }
+
+        return true;
+    }
+
+    // does the filter reject anything at all
+    bool active() const {
+        return !conditions.empty() || !nodes || !ways || !relations;
+    }
+
+    bool accepts_nodes() const {
+        return nodes;
+    }
+
+    bool accepts_ways() const {
+        return ways;
+    }
+
+    bool accepts_relations() const {
+        return relations;
+    }
+
+    // does at least one of the tags match one of the conditions
+    bool matches_tags(const Osmium::OSM::TagList &tags) const {
+        if(conditions.empty())
+            return true;
+
+        for(Osmium::OSM::TagList::const_iterator tag = tags.begin(); tag != tags.end(); ++tag) {
+            for(std::vector<Condition>::const_iterator cond = conditions.begin(); cond != conditions.end(); ++cond) {
+                if(equals(cond->key, tag->key()) && (cond->any_value || equals(cond->value, tag->value())))
+                    return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool matches(const Osmium::OSM::Node &node) const {
+        return nodes && matches_tags(node.tags());
+    }
+
+    bool matches(const Osmium::OSM::Way &way) const {
+        return ways && matches_tags(way.tags());
+    }
+
+    bool matches(const Osmium::OSM::Relation &relation) const {
+        return relations && matches_tags(relation.tags());
+    }
+};
+
+#endif // SPLITTER_OBJECT_FILTER_HPP
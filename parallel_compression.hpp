@@ -0,0 +1,915 @@
+#ifndef SPLITTER_PARALLEL_COMPRESSION_HPP
+#define SPLITTER_PARALLEL_COMPRESSION_HPP
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <deque>
+#include <vector>
+
+#include <zlib.h>
+#include <bzlib.h>
+#include <osmpbf/osmpbf.h>
+
+#include "container.hpp"
+#include "io.hpp"
+#include "numa.hpp"
+#include "tempfiles.hpp"
+
+/*
+
+Parallel Compression
+ - the osmium writer of an extract writes its output uncompressed into a fifo
+ - a fixed number of sink-threads (as many as compression threads) poll the fifos
+   of all extracts and cut every stream into independent blocks
+   - .bz2: 900k chunks, each compressed into a bzip2-stream of its own (the way pbzip2 does it)
+   - .gz:  1M chunks, each compressed into a gzip-member of its own
+   - .pbf: one block per blob, the writer is told to write raw blobs
+   - any other output: 1M chunks passed through as they are, only with
+     --output-memory, so their blocks count against the cap as well
+ - the blocks of all extracts are compressed on one shared pool of threads
+ - the sink-thread of an extract writes its compressed blocks in order to the real output file,
+   optionally in large batches (see io.hpp), or appends them as records of its
+   stream to a shared container (see container.hpp)
+ - the memory of all blocks held by the sinks is capped by the pool. a sink that
+   would exceed the cap first writes out its own oldest blocks, waiting for their
+   compression if needed, so the output memory doesn't grow with the number of
+   extracts. a sink holding no block always gets one, so no sink can starve.
+   the buffers of written blocks are recycled for the next blocks.
+ - the fifos live in a directory in $TMPDIR, which is removed at exit, even when the
+   split fails (see tempfiles.hpp)
+ - an error in a sink or compression thread ends the process with
+   TempFiles::fail_thread(), not exit()
+
+concatenated bzip2-streams and gzip-members are valid files for bzip2 and gzip
+and pbf-blobs are independent by design, so the result can be read by everyone.
+
+*/
+
+// a block of data waiting to be compressed
+class CompressionJob {
+
+public:
+    enum Format {
+        BZIP2 = 1,
+        GZIP = 2,
+        PBF_BLOB = 3,
+        PLAIN = 4
+    };
+
+    Format format;
+
+    // codec level, 0 leaves pbf-blobs uncompressed
+    int level;
+
+    // uncompressed input and compressed output
+    std::string input;
+    std::string output;
+
+    // the pbf blob-type (OSMHeader or OSMData)
+    std::string blob_type;
+
+    // bytes reserved from the pools buffer memory
+    size_t reserved;
+
+    // guarded by the pools mutex
+    bool done;
+
+    CompressionJob(Format format, int level) : format(format), level(level), reserved(0), done(false) {}
+
+    void run() {
+        switch(format) {
+            case BZIP2:
+                run_bzip2();
+                break;
+            case GZIP:
+                run_gzip();
+                break;
+            case PBF_BLOB:
+                run_pbf_blob();
+                break;
+            case PLAIN:
+                output.swap(input);
+                break;
+        }
+    }
+
+private:
+    void run_bzip2() {
+        unsigned int len = input.size() + input.size() / 100 + 600;
+        output.resize(len);
+
+        int ret = BZ2_bzBuffToBuffCompress(&output[0], &len, const_cast<char *>(input.data()), input.size(), level, 0, 30);
+        if(ret != BZ_OK) {
+            std::cerr << "bzip2 compression failed with error " << ret << std::endl;
+            TempFiles::fail_thread();
+        }
+        output.resize(len);
+    }
+
+    // deflate a buffer with the given window bits (15 for zlib, 15+16 for gzip)
+    static void deflate_buffer(const std::string &in, std::string &out, int level, int window_bits) {
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+
+        if(Z_OK != deflateInit2(&z, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY)) {
+            std::cerr << "unable to initialize zlib" << std::endl;
+            TempFiles::fail_thread();
+        }
+
+        out.resize(deflateBound(&z, in.size()) + 32);
+
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+        z.avail_in = in.size();
+        z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+        z.avail_out = out.size();
+
+        if(Z_STREAM_END != deflate(&z, Z_FINISH)) {
+            std::cerr << "zlib compression failed: " << (z.msg ? z.msg : "unknown error") << std::endl;
+            TempFiles::fail_thread();
+        }
+
+        out.resize(z.total_out);
+        deflateEnd(&z);
+    }
+
+    void run_gzip() {
+        deflate_buffer(input, output, level, 15+16);
+    }
+
+    void run_pbf_blob() {
+        OSMPBF::Blob blob;
+        if(!blob.ParseFromString(input)) {
+            std::cerr << "unable to parse pbf blob from writer" << std::endl;
+            TempFiles::fail_thread();
+        }
+
+        // the writer compressed this blob itself or uncompressed blobs were requested, pass it through
+        if(!blob.has_raw() || level == 0) {
+            output = frame_pbf_blob(blob_type, input);
+            return;
+        }
+
+        OSMPBF::Blob compressed;
+        compressed.set_raw_size(blob.raw().size());
+        deflate_buffer(blob.raw(), *compressed.mutable_zlib_data(), level, 15);
+
+        std::string data;
+        compressed.SerializeToString(&data);
+        output = frame_pbf_blob(blob_type, data);
+    }
+
+public:
+    // build the on-disk representation of a blob: 4 byte length, header, blob
+    static std::string frame_pbf_blob(const std::string &type, const std::string &data) {
+        OSMPBF::BlobHeader header;
+        header.set_type(type);
+        header.set_datasize(data.size());
+
+        std::string headerdata;
+        header.SerializeToString(&headerdata);
+
+        uint32_t len = headerdata.size();
+        char lenbuf[4] = {
+            static_cast<char>((len >> 24) & 0xff),
+            static_cast<char>((len >> 16) & 0xff),
+            static_cast<char>((len >> 8) & 0xff),
+            static_cast<char>(len & 0xff)
+        };
+
+        std::string framed;
+        framed.reserve(4 + headerdata.size() + data.size());
+        framed.append(lenbuf, 4);
+        framed.append(headerdata);
+        framed.append(data);
+        return framed;
+    }
+};
+
+// a fixed number of threads compressing the jobs of all sinks
+class CompressionPool {
+
+private:
+    std::vector<pthread_t> threads;
+    std::deque<CompressionJob*> queue;
+
+    // upper limit of queued jobs, so slow compression applies back-pressure to the sinks
+    size_t max_queued;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t space_cond;
+    pthread_cond_t done_cond;
+    bool shutdown;
+
+    // memory of the blocks held by all sinks, see reserve()
+    size_t buffer_limit;
+    size_t buffer_used;
+    size_t buffer_peak;
+
+    // buffers of written blocks, ready for the next blocks
+    std::vector<std::string> spare_buffers;
+    size_t spare_bytes;
+
+    static void *worker(void *arg) {
+        CompressionPool *pool = static_cast<CompressionPool *>(arg);
+
+        pthread_mutex_lock(&pool->mutex);
+        while(1) {
+            while(pool->queue.empty() && !pool->shutdown)
+                pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+            if(pool->queue.empty())
+                break;
+
+            CompressionJob *job = pool->queue.front();
+            pool->queue.pop_front();
+            pthread_cond_signal(&pool->space_cond);
+            pthread_mutex_unlock(&pool->mutex);
+
+            job->run();
+
+            pthread_mutex_lock(&pool->mutex);
+            job->done = true;
+            pthread_cond_broadcast(&pool->done_cond);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        return NULL;
+    }
+
+public:
+    CompressionPool(int nthreads, size_t buffer_limit) : threads(nthreads), max_queued(nthreads * 4), shutdown(false),
+        buffer_limit(buffer_limit), buffer_used(0), buffer_peak(0), spare_bytes(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work_cond, NULL);
+        pthread_cond_init(&space_cond, NULL);
+        pthread_cond_init(&done_cond, NULL);
+
+        for(int i = 0; i < nthreads; i++) {
+            pthread_create(&threads[i], NULL, &CompressionPool::worker, this);
+        }
+    }
+
+    ~CompressionPool() {
+        pthread_mutex_lock(&mutex);
+        shutdown = true;
+        pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&mutex);
+
+        for(int i = 0, l = threads.size(); i<l; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        pthread_cond_destroy(&done_cond);
+        pthread_cond_destroy(&space_cond);
+        pthread_cond_destroy(&work_cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    // queue a job, blocks while the queue is full
+    void submit(CompressionJob *job) {
+        pthread_mutex_lock(&mutex);
+        while(queue.size() >= max_queued)
+            pthread_cond_wait(&space_cond, &mutex);
+
+        queue.push_back(job);
+        pthread_cond_signal(&work_cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // check if a job is finished, optionally waiting for it
+    bool finished(CompressionJob *job, bool wait) {
+        pthread_mutex_lock(&mutex);
+        while(wait && !job->done)
+            pthread_cond_wait(&done_cond, &mutex);
+
+        bool done = job->done;
+        pthread_mutex_unlock(&mutex);
+        return done;
+    }
+
+    int size() const {
+        return threads.size();
+    }
+
+    /**
+     * reserve buffer memory for a block. a sink which already holds blocks
+     * (holding) is refused if the memory of all sinks would exceed the limit,
+     * it has to write some of its blocks first.
+     */
+    bool reserve(size_t bytes, bool holding) {
+        pthread_mutex_lock(&mutex);
+        bool ok = !holding || buffer_used + bytes <= buffer_limit;
+        if(ok) {
+            buffer_used += bytes;
+            if(buffer_used > buffer_peak)
+                buffer_peak = buffer_used;
+        }
+        pthread_mutex_unlock(&mutex);
+        return ok;
+    }
+
+    void release(size_t bytes) {
+        pthread_mutex_lock(&mutex);
+        buffer_used -= bytes;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // swap a spare buffer into buf, if there is one
+    void take_buffer(std::string &buf) {
+        pthread_mutex_lock(&mutex);
+        if(!spare_buffers.empty()) {
+            buf.swap(spare_buffers.back());
+            spare_buffers.pop_back();
+            spare_bytes -= buf.capacity();
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // keep the buffer of a written block for the next blocks, up to a quarter of the limit
+    void return_buffer(std::string &buf) {
+        pthread_mutex_lock(&mutex);
+        if(spare_bytes + buf.capacity() <= buffer_limit / 4) {
+            spare_bytes += buf.capacity();
+            buf.clear();
+            spare_buffers.push_back(std::string());
+            spare_buffers.back().swap(buf);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // the highest buffer memory held by all sinks at once
+    size_t peak_buffer_memory() {
+        pthread_mutex_lock(&mutex);
+        size_t peak = buffer_peak;
+        pthread_mutex_unlock(&mutex);
+        return peak;
+    }
+};
+
+class CompressingSink;
+
+// a fixed number of threads reading the fifos of all sinks. every sink is
+// served by one of the threads, which polls the fifos of its sinks and hands
+// their blocks to the compression pool, so the number of threads doesn't
+// grow with the number of extracts
+class SinkThreads {
+
+private:
+    struct Worker {
+        pthread_t thread;
+        int node;
+
+        // wakes the thread up when a sink is added or the threads are stopped
+        int wake[2];
+
+        // sinks added but not yet polled, guarded by the mutex of the threads
+        std::vector<CompressingSink*> added;
+    };
+
+    std::vector<Worker*> workers;
+    size_t next_worker;
+
+    pthread_mutex_t mutex;
+    bool shutdown;
+
+    struct WorkerArg {
+        SinkThreads *threads;
+        Worker *worker;
+    };
+
+    void run(Worker *worker);
+
+    static void *worker_main(void *arg) {
+        WorkerArg *a = static_cast<WorkerArg *>(arg);
+        SinkThreads *threads = a->threads;
+        Worker *worker = a->worker;
+        delete a;
+
+        threads->run(worker);
+        return NULL;
+    }
+
+    static void wake(Worker *worker) {
+        char c = 0;
+        while(::write(worker->wake[1], &c, 1) < 0 && errno == EINTR);
+    }
+
+public:
+    /**
+     * start nthreads threads. with numa nodes the threads are spread over the
+     * nodes and pinned to their cpus.
+     */
+    SinkThreads(int nthreads, int numa_nodes) : next_worker(0), shutdown(false) {
+        pthread_mutex_init(&mutex, NULL);
+
+        for(int i = 0; i < nthreads; i++) {
+            Worker *worker = new Worker();
+            worker->node = numa_nodes > 0 ? i % numa_nodes : -1;
+            if(0 != pipe(worker->wake)) {
+                std::cerr << "unable to create pipe: " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            fcntl(worker->wake[0], F_SETFL, O_NONBLOCK);
+
+            WorkerArg *arg = new WorkerArg();
+            arg->threads = this;
+            arg->worker = worker;
+            pthread_create(&worker->thread, NULL, &SinkThreads::worker_main, arg);
+            if(worker->node >= 0)
+                Numa::pin(worker->thread, worker->node);
+
+            workers.push_back(worker);
+        }
+    }
+
+    // all sinks have to be finished before
+    ~SinkThreads() {
+        pthread_mutex_lock(&mutex);
+        shutdown = true;
+        pthread_mutex_unlock(&mutex);
+
+        for(int i = 0, l = workers.size(); i<l; i++) {
+            wake(workers[i]);
+            pthread_join(workers[i]->thread, NULL);
+            close(workers[i]->wake[0]);
+            close(workers[i]->wake[1]);
+            delete workers[i];
+        }
+
+        pthread_mutex_destroy(&mutex);
+    }
+
+    int size() const {
+        return workers.size();
+    }
+
+    // serve a sink by the next thread, on the numa node if one of the threads runs there
+    void add(CompressingSink *sink, int node) {
+        pthread_mutex_lock(&mutex);
+        size_t n = workers.size();
+        size_t chosen = next_worker % n;
+        for(size_t i = 0; i < n; i++) {
+            size_t candidate = (next_worker + i) % n;
+            if(node < 0 || workers[candidate]->node == node) {
+                chosen = candidate;
+                break;
+            }
+        }
+        next_worker = chosen + 1;
+
+        Worker *worker = workers[chosen];
+        worker->added.push_back(sink);
+        pthread_mutex_unlock(&mutex);
+
+        wake(worker);
+    }
+};
+
+// reads the uncompressed output of one writer from a fifo, has it compressed
+// on the pool and writes the result in order to the output file
+class CompressingSink {
+
+private:
+    CompressionPool *pool;
+    SinkThreads *threads;
+    CompressionJob::Format format;
+    int level;
+    std::string fifo;
+    std::string outfile;
+
+    int in_fd;
+    int out_fd;
+
+    // the container the blocks are appended to instead of the output file, if any
+    ContainerWriter *container;
+    uint64_t stream;
+
+    // batches the writes to the output file, if requested
+    BatchedWriter *batched;
+    dev_t out_dev;
+
+    // bytes of the output written so far, read by the thread of the writer
+    uint64_t written;
+
+    // jobs submitted to the pool, in output order
+    std::deque<CompressionJob*> pending;
+
+    // the block being read from the fifo: a chunk, or the length, header or
+    // data of a pbf-blob, and the number of its bytes read so far
+    enum ReadState {
+        CHUNK,
+        BLOB_LENGTH,
+        BLOB_HEADER,
+        BLOB_DATA
+    };
+    ReadState state;
+    CompressionJob *current;
+    size_t got;
+    unsigned char lenbuf[4];
+    std::string headerdata;
+
+    // set by the sink thread once everything is written
+    pthread_mutex_t mutex;
+    pthread_cond_t finished_cond;
+    bool finished;
+
+    // bzip2 blocks are 100k per level, chunks match them
+    static const size_t bzip2_block_size = 100*1000;
+    static const size_t gzip_block_size = 1024*1024;
+
+    // read what the fifo holds, returns 0 at eof and -1 if the fifo is empty
+    ssize_t read_some(char *buf, size_t len) {
+        while(1) {
+            ssize_t r = ::read(in_fd, buf, len);
+            if(r >= 0)
+                return r;
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return -1;
+
+            std::cerr << "error reading from fifo " << fifo << ": " << strerror(errno) << std::endl;
+            TempFiles::fail_thread();
+        }
+    }
+
+    void write_full(const std::string &data) {
+        __sync_add_and_fetch(&written, data.size());
+
+        if(container) {
+            container->append(Container::BLOCK, stream, data);
+            return;
+        }
+
+        if(batched) {
+            batched->write(data.data(), data.size());
+            return;
+        }
+
+        double start = IoStats::now();
+        size_t pos = 0;
+        while(pos < data.size()) {
+            ssize_t w = ::write(out_fd, data.data() + pos, data.size() - pos);
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "error writing to " << outfile << ": " << strerror(errno) << std::endl;
+                TempFiles::fail_thread();
+            }
+            pos += w;
+        }
+        IoStats::instance().add_write(out_dev, data.size(), IoStats::now() - start);
+    }
+
+    // write out finished jobs in order, waiting for the first one if requested
+    void flush(bool wait) {
+        while(!pending.empty() && pool->finished(pending.front(), wait)) {
+            CompressionJob *job = pending.front();
+            pending.pop_front();
+
+            write_full(job->output);
+            release(job);
+        }
+    }
+
+    // hand the memory of a block back to the pool
+    void release(CompressionJob *job) {
+        pool->return_buffer(job->input);
+        pool->return_buffer(job->output);
+        pool->release(job->reserved);
+        delete job;
+    }
+
+    // create a job for a block of block_size bytes, writing out own blocks while the pool is full
+    CompressionJob *create_job(size_t block_size) {
+        // the input and about as much for the compressed output
+        size_t bytes = 2 * block_size;
+        while(!pool->reserve(bytes, !pending.empty())) {
+            flush(true);
+        }
+
+        CompressionJob *job = new CompressionJob(format, level);
+        job->reserved = bytes;
+        pool->take_buffer(job->input);
+        pool->take_buffer(job->output);
+        job->input.resize(block_size);
+        return job;
+    }
+
+    void submit(CompressionJob *job) {
+        pending.push_back(job);
+        pool->submit(job);
+
+        // write what's finished, and don't let a single sink run away with too many jobs
+        flush(false);
+        while(pending.size() > static_cast<size_t>(pool->size() * 2)) {
+            flush(true);
+        }
+    }
+
+    size_t chunk_size() const {
+        return format == CompressionJob::BZIP2 ? bzip2_block_size * level : gzip_block_size;
+    }
+
+    // cut a plain byte-stream into fixed size chunks, returns false at eof
+    bool read_chunks() {
+        while(1) {
+            if(!current) {
+                current = create_job(chunk_size());
+                got = 0;
+            }
+
+            ssize_t r = read_some(&current->input[got], current->input.size() - got);
+            if(r < 0)
+                return true;
+
+            if(r == 0) {
+                if(got > 0) {
+                    current->input.resize(got);
+                    submit(current);
+                } else {
+                    release(current);
+                }
+                current = NULL;
+                return false;
+            }
+
+            got += r;
+            if(got == current->input.size()) {
+                submit(current);
+                current = NULL;
+            }
+        }
+    }
+
+    // cut a pbf-stream at the blob boundaries, returns false at eof
+    bool read_blobs() {
+        while(1) {
+            ssize_t r;
+            switch(state) {
+                case BLOB_LENGTH:
+                    r = read_some(reinterpret_cast<char *>(lenbuf) + got, 4 - got);
+                    if(r > 0 && (got += r) == 4) {
+                        uint32_t headerlen = (lenbuf[0] << 24) | (lenbuf[1] << 16) | (lenbuf[2] << 8) | lenbuf[3];
+                        if(headerlen == 0 || headerlen > 64*1024) {
+                            std::cerr << "invalid blob header length " << headerlen << " in " << fifo << std::endl;
+                            TempFiles::fail_thread();
+                        }
+                        headerdata.resize(headerlen);
+                        state = BLOB_HEADER;
+                        got = 0;
+                    }
+                    break;
+
+                case BLOB_HEADER:
+                    r = read_some(&headerdata[got], headerdata.size() - got);
+                    if(r > 0 && (got += r) == headerdata.size()) {
+                        OSMPBF::BlobHeader header;
+                        if(!header.ParseFromString(headerdata)) {
+                            std::cerr << "unable to parse blob header in " << fifo << std::endl;
+                            TempFiles::fail_thread();
+                        }
+
+                        current = create_job(header.datasize());
+                        current->blob_type = header.type();
+                        state = BLOB_DATA;
+                        got = 0;
+
+                        // an empty blob has nothing left to read
+                        if(current->input.empty()) {
+                            submit(current);
+                            current = NULL;
+                            state = BLOB_LENGTH;
+                        }
+                    }
+                    break;
+
+                default:
+                    r = read_some(&current->input[got], current->input.size() - got);
+                    if(r > 0 && (got += r) == current->input.size()) {
+                        submit(current);
+                        current = NULL;
+                        state = BLOB_LENGTH;
+                        got = 0;
+                    }
+                    break;
+            }
+
+            if(r < 0)
+                return true;
+
+            if(r == 0) {
+                if(state != BLOB_LENGTH || got > 0) {
+                    std::cerr << "truncated blob in " << fifo << std::endl;
+                    TempFiles::fail_thread();
+                }
+                return false;
+            }
+        }
+    }
+
+public:
+    /**
+     * detect the compression format of an output file by its extension
+     * and return the filename the osmium writer should write to instead.
+     *
+     * returns false for formats that can't be compressed in parallel.
+     */
+    static bool detect_format(const std::string &name, CompressionJob::Format &format, std::string &plain_name) {
+        if(name.size() > 4 && 0 == name.compare(name.size()-4, 4, ".bz2")) {
+            format = CompressionJob::BZIP2;
+            plain_name = name.substr(0, name.size()-4);
+            return true;
+        }
+        if(name.size() > 3 && 0 == name.compare(name.size()-3, 3, ".gz")) {
+            format = CompressionJob::GZIP;
+            plain_name = name.substr(0, name.size()-3);
+            return true;
+        }
+        if(name.size() > 4 && 0 == name.compare(name.size()-4, 4, ".pbf")) {
+            format = CompressionJob::PBF_BLOB;
+            plain_name = name;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * create the fifo, open its reading end and the output. the fifo has to
+     * be opened for writing before start() is called. with a container the
+     * output file is not created, its blocks are appended to the container.
+     * otherwise the blocks are written in batches of write_batch bytes, with
+     * O_DIRECT if direct is set.
+     */
+    CompressingSink(CompressionPool *pool, SinkThreads *threads, CompressionJob::Format format, int level, const std::string &fifo, const std::string &outfile,
+            ContainerWriter *container = NULL, size_t write_batch = 0, bool direct = false) :
+        pool(pool), threads(threads), format(format), level(level), fifo(fifo), outfile(outfile), in_fd(-1), out_fd(-1), container(container), stream(0),
+        batched(NULL), out_dev(0), written(0), state(format == CompressionJob::PBF_BLOB ? BLOB_LENGTH : CHUNK), current(NULL), got(0), finished(false) {
+
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&finished_cond, NULL);
+
+        // a negative level selects the default of the codec
+        if(level < 0) {
+            switch(format) {
+                case CompressionJob::BZIP2:
+                    this->level = 9;
+                    break;
+                case CompressionJob::GZIP:
+                case CompressionJob::PBF_BLOB:
+                    this->level = Z_DEFAULT_COMPRESSION;
+                    break;
+                case CompressionJob::PLAIN:
+                    break;
+            }
+        }
+
+        // opening the reading end without blocking lets the writer open the fifo right away
+        if(0 != mkfifo(fifo.c_str(), 0600) || (in_fd = open(fifo.c_str(), O_RDONLY | O_NONBLOCK)) < 0) {
+            std::cerr << "unable to create fifo " << fifo << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+
+#ifdef F_SETPIPE_SZ
+        // a larger pipe means fewer wake-ups of the sink thread, it's only a hint
+        fcntl(in_fd, F_SETPIPE_SZ, 1024*1024);
+#endif
+
+        if(container) {
+            stream = container->open_stream(outfile);
+        } else if(write_batch > 0 || direct) {
+            batched = new BatchedWriter(outfile, write_batch, direct);
+        } else {
+            out_fd = open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if(out_fd < 0) {
+                std::cerr << "unable to open output file " << outfile << ": " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            out_dev = IoStats::device_of(out_fd);
+        }
+    }
+
+    /**
+     * hand the fifo to a sink thread, on the numa node if one of the threads
+     * runs there. all writers have opened the fifo, so its name is removed.
+     */
+    void start(int node) {
+        unlink(fifo.c_str());
+        threads->add(this, node);
+    }
+
+    int fd() const {
+        return in_fd;
+    }
+
+    // the size of the output so far, without the blocks still being read or compressed
+    uint64_t bytes_written() {
+        return __sync_add_and_fetch(&written, 0);
+    }
+
+    /**
+     * read what the writer wrote into the fifo, called by the sink thread
+     * whenever the fifo is readable.
+     *
+     * this method returns false once the writer closed the fifo.
+     */
+    bool pump() {
+        return format == CompressionJob::PBF_BLOB ? read_blobs() : read_chunks();
+    }
+
+    // write the remaining blocks and close the output after the writer closed the fifo
+    void finish() {
+        while(!pending.empty()) {
+            flush(true);
+        }
+
+        close(in_fd);
+        if(container) {
+            container->append(Container::CLOSE, stream, std::string());
+        } else if(batched) {
+            batched->close();
+            delete batched;
+            batched = NULL;
+        } else if(close(out_fd) != 0) {
+            std::cerr << "error closing output file " << outfile << ": " << strerror(errno) << std::endl;
+            TempFiles::fail_thread();
+        }
+
+        pthread_mutex_lock(&mutex);
+        finished = true;
+        pthread_cond_broadcast(&finished_cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    // waits until the writer closed the fifo and everything is written
+    ~CompressingSink() {
+        pthread_mutex_lock(&mutex);
+        while(!finished)
+            pthread_cond_wait(&finished_cond, &mutex);
+        pthread_mutex_unlock(&mutex);
+
+        pthread_cond_destroy(&finished_cond);
+        pthread_mutex_destroy(&mutex);
+    }
+};
+
+// poll the fifos of the sinks of a thread and pump the readable ones
+inline void SinkThreads::run(Worker *worker) {
+    std::vector<CompressingSink*> sinks;
+    std::vector<struct pollfd> fds;
+
+    while(1) {
+        pthread_mutex_lock(&mutex);
+        sinks.insert(sinks.end(), worker->added.begin(), worker->added.end());
+        worker->added.clear();
+        bool stop = shutdown;
+        pthread_mutex_unlock(&mutex);
+
+        if(stop && sinks.empty())
+            break;
+
+        fds.resize(sinks.size() + 1);
+        fds[0].fd = worker->wake[0];
+        fds[0].events = POLLIN;
+        for(int i = 0, l = sinks.size(); i<l; i++) {
+            fds[i+1].fd = sinks[i]->fd();
+            fds[i+1].events = POLLIN;
+        }
+
+        if(poll(&fds[0], fds.size(), -1) < 0) {
+            if(errno == EINTR) continue;
+            std::cerr << "error polling the output fifos: " << strerror(errno) << std::endl;
+            TempFiles::fail_thread();
+        }
+
+        if(fds[0].revents) {
+            char buf[64];
+            while(::read(worker->wake[0], buf, sizeof(buf)) > 0);
+        }
+
+        // sinks whose writer closed the fifo are finished and dropped
+        size_t kept = 0;
+        for(int i = 0, l = sinks.size(); i<l; i++) {
+            if(fds[i+1].revents && !sinks[i]->pump()) {
+                sinks[i]->finish();
+                continue;
+            }
+            sinks[kept++] = sinks[i];
+        }
+        sinks.resize(kept);
+    }
+}
+
+#endif // SPLITTER_PARALLEL_COMPRESSION_HPP
@@ -0,0 +1,366 @@
+#ifndef SPLITTER_PBF_BLOCKS_HPP
+#define SPLITTER_PBF_BLOCKS_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+#include <osmpbf/osmpbf.h>
+
+/*
+
+PBF Block Reader
+ - random access to the blobs of a .pbf file, independent of the osmium reader
+ - next_blob() reads only the blob headers and seeks over the blob data, so
+   indexing the blobs of a planet is cheap
+ - read_blob() reads and decompresses a single blob (raw or zlib)
+ - decode_block() extracts the node positions and object counts of a block
+ - decode_objects() extracts nodes, way-nodes and relation-members of a block,
+   with the visible flag of every object version
+
+*/
+
+// a node as stored in a pbf block, coordinates in osmium's fixed-point precision
+struct PbfNode {
+    int64_t id;
+    int32_t x;
+    int32_t y;
+    bool visible;
+};
+
+// the decoded content of a primitive block
+struct PbfBlockContent {
+    std::vector<PbfNode> nodes;
+    size_t ways;
+    size_t relations;
+    int64_t max_way_id;
+    int64_t max_relation_id;
+
+    PbfBlockContent() : ways(0), relations(0), max_way_id(0), max_relation_id(0) {}
+
+    void clear() {
+        nodes.clear();
+        ways = relations = 0;
+        max_way_id = max_relation_id = 0;
+    }
+};
+
+// a way or relation member as stored in a pbf block, type is 'n', 'w' or 'r'
+struct PbfMember {
+    char type;
+    int64_t ref;
+    std::string role;
+};
+
+struct PbfWay {
+    int64_t id;
+    bool visible;
+    std::vector<int64_t> refs;
+};
+
+struct PbfRelation {
+    int64_t id;
+    bool visible;
+    std::vector<PbfMember> members;
+};
+
+// all objects of a primitive block, without tags and meta-data
+struct PbfObjects {
+    std::vector<PbfNode> nodes;
+    std::vector<PbfWay> ways;
+    std::vector<PbfRelation> relations;
+
+    void clear() {
+        nodes.clear();
+        ways.clear();
+        relations.clear();
+    }
+};
+
+class PbfBlockReader {
+
+public:
+    // position of a blob in the file
+    struct BlobInfo {
+        std::string type;
+        off_t offset;
+        int32_t size;
+    };
+
+private:
+    std::string filename;
+    int fd;
+    off_t pos;
+
+    // pbf-coordinates are nanodegrees, osmium uses 1e-7 degrees
+    static const int64_t nano_per_fix = 100;
+
+    // round half away from zero like osmium does, truncating would move negative
+    // coordinates and those of granularities other than 100 by one unit
+    static int32_t to_fix(int64_t nano) {
+        if(nano < 0)
+            return -static_cast<int32_t>((-nano + nano_per_fix / 2) / nano_per_fix);
+        return static_cast<int32_t>((nano + nano_per_fix / 2) / nano_per_fix);
+    }
+
+    bool read_at(off_t offset, char *buf, size_t len) {
+        size_t done = 0;
+        while(done < len) {
+            ssize_t r = pread(fd, buf + done, len - done, offset + done);
+            if(r < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "error reading " << filename << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            if(r == 0) return false;
+            done += r;
+        }
+        return true;
+    }
+
+    // objects without the visible flag are not from a history file and visible
+    template <class TObject>
+    static bool visible(const TObject &o) {
+        return !o.has_info() || !o.info().has_visible() || o.info().visible();
+    }
+
+    static void decode_nodes(const OSMPBF::PrimitiveBlock &block, const OSMPBF::PrimitiveGroup &group, std::vector<PbfNode> &nodes) {
+        int64_t granularity = block.granularity();
+        int64_t lat_offset = block.lat_offset();
+        int64_t lon_offset = block.lon_offset();
+
+        for(int i = 0, l = group.nodes_size(); i<l; i++) {
+            const OSMPBF::Node &n = group.nodes(i);
+            PbfNode node;
+            node.id = n.id();
+            node.x = to_fix(lon_offset + granularity * n.lon());
+            node.y = to_fix(lat_offset + granularity * n.lat());
+            node.visible = visible(n);
+            nodes.push_back(node);
+        }
+
+        if(group.has_dense()) {
+            const OSMPBF::DenseNodes &dense = group.dense();
+            int64_t id = 0, lat = 0, lon = 0;
+            int visibles = dense.has_denseinfo() ? dense.denseinfo().visible_size() : 0;
+
+            // ids and coordinates are delta-coded
+            for(int i = 0, l = dense.id_size(); i<l; i++) {
+                id += dense.id(i);
+                lat += dense.lat(i);
+                lon += dense.lon(i);
+
+                PbfNode node;
+                node.id = id;
+                node.x = to_fix(lon_offset + granularity * lon);
+                node.y = to_fix(lat_offset + granularity * lat);
+                node.visible = i >= visibles || dense.denseinfo().visible(i);
+                nodes.push_back(node);
+            }
+        }
+    }
+
+public:
+    PbfBlockReader(const std::string &filename) : filename(filename), pos(0) {
+        fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0) {
+            std::cerr << "unable to open " << filename << ": " << strerror(errno) << std::endl;
+        }
+    }
+
+    ~PbfBlockReader() {
+        if(fd >= 0) close(fd);
+    }
+
+    bool is_open() const {
+        return fd >= 0;
+    }
+
+    off_t file_size() const {
+        struct stat st;
+        if(0 != fstat(fd, &st)) return 0;
+        return st.st_size;
+    }
+
+    /**
+     * read the header of the next blob and skip its data.
+     *
+     * this method returns false at the end of the file or on errors.
+     */
+    bool next_blob(BlobInfo &info) {
+        unsigned char lenbuf[4];
+        if(!read_at(pos, reinterpret_cast<char *>(lenbuf), 4))
+            return false;
+
+        uint32_t headerlen = (lenbuf[0] << 24) | (lenbuf[1] << 16) | (lenbuf[2] << 8) | lenbuf[3];
+        if(headerlen > 64*1024) {
+            std::cerr << "invalid blob header length " << headerlen << " in " << filename << std::endl;
+            return false;
+        }
+
+        std::string headerdata(headerlen, '\0');
+        if(!read_at(pos + 4, &headerdata[0], headerlen))
+            return false;
+
+        OSMPBF::BlobHeader header;
+        if(!header.ParseFromString(headerdata)) {
+            std::cerr << "unable to parse blob header in " << filename << std::endl;
+            return false;
+        }
+
+        info.type = header.type();
+        info.offset = pos + 4 + headerlen;
+        info.size = header.datasize();
+
+        pos = info.offset + info.size;
+        return true;
+    }
+
+    // read the blob-data without decompressing it
+    bool read_raw_blob(const BlobInfo &info, std::string &blobdata) {
+        blobdata.resize(info.size);
+        return read_at(info.offset, &blobdata[0], info.size);
+    }
+
+    /**
+     * read and decompress a blob.
+     *
+     * this method returns false if the blob can't be read or uses an unsupported compression.
+     */
+    bool read_blob(const BlobInfo &info, std::string &data) {
+        std::string blobdata;
+        if(!read_raw_blob(info, blobdata))
+            return false;
+
+        OSMPBF::Blob blob;
+        if(!blob.ParseFromString(blobdata)) {
+            std::cerr << "unable to parse blob at " << info.offset << " in " << filename << std::endl;
+            return false;
+        }
+
+        if(blob.has_raw()) {
+            data = blob.raw();
+            return true;
+        }
+
+        if(blob.has_zlib_data()) {
+            data.resize(blob.raw_size());
+            uLongf len = data.size();
+            if(Z_OK != uncompress(reinterpret_cast<Bytef *>(&data[0]), &len,
+                    reinterpret_cast<const Bytef *>(blob.zlib_data().data()), blob.zlib_data().size())) {
+                std::cerr << "unable to decompress blob at " << info.offset << " in " << filename << std::endl;
+                return false;
+            }
+            data.resize(len);
+            return true;
+        }
+
+        std::cerr << "unsupported blob compression at " << info.offset << " in " << filename << std::endl;
+        return false;
+    }
+
+    // decode the nodes and count the ways and relations of a primitive block
+    static bool decode_block(const std::string &data, PbfBlockContent &content) {
+        OSMPBF::PrimitiveBlock block;
+        if(!block.ParseFromString(data)) {
+            std::cerr << "unable to parse primitive block" << std::endl;
+            return false;
+        }
+
+        content.clear();
+
+        for(int i = 0, l = block.primitivegroup_size(); i<l; i++) {
+            const OSMPBF::PrimitiveGroup &group = block.primitivegroup(i);
+
+            decode_nodes(block, group, content.nodes);
+
+            content.ways += group.ways_size();
+            for(int ii = 0, ll = group.ways_size(); ii<ll; ii++) {
+                if(group.ways(ii).id() > content.max_way_id)
+                    content.max_way_id = group.ways(ii).id();
+            }
+
+            content.relations += group.relations_size();
+            for(int ii = 0, ll = group.relations_size(); ii<ll; ii++) {
+                if(group.relations(ii).id() > content.max_relation_id)
+                    content.max_relation_id = group.relations(ii).id();
+            }
+        }
+
+        return true;
+    }
+
+    // decode all nodes, ways and relations of a primitive block
+    static bool decode_objects(const std::string &data, PbfObjects &objects) {
+        OSMPBF::PrimitiveBlock block;
+        if(!block.ParseFromString(data)) {
+            std::cerr << "unable to parse primitive block" << std::endl;
+            return false;
+        }
+
+        objects.clear();
+
+        for(int i = 0, l = block.primitivegroup_size(); i<l; i++) {
+            const OSMPBF::PrimitiveGroup &group = block.primitivegroup(i);
+
+            decode_nodes(block, group, objects.nodes);
+
+            for(int ii = 0, ll = group.ways_size(); ii<ll; ii++) {
+                const OSMPBF::Way &w = group.ways(ii);
+                PbfWay way;
+                way.id = w.id();
+                way.visible = visible(w);
+
+                // way-nodes are delta-coded
+                int64_t ref = 0;
+                for(int iii = 0, lll = w.refs_size(); iii<lll; iii++) {
+                    ref += w.refs(iii);
+                    way.refs.push_back(ref);
+                }
+                objects.ways.push_back(way);
+            }
+
+            for(int ii = 0, ll = group.relations_size(); ii<ll; ii++) {
+                const OSMPBF::Relation &r = group.relations(ii);
+                PbfRelation relation;
+                relation.id = r.id();
+                relation.visible = visible(r);
+
+                // member-ids are delta-coded, roles are indexes into the stringtable
+                int64_t ref = 0;
+                for(int iii = 0, lll = r.memids_size(); iii<lll; iii++) {
+                    ref += r.memids(iii);
+
+                    PbfMember member;
+                    member.ref = ref;
+                    member.role = block.stringtable().s(r.roles_sid(iii));
+                    switch(r.types(iii)) {
+                        case OSMPBF::Relation::NODE:
+                            member.type = 'n';
+                            break;
+                        case OSMPBF::Relation::WAY:
+                            member.type = 'w';
+                            break;
+                        default:
+                            member.type = 'r';
+                            break;
+                    }
+                    relation.members.push_back(member);
+                }
+                objects.relations.push_back(relation);
+            }
+        }
+
+        return true;
+    }
+};
+
+#endif // SPLITTER_PBF_BLOCKS_HPP
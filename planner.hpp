@@ -0,0 +1,346 @@
+#ifndef SPLITTER_PLANNER_HPP
+#define SPLITTER_PLANNER_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "cut.hpp"
+#include "pbf_blocks.hpp"
+#include "way_locations.hpp"
+
+/*
+
+Planner (--plan)
+ - index all blobs of the .pbf input by reading only their headers
+ - divide the data-blobs into as many strata as blobs are sampled and pick one
+   random blob per stratum, so nodes, ways and relations are all represented
+ - decode the sampled blocks and test every node of them against every extract,
+   timing the tests per extract
+ - extrapolate per extract:
+   - nodes: sampled hits scaled up to the whole file
+   - ways, relations, output size: the totals scaled by the node fraction of the extract
+   - cpu: the measured time per test times the number of nodes in the file
+   - tracker memory: a segment of a growing_bitset is allocated as soon as one id falls
+     into it. from the fraction p of sampled node-blocks the extract hits and the
+     number k of blocks per segment, a segment is allocated with a probability of
+     1 - (1-p)^k. way-trackers are estimated the same way with the node hit-rate,
+     relation-trackers always fit into one segment. softcut extracts with locations=
+     add 20 bytes per node-version of the extract for their location store
+ - group the extracts first-fit-decreasing by memory, so every group fits into --max-memory
+
+the estimates are rough, softcut writes more than the node fraction suggests because of
+the extra nodes and the relations referring to the extract. they are meant to pick
+groups that don't swap, not to predict the output byte by byte.
+
+*/
+
+template <class TExtractInfo>
+class Planner {
+
+private:
+    struct Estimate {
+        TExtractInfo *extract;
+
+        // sampled values
+        uint64_t hits;
+        uint64_t hit_blocks;
+        double seconds;
+
+        // extrapolated values
+        double nodes;
+        double ways;
+        double relations;
+        double output_bytes;
+        double tracker_bytes;
+        double cpu_seconds;
+    };
+
+    static bool by_memory(const Estimate *a, const Estimate *b) {
+        return a->tracker_bytes > b->tracker_bytes;
+    }
+
+    static double now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    static const double MB;
+
+    CutInfo<TExtractInfo> *info;
+    bool softcut;
+    size_t samples;
+    size_t max_memory;
+
+    std::vector<Estimate> estimates;
+
+    // totals of the input, extrapolated from the sample
+    std::string filename;
+    size_t blob_count;
+    double file_bytes;
+    double total_nodes;
+    double total_ways;
+    double total_relations;
+    double decode_seconds;
+
+    // probability that a tracker segment of an id range holds at least one id of the extract
+    static double segment_probability(double block_hit_rate, double objects_per_block, double objects_per_segment) {
+        if(block_hit_rate <= 0 || objects_per_block <= 0)
+            return 0;
+
+        double blocks_per_segment = std::max(1.0, objects_per_segment / objects_per_block);
+        return 1 - pow(1 - block_hit_rate, blocks_per_segment);
+    }
+
+public:
+    Planner(CutInfo<TExtractInfo> *info, bool softcut, size_t samples, size_t max_memory) :
+        info(info), softcut(softcut), samples(samples), max_memory(max_memory),
+        blob_count(0), file_bytes(0), total_nodes(0), total_ways(0), total_relations(0), decode_seconds(0) {}
+
+    // sample the input, print the estimates and a grouping to stdout
+    bool run(const std::string &filename) {
+        if(!sample(filename))
+            return false;
+
+        print();
+        return true;
+    }
+
+    // the estimated tracker memory of an extract, returns false if the extract is unknown
+    bool tracker_bytes(const std::string &name, double &bytes) const {
+        for(int i = 0, l = estimates.size(); i<l; i++) {
+            if(estimates[i].extract->name == name) {
+                bytes = estimates[i].tracker_bytes;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * sample the input and extrapolate the estimates of all extracts.
+     *
+     * this method returns false if the input can't be read.
+     */
+    bool sample(const std::string &filename) {
+        this->filename = filename;
+        PbfBlockReader reader(filename);
+        if(!reader.is_open())
+            return false;
+
+        double start = now();
+
+        std::vector<PbfBlockReader::BlobInfo> blobs;
+        PbfBlockReader::BlobInfo blob;
+        while(reader.next_blob(blob)) {
+            if(blob.type != "OSMData")
+                continue;
+
+            blobs.push_back(blob);
+        }
+
+        if(blobs.empty()) {
+            std::cerr << "no data-blobs found in " << filename << std::endl;
+            return false;
+        }
+
+        std::cerr << "indexed " << blobs.size() << " blobs in " << (now() - start) << "s" << std::endl;
+
+        // one random blob out of every stratum, in file order
+        size_t n = std::min(samples, blobs.size());
+        std::vector<size_t> picks;
+        srand(42);
+        for(size_t i = 0; i < n; i++) {
+            size_t first = i * blobs.size() / n;
+            size_t last = (i+1) * blobs.size() / n;
+            picks.push_back(first + rand() % (last - first));
+        }
+
+        estimates.resize(info->extracts.size());
+        for(int i = 0, l = info->extracts.size(); i<l; i++) {
+            Estimate &e = estimates[i];
+            e.extract = info->extracts[i];
+            e.hits = e.hit_blocks = 0;
+            e.seconds = 0;
+        }
+
+        uint64_t sampled_nodes = 0, sampled_ways = 0, sampled_relations = 0;
+        uint64_t node_blocks = 0, way_blocks = 0;
+        int64_t max_node_id = 0, max_way_id = 0;
+        decode_seconds = 0;
+
+        std::string data;
+        PbfBlockContent content;
+        std::vector< shared_ptr<Osmium::OSM::Node const> > nodes;
+
+        for(size_t i = 0; i < n; i++) {
+            double decode_start = now();
+            if(!reader.read_blob(blobs[picks[i]], data) || !PbfBlockReader::decode_block(data, content))
+                return false;
+
+            nodes.clear();
+            for(int ii = 0, ll = content.nodes.size(); ii<ll; ii++) {
+                const PbfNode &pn = content.nodes[ii];
+                shared_ptr<Osmium::OSM::Node> node(new Osmium::OSM::Node());
+                node->id(pn.id);
+                node->position(Osmium::OSM::Position(
+                    static_cast<double>(pn.x) / PreparedPolygon::coordinate_precision,
+                    static_cast<double>(pn.y) / PreparedPolygon::coordinate_precision));
+                nodes.push_back(node);
+
+                if(pn.id > max_node_id)
+                    max_node_id = pn.id;
+            }
+            decode_seconds += now() - decode_start;
+
+            sampled_nodes += content.nodes.size();
+            sampled_ways += content.ways;
+            sampled_relations += content.relations;
+            if(!content.nodes.empty()) node_blocks++;
+            if(content.ways) way_blocks++;
+            max_way_id = std::max(max_way_id, content.max_way_id);
+
+            if(nodes.empty())
+                continue;
+
+            for(int ii = 0, ll = estimates.size(); ii<ll; ii++) {
+                Estimate &e = estimates[ii];
+                uint64_t hits = 0;
+
+                double test_start = now();
+                for(int iii = 0, lll = nodes.size(); iii<lll; iii++) {
+                    if(e.extract->contains(nodes[iii]))
+                        hits++;
+                }
+                e.seconds += now() - test_start;
+
+                e.hits += hits;
+                if(hits) e.hit_blocks++;
+            }
+        }
+
+        std::cerr << "sampled " << n << " of " << blobs.size() << " blobs in " << (now() - start) << "s" << std::endl;
+
+        // strata are equally sized, so every sampled blob stands for the same number of blobs
+        double scale = static_cast<double>(blobs.size()) / n;
+        blob_count = blobs.size();
+        total_nodes = sampled_nodes * scale;
+        total_ways = sampled_ways * scale;
+        total_relations = sampled_relations * scale;
+        file_bytes = reader.file_size();
+        decode_seconds = decode_seconds / n * blob_count;
+
+        double segment_bytes = growing_bitset::segment_size / 8;
+        double node_segments = max_node_id / growing_bitset::segment_size + 1;
+        double way_segments = max_way_id / growing_bitset::segment_size + 1;
+
+        // ids are handed out densely, so the number of objects per segment follows from the max id
+        double nodes_per_segment = max_node_id > 0 ? total_nodes * growing_bitset::segment_size / max_node_id : 0;
+        double ways_per_segment = max_way_id > 0 ? total_ways * growing_bitset::segment_size / max_way_id : 0;
+        double nodes_per_block = node_blocks ? static_cast<double>(sampled_nodes) / node_blocks : 0;
+        double ways_per_block = way_blocks ? static_cast<double>(sampled_ways) / way_blocks : 0;
+
+        for(int i = 0, l = estimates.size(); i<l; i++) {
+            Estimate &e = estimates[i];
+            double fraction = sampled_nodes ? static_cast<double>(e.hits) / sampled_nodes : 0;
+            double block_hit_rate = node_blocks ? static_cast<double>(e.hit_blocks) / node_blocks : 0;
+
+            e.nodes = total_nodes * fraction;
+            e.ways = total_ways * fraction;
+            e.relations = total_relations * fraction;
+            e.output_bytes = file_bytes * fraction;
+            e.cpu_seconds = sampled_nodes ? e.seconds / sampled_nodes * total_nodes : 0;
+
+            double node_tracker = node_segments * segment_probability(block_hit_rate, nodes_per_block, nodes_per_segment) * segment_bytes;
+            double way_tracker = way_segments * segment_probability(block_hit_rate, ways_per_block, ways_per_segment) * segment_bytes;
+            double relation_tracker = e.hits ? segment_bytes : 0;
+
+            if(softcut) {
+                // node-, extra-node-, way- and relation-tracker, filtered extracts
+                // additionally keep a filtered node- and relation-tracker
+                e.tracker_bytes = 2 * node_tracker + way_tracker + relation_tracker;
+                if(e.extract->options.filter.active())
+                    e.tracker_bytes += node_tracker + relation_tracker;
+            } else {
+                e.tracker_bytes = node_tracker + way_tracker;
+            }
+
+            // the second pass keeps every node-version written to the extract
+            if(softcut && !e.extract->options.locations.empty())
+                e.tracker_bytes += e.nodes * WayLocations::bytes_per_version;
+        }
+
+        return true;
+    }
+
+    // print the estimates and the grouping to stdout
+    void print() {
+        printf("# %s: %.0f MB in %lu blobs, about %.0f nodes, %.0f ways, %.0f relations\n",
+            filename.c_str(), file_bytes / MB, static_cast<unsigned long>(blob_count), total_nodes, total_ways, total_relations);
+        printf("# decoding the whole file takes about %.0f s per pass on this machine\n", decode_seconds);
+        printf("extract\tnodes\tways\trelations\toutput-MB\ttracker-MB\tcpu-s\n");
+
+        for(int i = 0, l = estimates.size(); i<l; i++) {
+            const Estimate &e = estimates[i];
+            printf("%s\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\t%.0f\n",
+                e.extract->name.c_str(), e.nodes, e.ways, e.relations, e.output_bytes / MB, e.tracker_bytes / MB, e.cpu_seconds);
+        }
+
+        print_groups();
+    }
+
+private:
+    // first-fit-decreasing: the largest extracts first, each into the first group it fits
+    void print_groups() {
+        std::vector<Estimate*> sorted;
+        for(int i = 0, l = estimates.size(); i<l; i++) {
+            sorted.push_back(&estimates[i]);
+        }
+        std::sort(sorted.begin(), sorted.end(), by_memory);
+
+        std::vector< std::vector<Estimate*> > groups;
+        std::vector<double> group_bytes;
+
+        for(int i = 0, l = sorted.size(); i<l; i++) {
+            size_t g = 0;
+            while(g < groups.size() && group_bytes[g] + sorted[i]->tracker_bytes > max_memory)
+                g++;
+
+            // an extract which doesn't fit on its own gets a group of its own
+            if(g == groups.size()) {
+                groups.push_back(std::vector<Estimate*>());
+                group_bytes.push_back(0);
+            }
+
+            groups[g].push_back(sorted[i]);
+            group_bytes[g] += sorted[i]->tracker_bytes;
+        }
+
+        printf("# %lu groups of at most %.0f MB tracker memory\n", static_cast<unsigned long>(groups.size()), max_memory / MB);
+        for(size_t g = 0; g < groups.size(); g++) {
+            double cpu = 0;
+            for(size_t i = 0; i < groups[g].size(); i++) {
+                cpu += groups[g][i]->cpu_seconds;
+            }
+
+            printf("group %lu\t%.0f MB\t%.0f cpu-s", static_cast<unsigned long>(g+1), group_bytes[g] / MB, cpu);
+            for(size_t i = 0; i < groups[g].size(); i++) {
+                printf("\t%s", groups[g][i]->extract->name.c_str());
+            }
+            printf("\n");
+
+            if(group_bytes[g] > max_memory)
+                std::cerr << "warning: " << groups[g][0]->extract->name << " alone needs more than --max-memory" << std::endl;
+        }
+    }
+};
+
+template <class TExtractInfo>
+const double Planner<TExtractInfo>::MB = 1024.0 * 1024.0;
+
+#endif // SPLITTER_PLANNER_HPP
@@ -0,0 +1,274 @@
+#ifndef SPLITTER_PREPARED_POLYGON_HPP
+#define SPLITTER_PREPARED_POLYGON_HPP
+
+#include <stdint.h>
+#include <math.h>
+
+#include <vector>
+#include <algorithm>
+
+#include <geos/geom/MultiPolygon.h>
+
+/*
+
+Prepared Polygon
+ - all rings of a (multi-)polygon are broken into edges with fixed-point int32
+   coordinates, the same precision osmium stores node positions with
+ - the y-range of the polygon is divided into horizontal slabs and every edge is
+   recorded in all slabs its y-range touches
+ - a point is tested by counting the edges of its slab it crosses to the right
+   (crossing number), an odd number means inside. holes and multiple outers need
+   no special treatment, they're just more edges.
+ - in front of the slabs, the bounding box is covered by a grid of tiles. every tile
+   touched by an edge is a boundary tile, all other tiles are completely inside or
+   completely outside, which is decided once by testing their center. points in
+   inside or outside tiles are answered by a single lookup, so the bulk of the nodes
+   of a large extract never reach the crossing test.
+
+the test doesn't allocate and doesn't touch any mutable state, so one prepared
+polygon can be shared by any number of threads.
+
+*/
+
+class PreparedPolygon {
+
+public:
+    // osmium's fixed-point precision
+    static const int32_t coordinate_precision = 10000000;
+
+    static int32_t to_fix(double c) {
+        return static_cast<int32_t>(lround(c * coordinate_precision));
+    }
+
+private:
+    struct Edge {
+        int32_t x1, y1, x2, y2;
+    };
+
+    // target number of edges per slab, long edges are counted in every slab they cross
+    static const size_t edges_per_slab = 4;
+    static const size_t max_slabs = 1024*1024;
+
+    enum TileState {
+        TILE_OUTSIDE = 0,
+        TILE_INSIDE = 1,
+        TILE_BOUNDARY = 2
+    };
+
+    // tiles per side, about 16 tiles per edge so most tiles stay free of edges
+    static const size_t min_tiles = 16;
+    static const size_t max_tiles = 1024;
+
+    int32_t min_x, min_y, max_x, max_y;
+    int64_t slab_height;
+
+    size_t tiles;
+    int64_t tile_width, tile_height;
+    std::vector<uint8_t> tile_states;
+
+    // edges of slab i are slab_edges[slab_offsets[i] .. slab_offsets[i+1]]
+    std::vector<uint32_t> slab_offsets;
+    std::vector<Edge> slab_edges;
+
+    void add_ring(const geos::geom::LineString *ring, std::vector<Edge> &edges) {
+        const geos::geom::CoordinateSequence *cs = ring->getCoordinatesRO();
+        for(size_t i = 1, l = cs->getSize(); i < l; i++) {
+            Edge e;
+            e.x1 = to_fix(cs->getAt(i-1).x);
+            e.y1 = to_fix(cs->getAt(i-1).y);
+            e.x2 = to_fix(cs->getAt(i).x);
+            e.y2 = to_fix(cs->getAt(i).y);
+            edges.push_back(e);
+        }
+    }
+
+    void add_geometry(const geos::geom::Geometry *geom, std::vector<Edge> &edges) {
+        const geos::geom::Polygon *poly = dynamic_cast<const geos::geom::Polygon *>(geom);
+        if(poly) {
+            add_ring(poly->getExteriorRing(), edges);
+            for(size_t i = 0, l = poly->getNumInteriorRing(); i < l; i++) {
+                add_ring(poly->getInteriorRingN(i), edges);
+            }
+            return;
+        }
+
+        // multipolygons and collections
+        for(size_t i = 0, l = geom->getNumGeometries(); i < l; i++) {
+            const geos::geom::Geometry *part = geom->getGeometryN(i);
+            if(part != geom)
+                add_geometry(part, edges);
+        }
+    }
+
+    size_t slab_of(int32_t y) const {
+        return static_cast<size_t>((static_cast<int64_t>(y) - min_y) / slab_height);
+    }
+
+    size_t tile_of(int32_t x, int32_t y) const {
+        size_t tx = static_cast<size_t>((static_cast<int64_t>(x) - min_x) / tile_width);
+        size_t ty = static_cast<size_t>((static_cast<int64_t>(y) - min_y) / tile_height);
+        return ty * tiles + tx;
+    }
+
+    // mark all tiles a rectangle touches as boundary tiles
+    void mark_boundary(int64_t x1, int64_t y1, int64_t x2, int64_t y2) {
+        size_t tx1 = (std::min(x1, x2) - min_x) / tile_width, tx2 = (std::max(x1, x2) - min_x) / tile_width;
+        size_t ty1 = (std::min(y1, y2) - min_y) / tile_height, ty2 = (std::max(y1, y2) - min_y) / tile_height;
+
+        for(size_t ty = ty1; ty <= ty2; ty++) {
+            for(size_t tx = tx1; tx <= tx2; tx++) {
+                tile_states[ty * tiles + tx] = TILE_BOUNDARY;
+            }
+        }
+    }
+
+    void build_tiles(const std::vector<Edge> &edges) {
+        tiles = std::max(min_tiles, std::min(max_tiles, static_cast<size_t>(4 * sqrt(static_cast<double>(edges.size())))));
+        tile_width = (static_cast<int64_t>(max_x) - min_x) / tiles + 1;
+        tile_height = (static_cast<int64_t>(max_y) - min_y) / tiles + 1;
+        tile_states.assign(tiles * tiles, TILE_OUTSIDE);
+
+        // cut every edge into pieces no longer than a tile in each direction, the bounding
+        // box of each piece covers every tile the piece passes through. horizontal edges
+        // count here, points on them are decided by the crossing test.
+        for(std::vector<Edge>::const_iterator it = edges.begin(); it != edges.end(); ++it) {
+            int64_t dx = static_cast<int64_t>(it->x2) - it->x1;
+            int64_t dy = static_cast<int64_t>(it->y2) - it->y1;
+            int64_t steps = std::max((dx < 0 ? -dx : dx) / tile_width, (dy < 0 ? -dy : dy) / tile_height) + 1;
+
+            int64_t px = it->x1, py = it->y1;
+            for(int64_t i = 1; i <= steps; i++) {
+                int64_t nx = it->x1 + dx * i / steps;
+                int64_t ny = it->y1 + dy * i / steps;
+                mark_boundary(px, py, nx, ny);
+                px = nx;
+                py = ny;
+            }
+        }
+
+        // no edge passes through the other tiles, their center decides for all of their points
+        for(size_t ty = 0; ty < tiles; ty++) {
+            for(size_t tx = 0; tx < tiles; tx++) {
+                uint8_t &state = tile_states[ty * tiles + tx];
+                if(state == TILE_BOUNDARY)
+                    continue;
+
+                int64_t cx = min_x + tx * tile_width + tile_width / 2;
+                int64_t cy = min_y + ty * tile_height + tile_height / 2;
+                if(cx > max_x || cy > max_y)
+                    continue;
+
+                state = crossing_test(cx, cy) ? TILE_INSIDE : TILE_OUTSIDE;
+            }
+        }
+    }
+
+    // count the crossings of the edges in the slab of the point
+    bool crossing_test(int32_t x, int32_t y) const {
+        size_t slab = slab_of(y);
+        bool inside = false;
+
+        for(uint32_t i = slab_offsets[slab], l = slab_offsets[slab+1]; i < l; i++) {
+            const Edge &e = slab_edges[i];
+
+            // the edge spans the horizontal line through the point
+            if((e.y1 > y) != (e.y2 > y)) {
+                // is the crossing right of the point: x < x1 + (y - y1) * (x2 - x1) / (y2 - y1)
+                int64_t dy = static_cast<int64_t>(e.y2) - e.y1;
+                int64_t lhs = (static_cast<int64_t>(x) - e.x1) * dy;
+                int64_t rhs = (static_cast<int64_t>(y) - e.y1) * (static_cast<int64_t>(e.x2) - e.x1);
+
+                if(dy > 0 ? lhs < rhs : lhs > rhs)
+                    inside = !inside;
+            }
+        }
+
+        return inside;
+    }
+
+public:
+    PreparedPolygon(const geos::geom::Geometry *geom) : min_x(0), min_y(0), max_x(-1), max_y(-1), slab_height(1), tiles(0), tile_width(1), tile_height(1) {
+        std::vector<Edge> edges;
+        add_geometry(geom, edges);
+
+        if(edges.empty()) {
+            slab_offsets.assign(2, 0);
+            return;
+        }
+
+        min_x = max_x = edges[0].x1;
+        min_y = max_y = edges[0].y1;
+        for(std::vector<Edge>::const_iterator it = edges.begin(); it != edges.end(); ++it) {
+            min_x = std::min(min_x, std::min(it->x1, it->x2));
+            max_x = std::max(max_x, std::max(it->x1, it->x2));
+            min_y = std::min(min_y, std::min(it->y1, it->y2));
+            max_y = std::max(max_y, std::max(it->y1, it->y2));
+        }
+
+        size_t slabs = std::max(static_cast<size_t>(1), std::min(max_slabs, edges.size() / edges_per_slab));
+        slab_height = (static_cast<int64_t>(max_y) - min_y) / slabs + 1;
+        slabs = slab_of(max_y) + 1;
+
+        // count the edges per slab, then fill them in. horizontal edges are never crossed.
+        std::vector<uint32_t> counts(slabs, 0);
+        for(std::vector<Edge>::const_iterator it = edges.begin(); it != edges.end(); ++it) {
+            if(it->y1 == it->y2)
+                continue;
+
+            for(size_t s = slab_of(std::min(it->y1, it->y2)), e = slab_of(std::max(it->y1, it->y2)); s <= e; s++) {
+                counts[s]++;
+            }
+        }
+
+        slab_offsets.resize(slabs + 1);
+        slab_offsets[0] = 0;
+        for(size_t i = 0; i < slabs; i++) {
+            slab_offsets[i+1] = slab_offsets[i] + counts[i];
+        }
+
+        slab_edges.resize(slab_offsets[slabs]);
+        std::vector<uint32_t> fill(slab_offsets.begin(), slab_offsets.end() - 1);
+        for(std::vector<Edge>::const_iterator it = edges.begin(); it != edges.end(); ++it) {
+            if(it->y1 == it->y2)
+                continue;
+
+            for(size_t s = slab_of(std::min(it->y1, it->y2)), e = slab_of(std::max(it->y1, it->y2)); s <= e; s++) {
+                slab_edges[fill[s]++] = *it;
+            }
+        }
+
+        build_tiles(edges);
+    }
+
+    // test a fixed-point coordinate
+    bool contains(int32_t x, int32_t y) const {
+        if(x < min_x || x > max_x || y < min_y || y > max_y)
+            return false;
+
+        uint8_t state = tile_states[tile_of(x, y)];
+        if(state != TILE_BOUNDARY)
+            return state == TILE_INSIDE;
+
+        return crossing_test(x, y);
+    }
+
+    // number of edges stored in all slabs, a rough measure of memory and speed
+    size_t size() const {
+        return slab_edges.size();
+    }
+
+    // share of the tiles which are answered without the crossing test
+    double resolved_tiles() const {
+        if(tile_states.empty())
+            return 0;
+
+        size_t resolved = 0;
+        for(size_t i = 0; i < tile_states.size(); i++) {
+            if(tile_states[i] != TILE_BOUNDARY)
+                resolved++;
+        }
+        return static_cast<double>(resolved) / tile_states.size();
+    }
+};
+
+#endif // SPLITTER_PREPARED_POLYGON_HPP
@@ -0,0 +1,233 @@
+#ifndef SPLITTER_PROBE_BATCH_HPP
+#define SPLITTER_PROBE_BATCH_HPP
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "growing_bitset.hpp"
+
+/*
+
+Batched Tracker Probes
+ - the ids of waynodes and relation members are spread over the whole id range,
+   testing them one by one against a tracker of several hundred megabytes makes
+   every test a cache- and tlb-miss the next test has to wait for
+ - instead the ways (or relations) are collected into batches of up to
+   max_objects objects or max_refs references
+ - the referenced ids of a batch are sorted and deduplicated once. every tracker
+   is then probed with the sorted ids, walking its segments front to back with the
+   words a few ids ahead prefetched, and the results are scattered back to the
+   references of the objects
+ - sorting costs about as much as a few probes, so with less than sort_threshold
+   extracts the ids are probed in input order, still prefetched
+ - the objects of a batch are then cut one extract after the other, in input
+   order, so every writer still gets its objects in the order of the input
+
+*/
+
+// the ids referenced by a batch, sorted and deduplicated, and the result of the last probe
+class ProbeSet {
+
+public:
+    // the number of trackers probed with the same ids from which sorting them pays off
+    static const int sort_threshold = 8;
+
+private:
+    // id and number of every reference, sorted by prepare()
+    std::vector< std::pair<osm_object_id_t, uint32_t> > pending;
+
+    // per reference, the index of its id in ids
+    std::vector<uint32_t> slots;
+    bool sorted;
+
+    std::vector<osm_object_id_t> ids;
+    std::vector<char> hits;
+
+public:
+    ProbeSet() : sorted(false) {}
+
+    // add a reference to an id, returns the number of the reference
+    uint32_t add(osm_object_id_t id) {
+        uint32_t ref = slots.size();
+        pending.push_back(std::make_pair(id, ref));
+        slots.push_back(0);
+        return ref;
+    }
+
+    size_t size() const {
+        return slots.size();
+    }
+
+    /**
+     * prepare the ids for probing the given number of trackers, after all
+     * references are added. for many trackers they are sorted and deduplicated.
+     */
+    void prepare(int trackers) {
+        ids.clear();
+        sorted = trackers >= sort_threshold;
+
+        if(!sorted) {
+            for(int i = 0, l = pending.size(); i<l; i++) {
+                ids.push_back(pending[i].first);
+            }
+            return;
+        }
+
+        std::sort(pending.begin(), pending.end());
+        for(int i = 0, l = pending.size(); i<l; i++) {
+            if(ids.empty() || ids.back() != pending[i].first)
+                ids.push_back(pending[i].first);
+            slots[pending[i].second] = ids.size() - 1;
+        }
+    }
+
+    // look up all ids in the tracker
+    void probe(const growing_bitset &tracker) {
+        tracker.get_many(ids, hits);
+    }
+
+    // was the id of the reference set in the last probed tracker
+    bool hit(uint32_t ref) const {
+        return hits[sorted ? slots[ref] : ref];
+    }
+
+    void clear() {
+        pending.clear();
+        slots.clear();
+        ids.clear();
+    }
+};
+
+// way-versions collected for batched probes of their waynodes
+class WayBatch {
+
+private:
+    static const size_t max_objects = 8*1024;
+    static const size_t max_refs = 64*1024;
+
+    // the number of the first waynode reference of every way
+    std::vector<uint32_t> first;
+
+    // per way, whether it has the waynodes of the way-version before it
+    std::vector<bool> unchanged;
+
+public:
+    std::vector< shared_ptr<Osmium::OSM::Way const> > ways;
+    ProbeSet nodes;
+
+    void add(const shared_ptr<Osmium::OSM::Way const>& way, bool same_nodes) {
+        first.push_back(nodes.size());
+        unchanged.push_back(same_nodes);
+        ways.push_back(way);
+
+        const Osmium::OSM::WayNodeList& waynodes = way->nodes();
+        for(int i = 0, l = waynodes.size(); i<l; i++) {
+            nodes.add(waynodes[i].ref());
+        }
+    }
+
+    bool full() const {
+        return ways.size() >= max_objects || nodes.size() >= max_refs;
+    }
+
+    bool empty() const {
+        return ways.empty();
+    }
+
+    int size() const {
+        return ways.size();
+    }
+
+    // the number of the reference to the first waynode of a way, the others follow it
+    uint32_t first_node(int way) const {
+        return first[way];
+    }
+
+    bool same_nodes(int way) const {
+        return unchanged[way];
+    }
+
+    void clear() {
+        first.clear();
+        unchanged.clear();
+        ways.clear();
+        nodes.clear();
+    }
+};
+
+// relation-versions collected for batched probes of their node- and way-members
+class RelationBatch {
+
+private:
+    static const size_t max_objects = 8*1024;
+    static const size_t max_refs = 64*1024;
+
+    // the index of the first member of every relation in refs
+    std::vector<uint32_t> first;
+
+    // per member, the number of its reference in nodes or ways, relation-members are not batched
+    std::vector<uint32_t> refs;
+
+public:
+    std::vector< shared_ptr<Osmium::OSM::Relation const> > relations;
+    ProbeSet nodes;
+    ProbeSet ways;
+
+    void add(const shared_ptr<Osmium::OSM::Relation const>& relation) {
+        first.push_back(refs.size());
+        relations.push_back(relation);
+
+        const Osmium::OSM::RelationMemberList& members = relation->members();
+        for(int i = 0, l = members.size(); i<l; i++) {
+            const Osmium::OSM::RelationMember& member = members[i];
+            if(member.type() == 'n')
+                refs.push_back(nodes.add(member.ref()));
+            else if(member.type() == 'w')
+                refs.push_back(ways.add(member.ref()));
+            else
+                refs.push_back(0);
+        }
+    }
+
+    bool full() const {
+        return relations.size() >= max_objects || refs.size() >= max_refs;
+    }
+
+    bool empty() const {
+        return relations.empty();
+    }
+
+    int size() const {
+        return relations.size();
+    }
+
+    void prepare(int trackers) {
+        nodes.prepare(trackers);
+        ways.prepare(trackers);
+    }
+
+    // was the node- or way-member set in the last probed trackers, false for relation-members
+    bool hit(int relation, int member) const {
+        const Osmium::OSM::RelationMember& m = relations[relation]->members()[member];
+        uint32_t ref = refs[first[relation] + member];
+
+        if(m.type() == 'n')
+            return nodes.hit(ref);
+        if(m.type() == 'w')
+            return ways.hit(ref);
+        return false;
+    }
+
+    void clear() {
+        first.clear();
+        refs.clear();
+        relations.clear();
+        nodes.clear();
+        ways.clear();
+    }
+};
+
+#endif // SPLITTER_PROBE_BATCH_HPP
@@ -0,0 +1,330 @@
+#ifndef SPLITTER_RESULT_CACHE_HPP
+#define SPLITTER_RESULT_CACHE_HPP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tempfiles.hpp"
+
+/*
+
+Result Cache (--cache)
+ - every extract is keyed by a hash of
+   - the fingerprint of the file it is cut from
+   - the mode (softcut or hardcut)
+   - its type, its specification and the content of its .poly or .osm file
+   - its options, except memory= and from= which don't change the output
+ - a fingerprint is the size of a file and a hash of its first megabyte and of 16
+   samples spread over the rest, so fingerprinting a planet costs a few seeks
+ - after a successful run a manifest is written next to every output (a hidden
+   .NAME.manifest), holding the key and the fingerprint of the output
+ - before a run, every extract whose manifest has the current key and whose output
+   still has the fingerprint of the manifest is removed from the config, only the
+   remaining extracts are planned and split
+ - a failed run writes no manifests, so a rerun redoes only what's missing
+
+*/
+
+class ResultCache {
+
+private:
+    static const uint64_t fnv_offset = 14695981039346656037ULL;
+    static const uint64_t fnv_prime = 1099511628211ULL;
+
+    // bump when the output for the same key changes
+    static const int version = 1;
+
+    static const size_t head_size = 1024*1024;
+    static const size_t sample_size = 64*1024;
+    static const int samples = 16;
+
+    std::string input;
+    std::string mode;
+    std::string conffile;
+
+    // fingerprints of the inputs, by filename
+    std::map<std::string, std::string> inputs;
+
+    static uint64_t fnv(uint64_t hash, const char *data, size_t len) {
+        for(size_t i = 0; i < len; i++) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= fnv_prime;
+        }
+        return hash;
+    }
+
+    static uint64_t fnv(uint64_t hash, const std::string &s) {
+        // the length keeps "ab","c" and "a","bc" apart
+        uint32_t len = s.size();
+        hash = fnv(hash, reinterpret_cast<const char *>(&len), sizeof(len));
+        return fnv(hash, s.data(), s.size());
+    }
+
+    static std::string hex(uint64_t hash) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+        return buf;
+    }
+
+    static bool read_at(int fd, std::vector<char> &buf, size_t len, off_t offset) {
+        size_t pos = 0;
+        while(pos < len) {
+            ssize_t r = pread(fd, &buf[pos], len - pos, offset + pos);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) return false;
+            pos += r;
+        }
+        return true;
+    }
+
+    /**
+     * the size and a hash of the head and some samples of a file.
+     *
+     * this method returns false if the file can't be read.
+     */
+    static bool fingerprint(const std::string &filename, std::string &result) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+
+        struct stat st;
+        if(0 != fstat(fd, &st)) {
+            close(fd);
+            return false;
+        }
+
+        off_t size = st.st_size;
+        uint64_t hash = fnv_offset;
+        std::vector<char> buf(head_size);
+
+        size_t head = std::min(static_cast<off_t>(head_size), size);
+        bool ok = read_at(fd, buf, head, 0);
+        hash = fnv(hash, &buf[0], head);
+
+        if(ok && size > static_cast<off_t>(head_size + sample_size)) {
+            off_t step = (size - head_size - sample_size) / samples;
+            for(int i = 1; i <= samples && ok; i++) {
+                ok = read_at(fd, buf, sample_size, head_size + i * step);
+                hash = fnv(hash, &buf[0], sample_size);
+            }
+        }
+        close(fd);
+
+        if(!ok)
+            return false;
+
+        std::ostringstream out;
+        out << size << ":" << hex(hash);
+        result = out.str();
+        return true;
+    }
+
+    static bool read_file(const std::string &filename, std::string &content) {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        if(!in)
+            return false;
+
+        std::ostringstream out;
+        out << in.rdbuf();
+        content = out.str();
+        return true;
+    }
+
+    static std::string manifest_name(const std::string &name) {
+        size_t slash = name.find_last_of('/');
+        if(slash == std::string::npos)
+            return "." + name + ".manifest";
+        return name.substr(0, slash + 1) + "." + name.substr(slash + 1) + ".manifest";
+    }
+
+    // split a config line into its tokens, returns false for comments and empty lines
+    static bool tokenize(char *line, std::vector<std::string> &tokens) {
+        tokens.clear();
+        if(line[0] == '#' || line[0] == '\r' || line[0] == '\n' || line[0] == '\0')
+            return false;
+
+        for(char *tok = strtok(line, "\t \r\n"); tok; tok = strtok(NULL, "\t \r\n")) {
+            tokens.push_back(tok);
+        }
+        return true;
+    }
+
+    // the key of a config line, empty if its input or geometry file can't be read
+    std::string key(const std::vector<std::string> &tokens) {
+        std::string from = input;
+        for(int i = 3, l = tokens.size(); i<l; i++) {
+            if(0 == tokens[i].compare(0, 5, "from="))
+                from = tokens[i].substr(5);
+        }
+
+        if(inputs.find(from) == inputs.end()) {
+            std::string print;
+            if(!fingerprint(from, print))
+                return "";
+            inputs[from] = print;
+        }
+
+        int v = version;
+        uint64_t hash = fnv_offset;
+        hash = fnv(hash, reinterpret_cast<const char *>(&v), sizeof(v));
+        hash = fnv(hash, inputs[from]);
+        hash = fnv(hash, mode);
+        hash = fnv(hash, tokens[1]);
+        hash = fnv(hash, tokens[2]);
+
+        if(tokens[1] == "POLY" || tokens[1] == "OSM") {
+            std::string content;
+            if(!read_file(tokens[2], content))
+                return "";
+            hash = fnv(hash, content);
+        }
+
+        for(int i = 3, l = tokens.size(); i<l; i++) {
+            if(0 == tokens[i].compare(0, 5, "from=") || 0 == tokens[i].compare(0, 7, "memory="))
+                continue;
+            hash = fnv(hash, tokens[i]);
+        }
+
+        return hex(hash);
+    }
+
+    // does the manifest of an output have the key and does the output still match it
+    bool fresh(const std::string &name, const std::string &key) {
+        std::ifstream in(manifest_name(name).c_str());
+        std::string stored_key, stored_print, print;
+        if(!(in >> stored_key >> stored_print))
+            return false;
+
+        return stored_key == key && fingerprint(name, print) && print == stored_print;
+    }
+
+public:
+    ResultCache(const std::string &input, bool softcut) : input(input), mode(softcut ? "softcut" : "hardcut") {}
+
+    ~ResultCache() {
+        if(!conffile.empty())
+            unlink(conffile.c_str());
+    }
+
+    /**
+     * write a config with only the lines whose outputs are missing or out of date.
+     *
+     * this method returns NULL if the config can't be read or written.
+     */
+    const char *filter(const char *original) {
+        const int linelen = 4096;
+
+        FILE *fp = fopen(original, "r");
+        if(!fp) {
+            std::cerr << "unable to open config file " << original << std::endl;
+            return NULL;
+        }
+
+        if(!TempFiles::create_file(conffile)) {
+            std::cerr << "unable to create filtered config: " << strerror(errno) << std::endl;
+            fclose(fp);
+            return NULL;
+        }
+
+        std::ofstream out(conffile.c_str());
+        int kept = 0, skipped = 0;
+
+        char line[linelen];
+        std::vector<std::string> tokens;
+        while(fgets(line, linelen-1, fp)) {
+            line[linelen-1] = '\0';
+            std::string original_line = line;
+            if(!tokenize(line, tokens) || tokens.size() < 3)
+                continue;
+
+            std::string k = key(tokens);
+            if(!k.empty() && fresh(tokens[0], k)) {
+                std::cerr << "skipping " << tokens[0] << ", its output is up to date" << std::endl;
+                skipped++;
+                continue;
+            }
+
+            out << original_line;
+            if(original_line.empty() || original_line[original_line.size()-1] != '\n')
+                out << "\n";
+            kept++;
+        }
+        fclose(fp);
+        out.close();
+
+        if(!out) {
+            std::cerr << "unable to write filtered config " << conffile << std::endl;
+            return NULL;
+        }
+
+        std::cerr << "cache: " << skipped << " extracts up to date, " << kept << " to split" << std::endl;
+        return conffile.c_str();
+    }
+
+    // is there nothing left to split
+    bool empty() const {
+        std::ifstream in(conffile.c_str());
+        std::string line;
+        return !std::getline(in, line);
+    }
+
+    /**
+     * write the manifests of all outputs of a config after it was split
+     * successfully from the cache's input.
+     *
+     * this method returns false if a manifest can't be written.
+     */
+    bool record(const char *conffile) {
+        const int linelen = 4096;
+
+        FILE *fp = fopen(conffile, "r");
+        if(!fp) {
+            std::cerr << "unable to open config file " << conffile << std::endl;
+            return false;
+        }
+
+        bool ok = true;
+        char line[linelen];
+        std::vector<std::string> tokens;
+        while(fgets(line, linelen-1, fp)) {
+            line[linelen-1] = '\0';
+            if(!tokenize(line, tokens) || tokens.size() < 3)
+                continue;
+
+            std::string k = key(tokens), print;
+            if(k.empty() || !fingerprint(tokens[0], print))
+                continue;
+
+            // written aside and renamed, so a crash leaves no half manifest
+            std::string manifest = manifest_name(tokens[0]);
+            std::string tmp = manifest + ".tmp";
+            std::ofstream out(tmp.c_str());
+            out << k << " " << print << "\n";
+            out.close();
+
+            if(!out || 0 != rename(tmp.c_str(), manifest.c_str())) {
+                std::cerr << "unable to write manifest " << manifest << std::endl;
+                unlink(tmp.c_str());
+                ok = false;
+            }
+        }
+        fclose(fp);
+        return ok;
+    }
+};
+
+#endif // SPLITTER_RESULT_CACHE_HPP
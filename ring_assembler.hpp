@@ -0,0 +1,227 @@
+#ifndef SPLITTER_RING_ASSEMBLER_HPP
+#define SPLITTER_RING_ASSEMBLER_HPP
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <geos/util/GEOSException.h>
+#include <geos/geom/MultiPolygon.h>
+#include <osmium/geometry/geos.hpp>
+
+#include "prepared_polygon.hpp"
+
+/*
+
+Ring Assembly (OSM and REL extracts)
+ - the node locations of a boundary are kept in a sparse store: one entry of
+   id and fixed-point location per node, sorted by id once after loading and
+   searched with a binary search. it only grows with the number of nodes of the
+   boundary, not with the highest node id like an array indexed by id
+ - the node-id lists of the ways of a boundary are joined at their end-nodes
+   into closed rings, in either direction, so a ring may be split over many ways.
+   the ways are indexed by both of their end-nodes, so the way continuing a ring
+   is looked up instead of searched among all ways
+ - rings are turned into polygons with the locations from the store, the outer
+   polygons minus the inner polygons are the boundary, just like a .poly file
+
+*/
+
+// sparse id -> location store, sorted by id
+class NodeLocations {
+
+private:
+    struct Entry {
+        int64_t id;
+        int32_t x;
+        int32_t y;
+
+        bool operator<(const Entry &other) const {
+            return id < other.id;
+        }
+    };
+
+    std::vector<Entry> entries;
+    bool sorted;
+
+public:
+    NodeLocations() : sorted(true) {}
+
+    // add a location, a later location of the same id replaces an earlier one
+    void add(int64_t id, int32_t x, int32_t y) {
+        Entry e;
+        e.id = id;
+        e.x = x;
+        e.y = y;
+
+        if(!entries.empty() && !(entries.back() < e))
+            sorted = false;
+        entries.push_back(e);
+    }
+
+    // sort the store after all locations are added, keeping the last location of every id
+    void sort() {
+        if(sorted)
+            return;
+
+        std::stable_sort(entries.begin(), entries.end());
+
+        size_t out = 0;
+        for(size_t i = 0, l = entries.size(); i<l; i++) {
+            if(out > 0 && entries[out-1].id == entries[i].id)
+                out--;
+            entries[out++] = entries[i];
+        }
+        entries.resize(out);
+        sorted = true;
+    }
+
+    // the location of a node, false if the store doesn't have it
+    bool find(int64_t id, int32_t &x, int32_t &y) const {
+        Entry key;
+        key.id = id;
+
+        std::vector<Entry>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), key);
+        if(it == entries.end() || it->id != id)
+            return false;
+
+        x = it->x;
+        y = it->y;
+        return true;
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+};
+
+class RingAssembler {
+
+public:
+    typedef std::vector<int64_t> nodelist_t;
+
+    /**
+     * join the node-lists of ways at their end-nodes. closed rings are appended
+     * to rings, the node-lists which can't be closed to open.
+     */
+    static void join(std::vector<nodelist_t> pending, std::vector<nodelist_t> &rings, std::vector<nodelist_t> &open) {
+        // the ways by both of their end-nodes, entries of joined ways are dropped when they are met
+        typedef std::multimap<int64_t, size_t> ends_t;
+        ends_t ends;
+        std::vector<bool> joined(pending.size(), false);
+        for(size_t i = 0, l = pending.size(); i<l; i++) {
+            if(pending[i].empty())
+                continue;
+            ends.insert(std::make_pair(pending[i].front(), i));
+            ends.insert(std::make_pair(pending[i].back(), i));
+        }
+
+        // rings are started from the last way, like taking them off a stack
+        for(size_t start = pending.size(); start-- > 0; ) {
+            if(joined[start])
+                continue;
+            joined[start] = true;
+
+            nodelist_t ring;
+            ring.swap(pending[start]);
+
+            while(ring.size() >= 2 && ring.front() != ring.back()) {
+                size_t next = pending.size();
+                std::pair<ends_t::iterator, ends_t::iterator> range = ends.equal_range(ring.back());
+                for(ends_t::iterator it = range.first; it != range.second && next == pending.size(); ) {
+                    if(joined[it->second]) {
+                        ends.erase(it++);
+                    } else {
+                        next = it->second;
+                    }
+                }
+
+                if(next == pending.size())
+                    break;
+
+                joined[next] = true;
+                nodelist_t &way = pending[next];
+                if(way.front() == ring.back())
+                    ring.insert(ring.end(), way.begin() + 1, way.end());
+                else
+                    ring.insert(ring.end(), way.rbegin() + 1, way.rend());
+            }
+
+            if(ring.size() >= 2 && ring.front() == ring.back())
+                rings.push_back(ring);
+            else
+                open.push_back(ring);
+        }
+    }
+
+    // destroy a vector of geometries, after a failure while building them
+    static void destroy(std::vector<geos::geom::Geometry*> *geoms) {
+        geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
+        for(int i = 0, l = geoms->size(); i<l; i++) {
+            f->destroyGeometry((*geoms)[i]);
+        }
+        delete geoms;
+    }
+
+    /**
+     * build a polygon from a closed ring, the caller owns the returned geometry.
+     *
+     * this method returns NULL if a node of the ring is missing in the store (its
+     * id is stored in missing then) or the ring is no valid polygon (missing is 0).
+     */
+    static geos::geom::Geometry *polygon(const nodelist_t &ring, const NodeLocations &locations, int64_t &missing) {
+        missing = 0;
+        if(ring.size() < 4)
+            return NULL;
+
+        std::vector<geos::geom::Coordinate> *c = new std::vector<geos::geom::Coordinate>();
+        for(int i = 0, l = ring.size(); i<l; i++) {
+            int32_t x, y;
+            if(!locations.find(ring[i], x, y)) {
+                missing = ring[i];
+                delete c;
+                return NULL;
+            }
+            c->push_back(geos::geom::Coordinate(
+                static_cast<double>(x) / PreparedPolygon::coordinate_precision,
+                static_cast<double>(y) / PreparedPolygon::coordinate_precision,
+                DoubleNotANumber));
+        }
+
+        geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
+        try {
+            return f->createPolygon(f->createLinearRing(f->getCoordinateSequenceFactory()->create(c)), NULL);
+        } catch(geos::util::GEOSException e) {
+            std::cerr << "error creating polygon: " << e.what() << std::endl;
+            return NULL;
+        }
+    }
+
+    /**
+     * the outer polygons minus the inner polygons, both vectors are taken over.
+     *
+     * this method returns NULL if geos fails to build the difference.
+     */
+    static geos::geom::Geometry *difference(std::vector<geos::geom::Geometry*> *outer, std::vector<geos::geom::Geometry*> *inner) {
+        geos::geom::GeometryFactory *f = Osmium::Geometry::geos_geometry_factory();
+        geos::geom::MultiPolygon *outerPoly = NULL;
+        geos::geom::MultiPolygon *innerPoly = NULL;
+        geos::geom::Geometry *poly = NULL;
+        try {
+            outerPoly = f->createMultiPolygon(outer);
+            innerPoly = f->createMultiPolygon(inner);
+
+            poly = outerPoly->difference(innerPoly);
+        } catch(geos::util::GEOSException e) {
+            std::cerr << "error creating multipolygon: " << e.what() << std::endl;
+        }
+
+        if(outerPoly) f->destroyGeometry(outerPoly);
+        if(innerPoly) f->destroyGeometry(innerPoly);
+        return poly;
+    }
+};
+
+#endif // SPLITTER_RING_ASSEMBLER_HPP
@@ -0,0 +1,492 @@
+#ifndef SPLITTER_SCHEDULER_HPP
+#define SPLITTER_SCHEDULER_HPP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "numa.hpp"
+#include "tempfiles.hpp"
+
+/*
+
+Scheduler (--threads)
+ - the config is read line by line without creating any geometry. a line with a
+   from=FILE option is cut from FILE instead of the input, if FILE is the output of
+   another line the line depends on it (ie. germany from=europe.osh.pbf)
+ - every extract gets the tracker memory given by its memory= option, the estimate
+   of the planner or a fixed default, a GRID line the default for each of its cells.
+   the memory of the location store of a locations= extract is part of the memory=
+   option and the planner's estimate, a line with locations= but neither gets twice
+   the default
+ - the extracts reading the same file are packed first-fit-decreasing into passes
+   which fit into --max-memory, so each file is read as few times as possible
+ - the passes are run as child processes, each with a config of its own:
+   - a pass is started when the pass creating its input has finished
+   - at most --threads passes run at the same time
+   - the memory of all running passes stays below --max-memory, a pass which
+     doesn't fit on its own is run alone
+ - when a pass fails, all passes depending on it are skipped
+ - with --numa every pass is bound to the numa node running the fewest passes
+
+*/
+
+class Scheduler {
+
+private:
+    enum PassState {
+        WAITING,
+        RUNNING,
+        DONE,
+        FAILED
+    };
+
+    struct Job {
+        std::string name;
+        std::string from;
+
+        // the config line without the from= option
+        std::vector<std::string> tokens;
+
+        double memory;
+        bool measured;
+        int pass;
+
+        // a GRID line is one job for all of its cells
+        int cells;
+
+        // written into shards, there is no file of its name to cut from
+        bool sharded;
+    };
+
+    struct Pass {
+        std::string input;
+        std::vector<int> jobs;
+        double memory;
+        int depends_on;
+        std::string conffile;
+        pid_t pid;
+        PassState state;
+        int node;
+    };
+
+    static bool by_memory(const Job *a, const Job *b) {
+        return a->memory > b->memory;
+    }
+
+    std::string input;
+    int threads;
+    double max_memory;
+    double default_memory;
+
+    // numa nodes the passes are bound to, 0 doesn't bind them
+    int numa_nodes;
+
+    std::string dir;
+    std::string all_conffile;
+
+    std::vector<Job> jobs;
+    std::vector<Pass> passes;
+
+    int find_job(const std::string &name) const {
+        for(int i = 0, l = jobs.size(); i<l; i++) {
+            if(jobs[i].name == name)
+                return i;
+        }
+        return -1;
+    }
+
+    bool write_config(const std::string &path, const std::vector<int> &selected) const {
+        std::ofstream out(path.c_str());
+        for(int i = 0, l = selected.size(); i<l; i++) {
+            const Job &job = jobs[selected[i]];
+            for(int ii = 0, ll = job.tokens.size(); ii<ll; ii++) {
+                out << (ii ? "\t" : "") << job.tokens[ii];
+            }
+            out << "\n";
+        }
+        out.close();
+
+        if(!out) {
+            std::cerr << "unable to write pass config " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool make_dir() {
+        if(!dir.empty())
+            return true;
+
+        if(!TempFiles::create_directory(dir, false)) {
+            std::cerr << "unable to create directory for pass configs: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // the numa node running the fewest passes
+    int idle_node() const {
+        std::vector<int> load(numa_nodes, 0);
+        for(int i = 0, l = passes.size(); i<l; i++) {
+            if(passes[i].state == RUNNING && passes[i].node >= 0)
+                load[passes[i].node]++;
+        }
+        return std::min_element(load.begin(), load.end()) - load.begin();
+    }
+
+    // start all passes that are ready and fit, returns the number of started passes
+    template <class TRunner>
+    int start_ready(TRunner &runner, int &running, double &used_memory) {
+        int started = 0;
+
+        for(int i = 0, l = passes.size(); i<l; i++) {
+            Pass &pass = passes[i];
+            if(pass.state != WAITING)
+                continue;
+
+            if(pass.depends_on >= 0) {
+                PassState dep = passes[pass.depends_on].state;
+                if(dep == FAILED) {
+                    std::cerr << "skipping pass " << (i+1) << ", its input " << pass.input << " failed" << std::endl;
+                    pass.state = FAILED;
+                    continue;
+                }
+                if(dep != DONE)
+                    continue;
+            }
+
+            if(running >= threads)
+                break;
+
+            if(running > 0 && used_memory + pass.memory > max_memory)
+                continue;
+
+            pass.node = numa_nodes > 0 ? idle_node() : -1;
+            if(pass.node >= 0)
+                std::cerr << "starting pass " << (i+1) << " on " << pass.input << " on numa node " << pass.node << std::endl;
+            else
+                std::cerr << "starting pass " << (i+1) << " on " << pass.input << std::endl;
+
+            std::cout.flush();
+            std::cerr.flush();
+
+            pid_t pid = fork();
+            if(pid < 0) {
+                std::cerr << "unable to fork pass " << (i+1) << ": " << strerror(errno) << std::endl;
+                pass.state = FAILED;
+                continue;
+            }
+
+            if(pid == 0) {
+                if(pass.node >= 0)
+                    Numa::bind_process(pass.node);
+
+                int ret = runner(pass.input, pass.conffile);
+                std::cout.flush();
+                std::cerr.flush();
+                _exit(ret);
+            }
+
+            pass.pid = pid;
+            pass.state = RUNNING;
+            running++;
+            used_memory += pass.memory;
+            started++;
+        }
+
+        return started;
+    }
+
+public:
+    Scheduler(const std::string &input, int threads, size_t max_memory, size_t default_memory) :
+        input(input), threads(threads > 0 ? threads : 1), max_memory(max_memory), default_memory(default_memory), numa_nodes(0) {}
+
+    ~Scheduler() {
+        for(int i = 0, l = passes.size(); i<l; i++) {
+            if(!passes[i].conffile.empty())
+                unlink(passes[i].conffile.c_str());
+        }
+
+        if(!all_conffile.empty())
+            unlink(all_conffile.c_str());
+
+        if(!dir.empty())
+            rmdir(dir.c_str());
+    }
+
+    // bind the passes to numa nodes, spreading them over the given number of nodes
+    void spread(int nodes) {
+        numa_nodes = nodes;
+    }
+
+    /**
+     * read the names and the from= and memory= options of all config lines.
+     *
+     * this method returns false if the config can't be read.
+     */
+    bool read_config(const char *conffile) {
+        const int linelen = 4096;
+
+        FILE *fp = fopen(conffile, "r");
+        if(!fp) {
+            std::cerr << "unable to open config file " << conffile << std::endl;
+            return false;
+        }
+
+        char line[linelen];
+        while(fgets(line, linelen-1, fp)) {
+            line[linelen-1] = '\0';
+            if(line[0] == '#' || line[0] == '\r' || line[0] == '\n' || line[0] == '\0')
+                continue;
+
+            Job job;
+            job.memory = default_memory;
+            job.cells = 1;
+            job.measured = false;
+            job.pass = -1;
+            job.sharded = false;
+            bool locations = false;
+
+            int n = 0;
+            for(char *tok = strtok(line, "\t \r\n"); tok; tok = strtok(NULL, "\t \r\n"), n++) {
+                if(n == 0)
+                    job.name = tok;
+
+                double g[6];
+                if(n == 2 && job.tokens.size() == 2 && job.tokens[1] == "GRID" &&
+                    6 == sscanf(tok, "%lf,%lf,%lf,%lf,%lf,%lf", &g[0], &g[1], &g[2], &g[3], &g[4], &g[5]) && g[4] > 0 && g[5] > 0) {
+                    job.cells = static_cast<int>(ceil((g[2] - g[0]) / g[4])) * static_cast<int>(ceil((g[3] - g[1]) / g[5]));
+                    job.memory = default_memory * job.cells;
+                }
+
+                if(n >= 3 && 0 == strncmp(tok, "from=", 5)) {
+                    job.from = tok + 5;
+                    continue;
+                }
+
+                if(n >= 3 && 0 == strncmp(tok, "memory=", 7)) {
+                    job.memory = atof(tok + 7) * 1024 * 1024;
+                    job.measured = true;
+                }
+
+                if(n >= 3 && 0 == strncmp(tok, "locations=", 10))
+                    locations = true;
+
+                if(n >= 3 && (0 == strncmp(tok, "shards=", 7) || 0 == strncmp(tok, "shard-size=", 11)))
+                    job.sharded = true;
+
+                job.tokens.push_back(tok);
+            }
+
+            // lines without a specification are skipped by the splitter, too
+            if(n < 3)
+                continue;
+
+            // the location store takes about as much as the trackers
+            if(locations && !job.measured)
+                job.memory *= 2;
+
+            if(find_job(job.name) >= 0) {
+                std::cerr << "output " << job.name << " is listed twice" << std::endl;
+                fclose(fp);
+                return false;
+            }
+
+            jobs.push_back(job);
+        }
+        fclose(fp);
+        return true;
+    }
+
+    // does any extract depend on another one
+    bool has_dependencies() const {
+        for(int i = 0, l = jobs.size(); i<l; i++) {
+            if(!jobs[i].from.empty())
+                return true;
+        }
+        return false;
+    }
+
+    // a config with all extracts and without from= options, for estimating the memory
+    const char *all_config() {
+        if(all_conffile.empty()) {
+            if(!make_dir())
+                return NULL;
+
+            std::vector<int> all;
+            for(int i = 0, l = jobs.size(); i<l; i++) {
+                all.push_back(i);
+            }
+
+            all_conffile = dir + "/all.config";
+            if(!write_config(all_conffile, all))
+                return NULL;
+        }
+        return all_conffile.c_str();
+    }
+
+    // set the estimated tracker memory of an extract without a memory= option
+    void estimate(const std::string &name, double bytes) {
+        int i = find_job(name);
+        if(i >= 0 && !jobs[i].measured)
+            jobs[i].memory = bytes;
+    }
+
+    /**
+     * pack the extracts into passes and write their configs.
+     *
+     * this method returns false if a from= option refers to nothing.
+     */
+    bool plan() {
+        if(!make_dir())
+            return false;
+
+        // group the extracts by the file they are cut from, in config order
+        std::vector<std::string> inputs;
+        for(int i = 0, l = jobs.size(); i<l; i++) {
+            std::string from = jobs[i].from.empty() ? input : jobs[i].from;
+
+            if(from == jobs[i].name) {
+                std::cerr << "output " << jobs[i].name << " can't be cut from itself" << std::endl;
+                return false;
+            }
+
+            if(from != input && find_job(from) >= 0 && jobs[find_job(from)].sharded) {
+                std::cerr << "output " << jobs[i].name << " is cut from " << from << ", which is written into shards" << std::endl;
+                return false;
+            }
+
+            if(from != input && find_job(from) < 0 && 0 != access(from.c_str(), R_OK)) {
+                std::cerr << "output " << jobs[i].name << " is cut from " << from << ", which is neither an output of the config nor a readable file" << std::endl;
+                return false;
+            }
+
+            if(std::find(inputs.begin(), inputs.end(), from) == inputs.end())
+                inputs.push_back(from);
+        }
+
+        for(int i = 0, l = inputs.size(); i<l; i++) {
+            std::vector<Job*> group;
+            for(int ii = 0, ll = jobs.size(); ii<ll; ii++) {
+                std::string from = jobs[ii].from.empty() ? input : jobs[ii].from;
+                if(from == inputs[i])
+                    group.push_back(&jobs[ii]);
+            }
+            std::sort(group.begin(), group.end(), by_memory);
+
+            // first-fit-decreasing into the passes of this input
+            size_t first = passes.size();
+            for(int ii = 0, ll = group.size(); ii<ll; ii++) {
+                size_t p = first;
+                while(p < passes.size() && passes[p].memory + group[ii]->memory > max_memory)
+                    p++;
+
+                if(p == passes.size()) {
+                    Pass pass;
+                    pass.input = inputs[i];
+                    pass.memory = 0;
+                    pass.depends_on = -1;
+                    pass.pid = 0;
+                    pass.state = WAITING;
+                    pass.node = -1;
+                    passes.push_back(pass);
+                }
+
+                passes[p].jobs.push_back(group[ii] - &jobs[0]);
+                passes[p].memory += group[ii]->memory;
+                group[ii]->pass = p;
+            }
+        }
+
+        for(int i = 0, l = passes.size(); i<l; i++) {
+            Pass &pass = passes[i];
+
+            int parent = find_job(pass.input);
+            if(parent >= 0)
+                pass.depends_on = jobs[parent].pass;
+
+            std::ostringstream conffile;
+            conffile << dir << "/pass-" << (i+1) << ".config";
+            pass.conffile = conffile.str();
+            if(!write_config(pass.conffile, pass.jobs))
+                return false;
+
+            std::cerr << "pass " << (i+1) << ": " << pass.jobs.size() << " extracts from " << pass.input
+                << ", " << static_cast<int>(pass.memory / (1024*1024)) << " MB";
+            if(pass.depends_on >= 0)
+                std::cerr << ", after pass " << (pass.depends_on+1);
+            std::cerr << std::endl;
+        }
+
+        return true;
+    }
+
+    /**
+     * run all passes, calling runner(input, conffile) in a child process for each of them.
+     *
+     * this method returns false if any pass failed or couldn't be run.
+     */
+    template <class TRunner>
+    bool run(TRunner &runner) {
+        int running = 0;
+        double used_memory = 0;
+        bool ok = true;
+
+        while(1) {
+            start_ready(runner, running, used_memory);
+
+            if(running == 0)
+                break;
+
+            int status;
+            pid_t pid = wait(&status);
+            if(pid < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "error waiting for passes: " << strerror(errno) << std::endl;
+                return false;
+            }
+
+            for(int i = 0, l = passes.size(); i<l; i++) {
+                Pass &pass = passes[i];
+                if(pass.state != RUNNING || pass.pid != pid)
+                    continue;
+
+                running--;
+                used_memory -= pass.memory;
+
+                if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                    std::cerr << "pass " << (i+1) << " finished" << std::endl;
+                    pass.state = DONE;
+                } else {
+                    std::cerr << "pass " << (i+1) << " failed" << std::endl;
+                    pass.state = FAILED;
+                }
+            }
+        }
+
+        for(int i = 0, l = passes.size(); i<l; i++) {
+            if(passes[i].state == WAITING)
+                std::cerr << "pass " << (i+1) << " never started, the from= options of its extracts form a cycle" << std::endl;
+
+            if(passes[i].state != DONE)
+                ok = false;
+        }
+
+        return ok;
+    }
+};
+
+#endif // SPLITTER_SCHEDULER_HPP
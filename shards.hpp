@@ -0,0 +1,216 @@
+#ifndef SPLITTER_SHARDS_HPP
+#define SPLITTER_SHARDS_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <osmium.hpp>
+
+/*
+
+Sharded Outputs (shards= and shard-size= options of an extract)
+ - the output of an extract is written into numbered files instead of a single
+   one, europe.osh.pbf becomes europe-0000.osh.pbf, europe-0001.osh.pbf, ...
+ - every shard is a complete file of its own, with header and bounds
+ - the writer rolls over to the next shard between two objects, never between
+   two versions of the same object. the osmium writer flushes its last block
+   when it's closed, so no block is split between shards
+ - objects arrive sorted by type and id, so every shard holds a contiguous id
+   range of nodes, ways and relations
+ - shards=N: the softcut knows the objects of the extract after its first pass
+   and estimates their versions from the versions per id of the input, every
+   shard gets about the same number of versions
+ - shard-size=MB: the next shard is started as soon as the file of the current
+   shard reached MB. every shard is written through a sink, which counts the
+   bytes it wrote. the blocks the writer and the sink still hold are not
+   counted yet, so shards get a bit bigger than MB
+ - after the last shard, a manifest (europe.shards) lists the file and the
+   first and last node-, way- and relation-id of every shard, tab separated
+
+*/
+
+class ExtractInfo;
+
+// opens the writer of an extract on another file, implemented by the CutInfo
+class ShardOpener {
+
+public:
+    virtual ~ShardOpener() {}
+
+    // set writer and sink of the extract to a new output file
+    virtual void open_shard(ExtractInfo *ex, const std::string &filename, Osmium::OSM::Bounds &bounds) = 0;
+};
+
+class ShardedOutput {
+
+private:
+    struct Range {
+        osm_object_id_t first, last;
+        bool used;
+
+        Range() : first(0), last(0), used(false) {}
+
+        void add(osm_object_id_t id) {
+            if(!used) first = id;
+            last = id;
+            used = true;
+        }
+    };
+
+    struct Shard {
+        std::string filename;
+        Range nodes, ways, relations;
+    };
+
+    std::string stem;
+    std::string extension;
+
+    int max_shards;
+    uint64_t max_bytes;
+
+    // versions per shard with shards=, 0 until they are known
+    uint64_t per_shard;
+
+    std::vector<Shard> shards;
+    // versions written into the current shard
+    uint64_t versions;
+
+    char last_type;
+    osm_object_id_t last_id;
+
+    static std::string basename(const std::string &filename) {
+        return filename.substr(filename.find_last_of('/') + 1);
+    }
+
+    std::string shard_name(int n) const {
+        char num[16];
+        snprintf(num, sizeof(num), "-%04d", n);
+        return stem + num + extension;
+    }
+
+    bool shard_full(uint64_t bytes) const {
+        if(versions == 0)
+            return false;
+
+        if(per_shard > 0)
+            return versions >= per_shard && static_cast<int>(shards.size()) < max_shards;
+
+        return max_bytes > 0 && bytes >= max_bytes;
+    }
+
+    static void write_range(FILE *fp, const Range &range) {
+        if(range.used)
+            fprintf(fp, "\t%lld\t%lld", static_cast<long long>(range.first), static_cast<long long>(range.last));
+        else
+            fprintf(fp, "\t-\t-");
+    }
+
+public:
+    ShardOpener *opener;
+    Osmium::OSM::Bounds bounds;
+
+    /**
+     * shard the output name into at most max_shards shards (0 for no limit)
+     * or shards of max_bytes (0 for no limit).
+     */
+    ShardedOutput(ShardOpener *opener, const std::string &name, int max_shards, uint64_t max_bytes, const Osmium::OSM::Bounds &bounds) :
+        max_shards(max_shards), max_bytes(max_bytes), per_shard(0), versions(0), last_type('\0'), last_id(0),
+        opener(opener), bounds(bounds) {
+
+        // the extension starts at the first dot of the file name
+        size_t slash = name.find_last_of('/');
+        size_t dot = name.find('.', slash == std::string::npos ? 0 : slash + 1);
+        stem = name.substr(0, dot);
+        extension = dot == std::string::npos ? "" : name.substr(dot);
+
+        Shard first;
+        first.filename = shard_name(0);
+        shards.push_back(first);
+    }
+
+    // the file of the current shard
+    const std::string &filename() const {
+        return shards.back().filename;
+    }
+
+    std::string manifest() const {
+        return stem + ".shards";
+    }
+
+    // with shards=, spread the number of versions the extract will get over the shards
+    void expect(uint64_t total) {
+        if(max_shards > 0)
+            per_shard = std::max(static_cast<uint64_t>(1), (total + max_shards - 1) / max_shards);
+    }
+
+    /**
+     * account for a version about to be written, bytes is the size of the
+     * current shard so far.
+     *
+     * this method returns true if the current shard is full and the writer has
+     * to be rolled over to the next shard before writing it, which only
+     * happens at the first version of an object.
+     */
+    bool next(char type, osm_object_id_t id, uint64_t bytes) {
+        bool roll = false;
+        if(type != last_type || id != last_id) {
+            roll = shard_full(bytes);
+            if(roll) {
+                Shard shard;
+                shard.filename = shard_name(shards.size());
+                shards.push_back(shard);
+                versions = 0;
+            }
+
+            Shard &shard = shards.back();
+            if(type == 'n') shard.nodes.add(id);
+            else if(type == 'w') shard.ways.add(id);
+            else shard.relations.add(id);
+
+            last_type = type;
+            last_id = id;
+        }
+
+        versions++;
+        return roll;
+    }
+
+    /**
+     * write the manifest of the shards.
+     *
+     * this method returns false if the manifest can't be written.
+     */
+    bool write_manifest() const {
+        FILE *fp = fopen(manifest().c_str(), "w");
+        if(!fp) {
+            std::cerr << "unable to write shard manifest " << manifest() << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        fprintf(fp, "# file\tfirst-node\tlast-node\tfirst-way\tlast-way\tfirst-relation\tlast-relation\n");
+        for(int i = 0, l = shards.size(); i<l; i++) {
+            fprintf(fp, "%s", basename(shards[i].filename).c_str());
+            write_range(fp, shards[i].nodes);
+            write_range(fp, shards[i].ways);
+            write_range(fp, shards[i].relations);
+            fprintf(fp, "\n");
+        }
+
+        if(0 != fclose(fp)) {
+            std::cerr << "unable to write shard manifest " << manifest() << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        std::cerr << "wrote " << shards.size() << " shards listed in " << manifest() << std::endl;
+        return true;
+    }
+};
+
+#endif // SPLITTER_SHARDS_HPP
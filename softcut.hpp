@@ -1,7 +1,11 @@
 #ifndef SPLITTER_SOFTCUT_HPP
 #define SPLITTER_SOFTCUT_HPP
 
+#include <algorithm>
+
 #include "cut.hpp"
+#include "probe_batch.hpp"
+#include "way_locations.hpp"
 
 /*
 
@@ -53,6 +57,21 @@ Second Pass
      - if the relation-id is recorded in the bboxes relation-tracker
        - send the relation to the bboxes writer
 
+history
+ - deleted node-versions are inside no extract, a node-version at the position of
+   the node-version before it is inside the same extracts without being tested again
+ - a way-version with the waynodes of the version before it reuses its tests
+
+batches
+ - ways and relations of the first pass are tested in batches, the node- and
+   way-references of a batch are looked up in the trackers of an extract sorted
+   and together (see probe_batch.hpp)
+
+way-locations (locations= option of an extract)
+ - the second pass stores the locations of the written node-versions and writes
+   every written way-version with the locations of its nodes at its timestamp to
+   a file of its own (see way_locations.hpp)
+
 features:
  - if an object is in the extract, all versions of it are there
  - ways and relations are not changed
@@ -64,6 +83,12 @@ disadvantages
    - ((1400000000÷8)+(1400000000÷8)+(130000000÷8)+(1500000÷8))÷1024÷1024 MB
  - relations will have dead references
 
+filters (types= and filter= options of an extract)
+ - nodes, ways and relations are recorded in their trackers only if one of their
+   versions inside the extract is accepted by the filter, so filtered extracts
+   stay history-complete
+ - all nodes of the written ways are written, so ways stay reference-complete
+
 */
 
 
@@ -75,22 +100,130 @@ public:
     growing_bitset way_tracker;
     growing_bitset relation_tracker;
 
-    SoftcutExtractInfo(std::string name) : ExtractInfo(name) {}
+    // only used by extracts with a filter: nodes inside the extract which are
+    // accepted by the filter and relations accepted by the filter
+    growing_bitset filtered_node_tracker;
+    growing_bitset filtered_relation_tracker;
+
+    // the node-locations of the extract with locations=, created by the second pass
+    WayLocations *locations;
+
+    SoftcutExtractInfo(std::string name) : ExtractInfo(name), locations(NULL) {}
+
+    ~SoftcutExtractInfo() {
+        delete locations;
+    }
+
+    // the softcut can write every extract, the nodes of the written ways are known in the second pass
+    static bool check_options(const std::string &, const ExtractOptions &) {
+        return true;
+    }
+
+    // bytes allocated by the trackers and the location store
+    size_t tracker_memory() const {
+        return node_tracker.memory_usage() + extra_node_tracker.memory_usage() +
+            way_tracker.memory_usage() + relation_tracker.memory_usage() +
+            filtered_node_tracker.memory_usage() + filtered_relation_tracker.memory_usage() +
+            (locations ? locations->memory_usage() : 0);
+    }
+
+    // move the trackers into files in dir
+    bool spill_trackers(const std::string &dir) {
+        growing_bitset *trackers[] = {&node_tracker, &extra_node_tracker, &way_tracker, &relation_tracker,
+            &filtered_node_tracker, &filtered_relation_tracker};
+
+        bool ok = true;
+        for(int i = 0; i < 6; i++) {
+            if(!trackers[i]->spill(dir))
+                ok = false;
+        }
+        return ok;
+    }
 };
 
 class SoftcutInfo : public CutInfo<SoftcutExtractInfo> {
 
+private:
+    // versions and ids of the nodes, ways and relations of the input, counted
+    // by the first pass to estimate the versions of sharded extracts
+    uint64_t input_versions[3];
+    uint64_t input_ids[3];
+    osm_object_id_t input_last_id[3];
+
+    static int type_index(char type) {
+        return type == 'n' ? 0 : (type == 'w' ? 1 : 2);
+    }
+
 public:
     std::multimap<osm_object_id_t, osm_object_id_t> cascading_relations_tracker;
+
+    SoftcutInfo() {
+        for(int i = 0; i<3; i++) {
+            input_versions[i] = 0;
+            input_ids[i] = 0;
+            input_last_id[i] = 0;
+        }
+    }
+
+    // count a version of the input, its versions follow each other
+    void count_input(char type, osm_object_id_t id) {
+        int t = type_index(type);
+        if(input_versions[t] == 0 || id != input_last_id[t])
+            input_ids[t]++;
+        input_last_id[t] = id;
+        input_versions[t]++;
+    }
+
+    // the average number of versions of an object of the type in the input
+    double versions_per_id(char type) const {
+        int t = type_index(type);
+        return input_ids[t] > 0 ? static_cast<double>(input_versions[t]) / input_ids[t] : 1.0;
+    }
+
+    /**
+     * close the way-locations of all extracts after the second pass.
+     *
+     * this method returns false if one of them couldn't be written.
+     */
+    bool close_locations() {
+        bool ok = true;
+        for(int i = 0, l = extracts.size(); i<l; i++) {
+            if(extracts[i]->locations && !extracts[i]->locations->close())
+                ok = false;
+        }
+        return ok;
+    }
 };
 
 
-class SoftcutPassOne : public Cut<SoftcutInfo> {
+template <class TDebug>
+class SoftcutPassOne : public Cut<SoftcutInfo, TDebug> {
 private:
+    using Cut<SoftcutInfo, TDebug>::debug;
+    using Cut<SoftcutInfo, TDebug>::pg;
+    using Cut<SoftcutInfo, TDebug>::info;
+
     osm_object_id_t current_way_id;
-    typedef std::set<osm_object_id_t> current_way_nodes_t;
-    typedef std::set<osm_object_id_t>::iterator current_way_nodes_it;
+    // collected unsorted and deduplicated only when needed, so the vector
+    // keeps its capacity and no node-id allocates memory in the way-phase
+    typedef std::vector<osm_object_id_t> current_way_nodes_t;
+    typedef std::vector<osm_object_id_t>::iterator current_way_nodes_it;
     current_way_nodes_t current_way_nodes;
+    bool current_way_nodes_unique;
+
+    // whether the last way-version has a node inside an extract. versions with
+    // the waynodes of the one before them reuse it, only extracts whose filter
+    // rejected all versions so far still have to be tested
+    enum WayTest {
+        UNTESTED,
+        INSIDE,
+        OUTSIDE
+    };
+    WayNodesMemo way_memo;
+
+    // the way- and relation-versions waiting to be tested, their references are probed together
+    WayBatch way_batch;
+    RelationBatch relation_batch;
 
     // - walk over all bboxes
     //   - if the way-id is in the bboxes way-id-tracker (in other words: the way is in the output)
@@ -100,6 +233,12 @@ private:
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
             SoftcutExtractInfo *extract = info->extracts[i];
             if(extract->way_tracker.get(current_way_id)) {
+                if(!current_way_nodes_unique) {
+                    std::sort(current_way_nodes.begin(), current_way_nodes.end());
+                    current_way_nodes.erase(std::unique(current_way_nodes.begin(), current_way_nodes.end()), current_way_nodes.end());
+                    current_way_nodes_unique = true;
+                }
+
                 if(debug) std::cerr << "way had a node inside extract [" << i << "], recording extra nodes" << std::endl;
                 for(current_way_nodes_it it = current_way_nodes.begin(), end = current_way_nodes.end(); it != end; it++) {
                     extract->extra_node_tracker.set(*it);
@@ -111,7 +250,7 @@ private:
     }
 
 public:
-    SoftcutPassOne(SoftcutInfo *info) : Cut<SoftcutInfo>(info), current_way_id(0), current_way_nodes() {}
+    SoftcutPassOne(SoftcutInfo *info) : Cut<SoftcutInfo, TDebug>(info), current_way_id(0), current_way_nodes(), current_way_nodes_unique(true) {}
 
     void init(Osmium::OSM::Meta& meta) {
         std::cerr << "softcut first-pass init" << std::endl;
@@ -136,14 +275,22 @@ public:
         } else {
             pg.node(node);
         }
+        info->check_pressure();
+        info->count_input('n', node->id());
 
-        for(int i = 0, l = info->extracts.size(); i<l; i++) {
-            SoftcutExtractInfo *extract = info->extracts[i];
-            if(extract->contains(node)) {
-                if(debug) std::cerr << "node is in extract [" << i << "], recording in node_tracker" << std::endl;
+        this->dispatch_node(this, node);
+    }
 
-                extract->node_tracker.set(node->id());
-            }
+    // the node-version is inside the extract
+    void node_inside(SoftcutExtractInfo *extract, const shared_ptr<Osmium::OSM::Node const>& node) {
+        if(debug) std::cerr << "node is in extract [" << extract->id << "], recording in node_tracker" << std::endl;
+
+        extract->node_tracker.set(node->id());
+
+        if(extract->options.filter.active() && extract->options.filter.matches(*node)) {
+            if(debug) std::cerr << "node is accepted by the filter of extract [" << extract->id << "], recording in filtered_node_tracker" << std::endl;
+
+            extract->filtered_node_tracker.set(node->id());
         }
     }
 
@@ -177,42 +324,88 @@ public:
     //       - append all nodes of the current-way-nodes set to the extra-node-tracker
 
     void way(const shared_ptr<Osmium::OSM::Way const>& way) {
-        // detect a new way
-        if(current_way_id != 0 && current_way_id != way->id()) {
-            write_way_extra_nodes();
-            current_way_nodes.clear();
-        }
-        current_way_id = way->id();
-
         if(debug) {
             std::cerr << "softcut way " << way->id() << " v" << way->version() << std::endl;
         } else {
             pg.way(way);
         }
+        info->check_pressure();
+        info->count_input('w', way->id());
 
-        Osmium::OSM::WayNodeList nodes = way->nodes();
-        for(int ii = 0, ll = nodes.size(); ii<ll; ii++) {
-            Osmium::OSM::WayNode node = nodes[ii];
-            current_way_nodes.insert(node.ref());
-        }
+        way_batch.add(way, way_memo.unchanged(way));
+        if(way_batch.full())
+            test_ways();
+    }
+
+    // probe the waynodes of all collected way-versions at once, then test them extract
+    // by extract, then collect the waynodes of the ways in input order
+    void test_ways() {
+        if(way_batch.empty())
+            return;
+
+        way_batch.nodes.prepare(info->extracts.size());
 
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
             SoftcutExtractInfo *extract = info->extracts[i];
+            way_batch.nodes.probe(extract->node_tracker);
+
+            WayTest test = UNTESTED;
+            for(int w = 0, wl = way_batch.size(); w<wl; w++) {
+                const shared_ptr<Osmium::OSM::Way const>& way = way_batch.ways[w];
+                if(!way_batch.same_nodes(w))
+                    test = UNTESTED;
+
+                // ways rejected by the filter don't make it into the way_tracker, so
+                // neither they nor their extra nodes are written
+                if(extract->options.filter.active() && !extract->options.filter.matches(*way))
+                    continue;
+
+                if(test == UNTESTED) {
+                    test = OUTSIDE;
+                    uint32_t ref = way_batch.first_node(w);
+                    for(int ii = 0, ll = way->nodes().size(); ii<ll; ii++, ref++) {
+                        if(way_batch.nodes.hit(ref)) {
+                            if(debug) std::cerr << "way " << way->id() << " v" << way->version() << " has a node (" << way->nodes()[ii].ref() << ") inside extract [" << i << "], recording in way_tracker" << std::endl;
+
+                            test = INSIDE;
+                            break;
+                        }
+                    }
+                }
 
-            for(int ii = 0, ll = nodes.size(); ii<ll; ii++) {
-                Osmium::OSM::WayNode node = nodes[ii];
-                if(extract->node_tracker.get(node.ref())) {
-                    if(debug) std::cerr << "way has a node (" << node.ref() << ") inside extract [" << i << "], recording in way_tracker" << std::endl;
-
+                if(test == INSIDE)
                     extract->way_tracker.set(way->id());
-                    break;
+            }
+        }
+
+        // the way_trackers are complete for all versions of the batch now
+        for(int w = 0, wl = way_batch.size(); w<wl; w++) {
+            const shared_ptr<Osmium::OSM::Way const>& way = way_batch.ways[w];
+
+            // detect a new way
+            if(current_way_id != 0 && current_way_id != way->id()) {
+                write_way_extra_nodes();
+                current_way_nodes.clear();
+            }
+            current_way_id = way->id();
+
+            // unchanged waynodes are already in the current-way-nodes set
+            if(!way_batch.same_nodes(w)) {
+                const Osmium::OSM::WayNodeList& nodes = way->nodes();
+                for(int ii = 0, ll = nodes.size(); ii<ll; ii++) {
+                    current_way_nodes.push_back(nodes[ii].ref());
                 }
+                current_way_nodes_unique = false;
             }
         }
+
+        way_batch.clear();
     }
 
     void after_ways() {
+        test_ways();
         write_way_extra_nodes();
+        current_way_id = 0;
         if(debug) {
             std::cerr << "after ways" << std::endl <<
                 std::endl << std::endl << "===== RELATIONS =====" << std::endl << std::endl;
@@ -233,37 +426,73 @@ public:
         } else {
             pg.relation(relation);
         }
+        info->check_pressure();
+        info->count_input('r', relation->id());
+
+        // the cascading-pairs don't depend on the extract, they are recorded once
+        const Osmium::OSM::RelationMemberList& members = relation->members();
+        for(int ii = 0, ll = members.size(); ii<ll; ii++) {
+            const Osmium::OSM::RelationMember& member = members[ii];
+            if(member.type() == 'r') {
+                if(debug) std::cerr << "recording cascading-pair: " << member.ref() << " -> " << relation->id() << std::endl;
+                info->cascading_relations_tracker.insert(std::make_pair(member.ref(), relation->id()));
+            }
+        }
+
+        relation_batch.add(relation);
+        if(relation_batch.full())
+            test_relations();
+    }
+
+    // probe the node- and way-members of all collected relation-versions at once, then
+    // test them extract by extract. relation-members are tested one by one, the
+    // relation_tracker grows while the batch is tested
+    void test_relations() {
+        if(relation_batch.empty())
+            return;
+
+        relation_batch.prepare(info->extracts.size());
 
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
-            bool hit = false;
             SoftcutExtractInfo *extract = info->extracts[i];
-            Osmium::OSM::RelationMemberList members = relation->members();
-            
-            for(int ii = 0, ll = members.size(); ii<ll; ii++) {
-                Osmium::OSM::RelationMember member = members[ii];
+            // with a filter, a node rejected by it is not written and doesn't bring
+            // its relations into the extract
+            relation_batch.nodes.probe(extract->options.filter.active() ? extract->filtered_node_tracker : extract->node_tracker);
+            relation_batch.ways.probe(extract->way_tracker);
+
+            for(int r = 0, rl = relation_batch.size(); r<rl; r++) {
+                const shared_ptr<Osmium::OSM::Relation const>& relation = relation_batch.relations[r];
+                const Osmium::OSM::RelationMemberList& members = relation->members();
+
+                bool accepted = true;
+                if(extract->options.filter.active()) {
+                    accepted = extract->options.filter.matches(*relation);
+                    if(accepted)
+                        extract->filtered_relation_tracker.set(relation->id());
+                }
 
-                if( !hit && (
-                    (member.type() == 'n' && extract->node_tracker.get(member.ref())) ||
-                    (member.type() == 'w' && extract->way_tracker.get(member.ref())) ||
-                    (member.type() == 'r' && extract->relation_tracker.get(member.ref()))
-                )) {
+                if(!accepted)
+                    continue;
 
-                    if(debug) std::cerr << "relation has a member (" << member.type() << " " << member.ref() << ") inside extract [" << i << "], recording in relation_tracker" << std::endl;
-                    hit = true;
+                bool hit = false;
+                for(int ii = 0, ll = members.size(); ii<ll && !hit; ii++) {
+                    const Osmium::OSM::RelationMember& member = members[ii];
 
-                    extract->relation_tracker.set(relation->id());
-                }
+                    if(relation_batch.hit(r, ii) || (member.type() == 'r' && extract->relation_tracker.get(member.ref()))) {
+                        if(debug) std::cerr << "relation " << relation->id() << " v" << relation->version() << " has a member (" << member.type() << " " << member.ref() << ") inside extract [" << i << "], recording in relation_tracker" << std::endl;
+                        hit = true;
 
-                if(member.type() == 'r') {
-                    if(debug) std::cerr << "recording cascading-pair: " << member.ref() << " -> " << relation->id() << std::endl;
-                    info->cascading_relations_tracker.insert(std::make_pair(member.ref(), relation->id()));
+                        extract->relation_tracker.set(relation->id());
+                    }
                 }
-            }
 
-            if(hit) {
-                cascading_relations(extract, relation->id());
+                if(hit) {
+                    cascading_relations(extract, relation->id());
+                }
             }
         }
+
+        relation_batch.clear();
     }
 
     void cascading_relations(SoftcutExtractInfo *extract, osm_object_id_t id) {
@@ -280,6 +509,10 @@ public:
             if(extract->relation_tracker.get(it->second))
                 continue;
 
+            // the parent relation was rejected by the filter
+            if(extract->options.filter.active() && !extract->filtered_relation_tracker.get(it->second))
+                continue;
+
             extract->relation_tracker.set(it->second);
 
             cascading_relations(extract, it->second);
@@ -287,6 +520,8 @@ public:
     }
 
     void after_relations() {
+        test_relations();
+
         if(debug) {
             std::cerr << "after relations" << std::endl;
         } else {
@@ -295,6 +530,14 @@ public:
     }
 
     void final() {
+        // in case the input ended without calling after_ways() or after_relations()
+        if(!way_batch.empty() || current_way_id != 0) {
+            test_ways();
+            write_way_extra_nodes();
+            current_way_id = 0;
+        }
+        test_relations();
+
         if(!debug) {
             pg.final();
         }
@@ -307,14 +550,38 @@ public:
 
 
 
-class SoftcutPassTwo : public Cut<SoftcutInfo> {
+template <class TDebug>
+class SoftcutPassTwo : public Cut<SoftcutInfo, TDebug> {
+
+private:
+    using Cut<SoftcutInfo, TDebug>::debug;
+    using Cut<SoftcutInfo, TDebug>::pg;
+    using Cut<SoftcutInfo, TDebug>::info;
 
 public:
-    SoftcutPassTwo(SoftcutInfo *info) : Cut<SoftcutInfo>(info) {}
+    SoftcutPassTwo(SoftcutInfo *info) : Cut<SoftcutInfo, TDebug>(info) {}
 
     void init(Osmium::OSM::Meta& meta) {
         std::cerr << "softcut second-pass init" << std::endl;
 
+        for(int i = 0, l = info->extracts.size(); i<l; i++) {
+            SoftcutExtractInfo *extract = info->extracts[i];
+            if(!extract->options.locations.empty())
+                extract->locations = new WayLocations(extract->options.locations);
+
+            // the first pass found all objects of the extract, spread their versions
+            // over its shards. it only counted the versions of the whole input, so
+            // the versions of the extract are estimated from the versions per id
+            if(extract->shards) {
+                const growing_bitset &tracker = extract->options.filter.active() ? extract->filtered_node_tracker : extract->node_tracker;
+                double versions =
+                    tracker.count(&extract->extra_node_tracker) * info->versions_per_id('n') +
+                    extract->way_tracker.count() * info->versions_per_id('w') +
+                    extract->relation_tracker.count() * info->versions_per_id('r');
+                extract->shards->expect(static_cast<uint64_t>(versions + 0.5));
+            }
+        }
+
         if(debug) {
             std::cerr << std::endl << std::endl << "===== NODES =====" << std::endl << std::endl;
         } else {
@@ -326,18 +593,26 @@ public:
     //   - walk over all bboxes
     //     - if the node-id is recorded in the bboxes node-tracker or in the extra-node-tracker
     //       - send the node to the bboxes writer
+    //       - store its location if the bbox writes way-locations
     void node(const shared_ptr<Osmium::OSM::Node const>& node) {
         if(debug) {
             std::cerr << "softcut node " << node->id() << " v" << node->version() << std::endl;
         } else {
             pg.node(node);
         }
+        info->check_pressure();
 
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
             SoftcutExtractInfo *extract = info->extracts[i];
 
-            if(extract->node_tracker.get(node->id()) || extract->extra_node_tracker.get(node->id()))
-                extract->writer->node(node);
+            // with a filter only the accepted nodes and the nodes of the written ways are written
+            const growing_bitset &tracker = extract->options.filter.active() ? extract->filtered_node_tracker : extract->node_tracker;
+
+            if(tracker.get(node->id()) || extract->extra_node_tracker.get(node->id())) {
+                extract->output('n', node->id())->node(node);
+                if(extract->locations)
+                    extract->locations->node(node);
+            }
         }
     }
 
@@ -354,18 +629,23 @@ public:
     //   - walk over all bboxes
     //     - if the way-id is recorded in the bboxes way-tracker
     //       - send the way to the bboxes writer
+    //       - write it with the locations of its nodes if the bbox writes way-locations
     void way(const shared_ptr<Osmium::OSM::Way const>& way) {
         if(debug) {
             std::cerr << "softcut way " << way->id() << " v" << way->version() << std::endl;
         } else {
             pg.way(way);
         }
+        info->check_pressure();
 
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
             SoftcutExtractInfo *extract = info->extracts[i];
 
-            if(extract->way_tracker.get(way->id()))
-                extract->writer->way(way);
+            if(extract->way_tracker.get(way->id())) {
+                extract->output('w', way->id())->way(way);
+                if(extract->locations)
+                    extract->locations->way(way);
+            }
         }
     }
 
@@ -389,12 +669,13 @@ public:
         } else {
             pg.relation(relation);
         }
+        info->check_pressure();
 
         for(int i = 0, l = info->extracts.size(); i<l; i++) {
             SoftcutExtractInfo *extract = info->extracts[i];
 
             if(extract->relation_tracker.get(relation->id()))
-                extract->writer->relation(relation);
+                extract->output('r', relation->id())->relation(relation);
         }
     }
 
@@ -3,7 +3,9 @@
 #include <errno.h>
 
 #include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
+#include <sys/resource.h>
 
 #define OSMIUM_MAIN
 #define OSMIUM_WITH_PBF_INPUT
@@ -19,39 +21,508 @@
 
 #include "softcut.hpp"
 #include "hardcut.hpp"
+#include "spool.hpp"
+#include "planner.hpp"
+#include "scheduler.hpp"
+#include "boundary_reader.hpp"
+#include "result_cache.hpp"
+#include "broadcast.hpp"
+#include "io.hpp"
 
-template <class TExtractInfo> bool readConfig(char *conffile, CutInfo<TExtractInfo> &info);
+template <class TExtractInfo> bool readConfig(const char *conffile, const char *infile, CutInfo<TExtractInfo> &info);
+
+// read the input into a handler, through the readahead pump if there is one
+template <class THandler> void read_input(Osmium::OSMFile &infile, InputPump *pump, THandler &handler) {
+    if(!pump) {
+        Osmium::Input::read(infile, handler);
+        return;
+    }
+
+    // the pump replaces stdin, which has no name to detect the format from
+    Osmium::OSMFile pumped("-");
+    pumped.type(infile.type());
+    pumped.encoding(infile.encoding());
+
+    if(!pump->start())
+        exit(1);
+    Osmium::Input::read(pumped, handler);
+    pump->finish();
+}
+
+template <class TDebug> bool run_softcut(Osmium::OSMFile &infile, const char *spoolfile, BroadcastRing *ring, InputPump *pump, SoftcutInfo &info) {
+    if(ring) {
+        // both passes read a round of the broadcast instead of the input
+        SoftcutPassOne<TDebug> one(&info);
+        if(!BroadcastInput::read(*ring, one))
+            return false;
+
+        SoftcutPassTwo<TDebug> two(&info);
+        if(!BroadcastInput::read(*ring, two))
+            return false;
+        return info.close_locations();
+    }
+
+    if(spoolfile) {
+        // read stdin in the first pass while it's copied to the spool file,
+        // then read the spool file in the second pass
+        StdinSpool spool(spoolfile);
+        if(!spool.start())
+            return false;
+
+        SoftcutPassOne<TDebug> one(&info);
+        Osmium::Input::read(infile, one);
+        spool.finish();
+
+        Osmium::OSMFile spoolinfile(spoolfile);
+        SoftcutPassTwo<TDebug> two(&info);
+        Osmium::Input::read(spoolinfile, two);
+        return info.close_locations();
+    }
+
+    SoftcutPassOne<TDebug> one(&info);
+    read_input(infile, pump, one);
+
+    SoftcutPassTwo<TDebug> two(&info);
+    read_input(infile, pump, two);
+    return info.close_locations();
+}
+
+template <class TExtractInfo> int run_plan(const char *filename, const char *conffile, CutInfo<TExtractInfo> &info, bool softcut, size_t samples, size_t max_memory) {
+    // the planner only needs the geometries, don't create any output files
+    info.open_writers = false;
+    if(!readConfig(conffile, filename, info))
+    {
+        std::cerr << "error reading config" << std::endl;
+        return 1;
+    }
+
+    Planner<TExtractInfo> planner(&info, softcut, samples, max_memory);
+    return planner.run(filename) ? 0 : 1;
+}
+
+template <class TDebug> bool run_hardcut(Osmium::OSMFile &infile, BroadcastRing *ring, InputPump *pump, HardcutInfo &info) {
+    Hardcut<TDebug> cutter(&info);
+    if(ring)
+        return BroadcastInput::read(*ring, cutter);
+
+    read_input(infile, pump, cutter);
+    return true;
+}
+
+// print the memory the trackers actually used, to be put into memory= options
+template <class TExtractInfo> void report_memory(CutInfo<TExtractInfo> &info) {
+    for(int i = 0, l = info.extracts.size(); i<l; i++) {
+        std::cerr << "tracker memory of " << info.extracts[i]->name << ": "
+            << (info.extracts[i]->tracker_memory() / (1024*1024)) << " MB" << std::endl;
+    }
+}
+
+// the options of a split, shared by all passes
+struct SplitOptions {
+    bool softcut;
+    bool debug;
+    int compress_threads;
+    size_t output_memory;
+    bool output_memory_set;
+    const char *container;
+    bool cache;
+    const char *spoolfile;
+    const char *attach;
+    size_t readahead;
+    size_t write_batch;
+    bool io_direct;
+    bool numa;
+    bool hugepages;
+    const char *pressure_spill;
+
+    SplitOptions() : softcut(true), debug(false), compress_threads(0), output_memory(256 * 1024 * 1024), output_memory_set(false),
+        container(NULL), cache(false), spoolfile(NULL), attach(NULL), readahead(0), write_batch(0), io_direct(false),
+        numa(false), hugepages(false), pressure_spill(NULL) {}
+};
+
+template <class TExtractInfo> void apply_options(const SplitOptions &options, CutInfo<TExtractInfo> &info) {
+    info.compress_threads = options.compress_threads;
+    info.output_memory = options.output_memory;
+    info.pool_outputs = options.output_memory_set;
+    if(options.container) info.container = new ContainerWriter(options.container);
+    info.write_batch = options.write_batch;
+    info.io_direct = options.io_direct;
+    info.numa_nodes = options.numa ? Numa::nodes() : 0;
+    growing_bitset::hugepages(options.hugepages);
+}
+
+// split one input into all extracts of a config
+int run_split(const char *filename, const char *conffile, const SplitOptions &options) {
+    Osmium::OSMFile infile(filename);
+
+    // stdin has no name to detect its format from, take the one of the spool file
+    if(options.spoolfile) {
+        Osmium::OSMFile spoolinfile(options.spoolfile);
+        infile.type(spoolinfile.type());
+        infile.encoding(spoolinfile.encoding());
+    }
+
+    // the ring is attached after the config is read. a consumer with a broken config never attaches,
+    // the producer gives up waiting for it after --attach-timeout
+    BroadcastRing broadcast(options.attach ? options.attach : "");
+    BroadcastRing *ring = options.attach ? &broadcast : NULL;
+
+    // stdin is read directly, it's a pipe already
+    InputPump readahead(filename, options.readahead, options.io_direct);
+    InputPump *pump = options.readahead > 0 && !options.spoolfile ? &readahead : NULL;
+
+    // reports thrashing while the trackers fill up, outlives the info using it
+    MemoryWatchdog watchdog(options.pressure_spill);
+
+    bool ok;
+    if(options.softcut) {
+        SoftcutInfo info;
+        apply_options(options, info);
+        info.watchdog = &watchdog;
+        if(!readConfig(conffile, filename, info))
+        {
+            std::cerr << "error reading config" << std::endl;
+            return 1;
+        }
+
+        if(ring && !ring->attach(2))
+            return 1;
+
+        if(options.debug) ok = run_softcut<DebugOn>(infile, options.spoolfile, ring, pump, info);
+        else ok = run_softcut<DebugOff>(infile, options.spoolfile, ring, pump, info);
+
+        if(ring) ring->detach();
+
+        if(ok)
+            report_memory(info);
+    } else {
+        HardcutInfo info;
+        apply_options(options, info);
+        info.watchdog = &watchdog;
+        if(!readConfig(conffile, filename, info))
+        {
+            std::cerr << "error reading config" << std::endl;
+            return 1;
+        }
+
+        // the node-locations are stored and the objects of an extract are
+        // counted by the first pass of the softcut
+        for(int i = 0, l = info.extracts.size(); i<l; i++) {
+            if(!info.extracts[i]->options.locations.empty()) {
+                std::cerr << "extract " << info.extracts[i]->name << ": locations= needs the softcut" << std::endl;
+                return 1;
+            }
+            if(info.extracts[i]->options.shards > 0) {
+                std::cerr << "extract " << info.extracts[i]->name << ": shards= needs the softcut, use shard-size= instead" << std::endl;
+                return 1;
+            }
+        }
+
+        if(ring && !ring->attach(1))
+            return 1;
+
+        if(options.debug) ok = run_hardcut<DebugOn>(infile, ring, pump, info);
+        else ok = run_hardcut<DebugOff>(infile, ring, pump, info);
+
+        if(ring) ring->detach();
+
+        if(ok)
+            report_memory(info);
+    }
+
+    if(!ok)
+        return 1;
+
+    IoStats::instance().report();
+
+    // the outputs are complete once the writers are closed with the info
+    if(options.cache) {
+        ResultCache result_cache(filename, options.softcut);
+        if(!result_cache.record(conffile))
+            return 1;
+    }
+
+    return 0;
+}
+
+// decode the input once for all consumers attached to a broadcast
+int run_broadcast(const char *filename, const char *name, int consumers, int attach_timeout, const SplitOptions &options) {
+    BroadcastRing ring(name);
+    int rounds = options.softcut ? 2 : 1;
+    if(!ring.create(consumers, rounds, attach_timeout))
+        return 1;
+
+    InputPump readahead(filename, options.readahead, options.io_direct);
+    InputPump *pump = options.readahead > 0 ? &readahead : NULL;
+
+    Osmium::OSMFile infile(filename);
+    for(int i = 0; i < rounds; i++) {
+        BroadcastProducer producer(&ring);
+        read_input(infile, pump, producer);
+
+        // hardcut consumers of a softcut broadcast are finished after the first round
+        if(producer.abandoned())
+            break;
+    }
+
+    // consumers that detached are done, one that died didn't get its outputs
+    if(ring.died() > 0)
+        return 1;
+
+    IoStats::instance().report();
+    return 0;
+}
+
+// runs a pass of the scheduler in its child process
+struct PassRunner {
+    SplitOptions options;
+
+    // the scheduler binds every pass to a numa node as a whole, its extracts are not spread
+    PassRunner(const SplitOptions &options) : options(options) {
+        this->options.numa = false;
+    }
+
+    int operator()(const std::string &input, const std::string &conffile) {
+        return run_split(input.c_str(), conffile.c_str(), options);
+    }
+};
+
+// raise the limit of open files as far as allowed
+void raise_file_limit() {
+    struct rlimit limit;
+    if(0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if(0 != setrlimit(RLIMIT_NOFILE, &limit))
+            std::cerr << "unable to raise the limit of open files: " << strerror(errno) << std::endl;
+    }
+}
+
+// does the config use from= options, which only the scheduler can handle
+bool scheduler_needed(const char *conffile) {
+    Scheduler scheduler("", 1, 0, 0);
+    return scheduler.read_config(conffile) && scheduler.has_dependencies();
+}
+
+// estimate the tracker memory of all extracts by sampling the input, if it's a .pbf
+template <class TExtractInfo> bool estimate_memory(const char *filename, Scheduler &scheduler, CutInfo<TExtractInfo> &info, bool softcut, size_t samples, size_t max_memory) {
+    const char *conffile = scheduler.all_config();
+    if(!conffile)
+        return false;
+
+    // check all lines before any pass is started
+    info.open_writers = false;
+    if(!readConfig(conffile, filename, info))
+    {
+        std::cerr << "error reading config" << std::endl;
+        return false;
+    }
+
+    size_t len = strlen(filename);
+    if(len < 4 || strcmp(filename + len - 4, ".pbf")) {
+        std::cerr << "input is no .pbf file, using memory= options or fixed estimates" << std::endl;
+        return true;
+    }
+
+    Planner<TExtractInfo> planner(&info, softcut, samples, max_memory);
+    if(!planner.sample(filename))
+        return false;
+
+    // even an extract without a sampled node allocates a segment of its trackers
+    for(int i = 0, l = info.extracts.size(); i<l; i++) {
+        double bytes;
+        if(planner.tracker_bytes(info.extracts[i]->name, bytes))
+            scheduler.estimate(info.extracts[i]->name, std::max(bytes, static_cast<double>(growing_bitset::segment_size / 8)));
+    }
+    return true;
+}
+
+// parse a number of threads given on the command line
+bool parse_threads(const char *option, const char *value, int &threads) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    if(end == value || *end || n < 1 || n > 1024) {
+        std::cerr << "--" << option << "=" << value << " is not a number of threads between 1 and 1024" << std::endl;
+        return false;
+    }
+    threads = n;
+    return true;
+}
+
+// parse a whole number between min and max given on the command line
+bool parse_number(const char *option, const char *value, long long min, long long max, long long &n) {
+    char *end;
+    errno = 0;
+    n = strtoll(value, &end, 10);
+    if(end == value || *end || errno == ERANGE || n < min || n > max) {
+        std::cerr << "--" << option << "=" << value << " is not a number between " << min << " and " << max << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool parse_number(const char *option, const char *value, long long min, long long max, int &n) {
+    long long v;
+    if(!parse_number(option, value, min, max, v))
+        return false;
+    n = v;
+    return true;
+}
+
+// parse a size in MB given on the command line into bytes
+bool parse_megabytes(const char *option, const char *value, long long min, size_t &bytes) {
+    long long mb;
+    if(!parse_number(option, value, min, 1024LL * 1024 * 1024, mb))
+        return false;
+    bytes = static_cast<size_t>(mb) * 1024 * 1024;
+    return true;
+}
 
 int main(int argc, char *argv[]) {
-    bool softcut = true;
-    bool debug = false;
-    char *filename, *conffile;
+    SplitOptions options;
+    char *demux = NULL;
+    char *broadcast = NULL;
+    int consumers = 0;
+    int attach_timeout = 600;
+    int threads = 0;
+    bool plan = false;
+    size_t plan_samples = 100;
+    size_t max_memory = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+    char *filename;
+    const char *conffile;
 
     static struct option long_options[] = {
         {"debug",               no_argument, 0, 'd'},
         {"softcut",             no_argument, 0, 's'},
         {"hardcut",             no_argument, 0, 'h'},
+        {"compress-threads",    required_argument, 0, 'c'},
+        {"spool",               required_argument, 0, 'p'},
+        {"plan",                optional_argument, 0, 'P'},
+        {"max-memory",          required_argument, 0, 'm'},
+        {"threads",             required_argument, 0, 't'},
+        {"output-memory",       required_argument, 0, 'o'},
+        {"container",           required_argument, 0, 'C'},
+        {"demux",               required_argument, 0, 'D'},
+        {"cache",               no_argument, 0, 'k'},
+        {"broadcast",           required_argument, 0, 'B'},
+        {"consumers",           required_argument, 0, 'n'},
+        {"attach",              required_argument, 0, 'a'},
+        {"attach-timeout",      required_argument, 0, 'T'},
+        {"readahead",           required_argument, 0, 'r'},
+        {"write-batch",         required_argument, 0, 'w'},
+        {"io-direct",           no_argument, 0, 'i'},
+        {"numa",                no_argument, 0, 'N'},
+        {"hugepages",           no_argument, 0, 'H'},
+        {"pressure-spill",      required_argument, 0, 'S'},
         {0, 0, 0, 0}
     };
 
     while (1) {
-        int c = getopt_long(argc, argv, "dsh", long_options, 0);
+        int c = getopt_long(argc, argv, "dshc:p:P::m:t:o:C:D:kB:n:a:T:r:w:iNHS:", long_options, 0);
         if (c == -1)
             break;
 
         switch (c) {
             case 'd':
-                debug = true;
+                options.debug = true;
                 break;
             case 's':
-                softcut = true;
+                options.softcut = true;
                 break;
             case 'h':
-                softcut = false;
+                options.softcut = false;
+                break;
+            case 'c':
+                if(!parse_threads("compress-threads", optarg, options.compress_threads))
+                    return 1;
+                break;
+            case 'p':
+                options.spoolfile = optarg;
+                break;
+            case 'P':
+                plan = true;
+                if(optarg) {
+                    long long n;
+                    if(!parse_number("plan", optarg, 1, 1000000, n))
+                        return 1;
+                    plan_samples = n;
+                }
+                break;
+            case 'm':
+                if(!parse_megabytes("max-memory", optarg, 1, max_memory))
+                    return 1;
+                break;
+            case 't':
+                if(!parse_threads("threads", optarg, threads))
+                    return 1;
+                break;
+            case 'o':
+                if(!parse_megabytes("output-memory", optarg, 1, options.output_memory))
+                    return 1;
+                options.output_memory_set = true;
+                break;
+            case 'C':
+                options.container = optarg;
+                break;
+            case 'D':
+                demux = optarg;
+                break;
+            case 'k':
+                options.cache = true;
+                break;
+            case 'B':
+                broadcast = optarg;
+                break;
+            case 'n':
+                if(!parse_number("consumers", optarg, 1, BroadcastRing::max_consumers, consumers))
+                    return 1;
+                break;
+            case 'a':
+                options.attach = optarg;
+                break;
+            case 'T':
+                if(!parse_number("attach-timeout", optarg, 1, 86400, attach_timeout))
+                    return 1;
+                break;
+            case 'r':
+                if(!parse_megabytes("readahead", optarg, 0, options.readahead))
+                    return 1;
+                break;
+            case 'w':
+                if(!parse_megabytes("write-batch", optarg, 0, options.write_batch))
+                    return 1;
+                break;
+            case 'i':
+                options.io_direct = true;
+                break;
+            case 'N':
+                options.numa = true;
+                break;
+            case 'H':
+                options.hugepages = true;
+                break;
+            case 'S':
+                options.pressure_spill = optarg;
                 break;
         }
     }
 
+    // a pass which stops reading stdin early shows up as EPIPE in the thread
+    // feeding it (--spool, --readahead), it must not kill the whole split
+    signal(SIGPIPE, SIG_IGN);
+
+    if(demux) {
+        ContainerDemux d(demux);
+        return d.run() ? 0 : 1;
+    }
+
+    if(broadcast) {
+        if(optind > argc-1) {
+            std::cerr << "Usage: " << argv[0] << " --broadcast=NAME --consumers=N [--attach-timeout=SECONDS] [--softcut|--hardcut] OSMFILE" << std::endl;
+            return 1;
+        }
+        return run_broadcast(argv[optind], broadcast, consumers, attach_timeout, options);
+    }
+
     if (optind > argc-2) {
         std::cerr << "Usage: " << argv[0] << " [OPTIONS] OSMFILE CONFIGFILE" << std::endl;
         return 1;
@@ -60,47 +531,118 @@ int main(int argc, char *argv[]) {
     filename = argv[optind];
     conffile = argv[optind+1];
 
-    if(softcut & !strcmp(filename, "-")) {
-        std::cerr << "Can't read from stdin when in softcut" << std::endl;
+    if(options.softcut && !strcmp(filename, "-") && !options.spoolfile) {
+        std::cerr << "Can't read from stdin when in softcut without --spool" << std::endl;
         return 1;
     }
 
-    Osmium::OSMFile infile(filename);
+    if(options.spoolfile && (!options.softcut || strcmp(filename, "-"))) {
+        std::cerr << "--spool is only used when reading from stdin in softcut" << std::endl;
+        return 1;
+    }
 
-    if(softcut) {
-        SoftcutInfo info;
-        if(!readConfig(conffile, info))
-        {
-            std::cerr << "error reading config" << std::endl;
+    if(options.pressure_spill && 0 != access(options.pressure_spill, W_OK)) {
+        std::cerr << "--pressure-spill needs a writable directory, " << options.pressure_spill << " is not" << std::endl;
+        return 1;
+    }
+
+    if(plan) {
+        size_t len = strlen(filename);
+        if(len < 4 || strcmp(filename + len - 4, ".pbf")) {
+            std::cerr << "--plan needs a .pbf file" << std::endl;
             return 1;
         }
 
-        SoftcutPassOne one(&info);
-        one.debug = debug;
-        Osmium::Input::read(infile, one);
+        if(options.softcut) {
+            SoftcutInfo info;
+            return run_plan(filename, conffile, info, true, plan_samples, max_memory);
+        } else {
+            HardcutInfo info;
+            return run_plan(filename, conffile, info, false, plan_samples, max_memory);
+        }
+    }
 
-        SoftcutPassTwo two(&info);
-        two.debug = debug;
-        Osmium::Input::read(infile, two);
-    } else {
-        HardcutInfo info;
-        if(!readConfig(conffile, info))
-        {
-            std::cerr << "error reading config" << std::endl;
+    ResultCache result_cache(filename, options.softcut);
+    if(options.cache) {
+        if(!strcmp(filename, "-") || options.container) {
+            std::cerr << "--cache needs an input file and the outputs as files, not stdin or --container" << std::endl;
             return 1;
         }
 
-        Hardcut cutter(&info);
-        cutter.debug = debug;
-        Osmium::Input::read(infile, cutter);
+        // only the outputs which are missing or out of date are split
+        conffile = result_cache.filter(conffile);
+        if(!conffile)
+            return 1;
+
+        if(result_cache.empty())
+            return 0;
     }
 
-    return 0;
+    if(options.container) {
+        if(scheduler_needed(conffile)) {
+            std::cerr << "--container can't be used with from= options, their inputs have to be files" << std::endl;
+            return 1;
+        }
+
+        // every output still has a fifo and its two ends
+        raise_file_limit();
+
+        if(!ContainerWriter::create(options.container))
+            return 1;
+    }
+
+    if(threads > 0 || scheduler_needed(conffile)) {
+        if(options.attach) {
+            std::cerr << "--attach reads a single broadcast, it can't be split into passes" << std::endl;
+            return 1;
+        }
+
+        if(!strcmp(filename, "-")) {
+            std::cerr << "Can't read from stdin when running passes" << std::endl;
+            return 1;
+        }
+
+        // the per-extract sizes from the algorithm descriptions in softcut.hpp and hardcut.hpp
+        Scheduler scheduler(filename, threads, max_memory, (options.softcut ? 350 : 190) * 1024 * 1024);
+        if(options.numa)
+            scheduler.spread(Numa::nodes());
+        if(!scheduler.read_config(conffile))
+            return 1;
+
+        bool ok;
+        if(options.softcut) {
+            SoftcutInfo info;
+            ok = estimate_memory(filename, scheduler, info, true, plan_samples, max_memory);
+        } else {
+            HardcutInfo info;
+            ok = estimate_memory(filename, scheduler, info, false, plan_samples, max_memory);
+        }
+
+        if(!ok || !scheduler.plan())
+            return 1;
+
+        PassRunner runner(options);
+        return scheduler.run(runner) ? 0 : 1;
+    }
+
+    return run_split(filename, conffile, options);
 }
 
-template <class TExtractInfo> bool readConfig(char *conffile, CutInfo<TExtractInfo> &info) {
+// a line of the config, read before any extract is added
+struct ConfigLine {
+    std::string name;
+    char type;
+    std::string spec;
+    ExtractOptions options;
+};
+
+template <class TExtractInfo> bool readConfig(const char *conffile, const char *infile, CutInfo<TExtractInfo> &info) {
     const int linelen = 4096;
 
+    // all lines are read first, the extracts are added in config order once the
+    // OSM files are read in parallel and the REL relations fetched together
+    std::vector<ConfigLine> lines;
+
     FILE *fp = fopen(conffile, "r");
     if(!fp) {
         std::cerr << "unable to open config file " << conffile << std::endl;
@@ -114,12 +656,12 @@ template <class TExtractInfo> bool readConfig(char *conffile, CutInfo<TExtractIn
             continue;
 
         int n = 0;
-        char *tok = strtok(line, "\t ");
+        char *tok = strtok(line, "\t \r\n");
 
         const char *name = NULL;
-        double minlon = 0, minlat = 0, maxlon = 0, maxlat = 0;
+        const char *spec = NULL;
         char type = '\0';
-        char file[linelen];
+        ExtractOptions options;
 
         while(tok) {
             switch(n) {
@@ -134,52 +676,158 @@ template <class TExtractInfo> bool readConfig(char *conffile, CutInfo<TExtractIn
                         type = 'p';
                     else if(0 == strcmp("OSM", tok))
                         type = 'o';
+                    else if(0 == strcmp("REL", tok))
+                        type = 'r';
+                    else if(0 == strcmp("GRID", tok))
+                        type = 'g';
                     else {
                         type = '\0';
                         std::cerr << "output " << name << " of type " << tok << ": unknown output type" << std::endl;
+                        fclose(fp);
                         return false;
                     }
                     break;
 
                 case 2:
-                    switch(type) {
-                        case 'b':
-                            if(4 == sscanf(tok, "%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat)) {
-                                info.addExtract(name, minlat, minlon, maxlat, maxlon);
-                            } else {
-                                std::cerr << "error reading BBOX " << tok << " for " << name << std::endl;
-                                return false;
-                            }
-                            break;
-                        case 'p':
-                            if(1 == sscanf(tok, "%s", file)) {
-                                geos::geom::Geometry *geom = OsmiumExtension::GeometryReader::fromPolyFile(file);
-                                if(!geom) {
-                                    std::cerr << "error creating geometry from poly-file " << file << " for " << name << std::endl;
-                                    break;
-                                }
-                                info.addExtract(name, geom);
-                            }
-                            break;
-                        case 'o':
-                            if(1 == sscanf(tok, "%s", file)) {
-                                geos::geom::Geometry *geom = OsmiumExtension::GeometryReader::fromOsmFile(file);
-                                if(!geom) {
-                                    std::cerr << "error creating geometry from poly-file " << file << " for " << name << std::endl;
-                                    break;
-                                }
-                                info.addExtract(name, geom);
-                            }
-                            break;
+                    spec = tok;
+                    break;
+
+                default:
+                    if(!options.parse(tok)) {
+                        std::cerr << "error reading option " << tok << " for " << name << std::endl;
+                        fclose(fp);
+                        return false;
                     }
                     break;
             }
 
-            tok = strtok(NULL, "\t ");
+            tok = strtok(NULL, "\t \r\n");
             n++;
         }
+
+        if(!spec)
+            continue;
+
+        if(!options.check(name) || !TExtractInfo::check_options(name, options)) {
+            fclose(fp);
+            return false;
+        }
+
+        ConfigLine config;
+        config.name = name;
+        config.type = type;
+        config.spec = spec;
+        config.options = options;
+        lines.push_back(config);
     }
     fclose(fp);
+
+    // the OSM files, parsed in parallel, their geometries are built when their extracts are added
+    std::vector<std::string> osm_files;
+    char file[linelen];
+    for(int i = 0, l = lines.size(); i<l; i++) {
+        if(lines[i].type == 'o' && 1 == sscanf(lines[i].spec.c_str(), "%s", file))
+            osm_files.push_back(file);
+    }
+
+    OsmiumExtension::OsmFileReader osm_reader(osm_files);
+    if(!osm_files.empty())
+        osm_reader.read();
+
+    // the relations of the REL lines, fetched together from the input
+    std::vector<long long> relation_ids;
+    std::vector<std::string> relation_names;
+    for(int i = 0, l = lines.size(); i<l; i++) {
+        long long relation_id;
+        if(lines[i].type != 'r')
+            continue;
+
+        if(1 != sscanf(lines[i].spec.c_str(), "%lld", &relation_id)) {
+            std::cerr << "error reading relation id " << lines[i].spec << " for " << lines[i].name << std::endl;
+            return false;
+        }
+        relation_ids.push_back(relation_id);
+        relation_names.push_back(lines[i].name);
+    }
+
+    std::vector<geos::geom::Geometry*> relation_geoms;
+    if(!relation_ids.empty()) {
+        size_t len = strlen(infile);
+        if(len < 4 || strcmp(infile + len - 4, ".pbf")) {
+            std::cerr << "REL extracts need a .pbf input file" << std::endl;
+            return false;
+        }
+
+        BoundaryReader boundaries(infile);
+        for(int i = 0, l = relation_ids.size(); i<l; i++) {
+            boundaries.add(relation_ids[i]);
+        }
+
+        if(!boundaries.read())
+            return false;
+
+        for(int i = 0, l = relation_ids.size(); i<l; i++) {
+            geos::geom::Geometry *geom = boundaries.geometry(relation_ids[i]);
+            if(!geom) {
+                std::cerr << "error creating geometry from relation " << relation_ids[i] << " for " << relation_names[i] << std::endl;
+                return false;
+            }
+            relation_geoms.push_back(geom);
+        }
+    }
+
+    int osm_line = 0, relation_line = 0;
+    for(int i = 0, l = lines.size(); i<l; i++) {
+        const ConfigLine &config = lines[i];
+        const char *name = config.name.c_str();
+        const char *spec = config.spec.c_str();
+        double minlon = 0, minlat = 0, maxlon = 0, maxlat = 0, dx = 0, dy = 0;
+
+        info.begin_line(config.name);
+
+        switch(config.type) {
+            case 'b':
+                if(4 == sscanf(spec, "%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat)) {
+                    info.addExtract(name, minlat, minlon, maxlat, maxlon, config.options);
+                } else {
+                    std::cerr << "error reading BBOX " << spec << " for " << name << std::endl;
+                    return false;
+                }
+                break;
+            case 'p':
+                if(1 == sscanf(spec, "%s", file)) {
+                    geos::geom::Geometry *geom = OsmiumExtension::GeometryReader::fromPolyFile(file);
+                    if(!geom) {
+                        std::cerr << "error creating geometry from poly-file " << file << " for " << name << std::endl;
+                        break;
+                    }
+                    info.addExtract(name, geom, config.options);
+                }
+                break;
+            case 'o': {
+                geos::geom::Geometry *geom = osm_reader.geometry(osm_line);
+                if(!geom) {
+                    std::cerr << "error creating geometry from osm-file " << osm_files[osm_line] << " for " << name << std::endl;
+                } else {
+                    info.addExtract(name, geom, config.options);
+                }
+                osm_line++;
+                break;
+            }
+            case 'g':
+                if(6 == sscanf(spec, "%lf,%lf,%lf,%lf,%lf,%lf", &minlon, &minlat, &maxlon, &maxlat, &dx, &dy)) {
+                    if(!info.addGrid(name, minlon, minlat, maxlon, maxlat, dx, dy, config.options))
+                        return false;
+                } else {
+                    std::cerr << "error reading GRID " << spec << " for " << name << std::endl;
+                    return false;
+                }
+                break;
+            case 'r':
+                info.addExtract(name, relation_geoms[relation_line++], config.options);
+                break;
+        }
+        info.end_line();
+    }
     return true;
 }
-
@@ -0,0 +1,134 @@
+#ifndef SPLITTER_SPOOL_HPP
+#define SPLITTER_SPOOL_HPP
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "io.hpp"
+
+/*
+
+Stdin Spool
+ - the softcut needs to read its input twice, but stdin can only be read once
+ - before the first pass, stdin is replaced by a pipe
+ - a tee-thread reads the real stdin and writes everything both into the pipe
+   and into a spool file
+ - the first pass reads the pipe as if it were stdin, so downloading the input
+   and the first pass overlap
+ - the second pass reads the spool file, which is a byte-exact copy of the input
+
+*/
+
+class StdinSpool {
+
+private:
+    std::string spoolfile;
+
+    pthread_t thread;
+
+    int spool_fd;
+    StdinPipe pipe;
+
+    static const size_t buffer_size = 1024*1024;
+
+    void write_spool(const char *buf, size_t len) {
+        size_t pos = 0;
+        while(pos < len) {
+            ssize_t w = ::write(spool_fd, buf + pos, len - pos);
+            if(w < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "error writing to " << spoolfile << ": " << strerror(errno) << std::endl;
+                TempFiles::fail_thread();
+            }
+            pos += w;
+        }
+    }
+
+    void run() {
+        std::vector<char> buf(buffer_size);
+        bool piping = true;
+        int in_fd = pipe.real_stdin();
+
+        while(1) {
+            ssize_t r = ::read(in_fd, &buf[0], buffer_size);
+            if(r < 0) {
+                if(errno == EINTR) continue;
+                std::cerr << "error reading from stdin: " << strerror(errno) << std::endl;
+                TempFiles::fail_thread();
+            }
+            if(r == 0) break;
+
+            write_spool(&buf[0], r);
+
+            // if the first pass stopped reading early, keep on spooling
+            if(piping && !pipe.write(&buf[0], r)) {
+                piping = false;
+                pipe.close_writer();
+            }
+        }
+
+        pipe.close_writer();
+
+        if(0 != fsync(spool_fd) || 0 != close(spool_fd)) {
+            std::cerr << "error closing spool file " << spoolfile << ": " << strerror(errno) << std::endl;
+            TempFiles::fail_thread();
+        }
+    }
+
+    static void *thread_main(void *arg) {
+        static_cast<StdinSpool *>(arg)->run();
+        return NULL;
+    }
+
+public:
+    StdinSpool(const std::string &spoolfile) : spoolfile(spoolfile), spool_fd(-1) {}
+
+    /**
+     * replace stdin with the pipe and start the tee-thread.
+     *
+     * this method returns false if the spool file, the pipe or the thread
+     * can't be created.
+     */
+    bool start() {
+        spool_fd = open(spoolfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(spool_fd < 0) {
+            std::cerr << "unable to open spool file " << spoolfile << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        // keep the real stdin for the tee-thread and let the pipe take its place
+        if(!pipe.replace_stdin(0)) {
+            close(spool_fd);
+            return false;
+        }
+
+        if(!StdinPipe::start_thread(thread, &StdinSpool::thread_main, this)) {
+            close(spool_fd);
+            pipe.close_reader();
+            pipe.close_writer();
+            pipe.restore();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * close the pipe and wait until the input is completely spooled.
+     * call this after the first pass, the spool file can be read afterwards.
+     */
+    void finish() {
+        pipe.close_reader();
+        pthread_join(thread, NULL);
+        pipe.restore();
+    }
+};
+
+#endif // SPLITTER_SPOOL_HPP
@@ -0,0 +1,131 @@
+#ifndef SPLITTER_TEMPFILES_HPP
+#define SPLITTER_TEMPFILES_HPP
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/*
+
+Temporary Files
+ - the fifos of the sinks, the pass configs of the scheduler and the filtered
+   config of the cache are created in $TMPDIR, or in /tmp if it's not set
+ - directories created with remove_at_exit are removed when the process exits,
+   even when the split fails
+ - a thread other than the main thread fails with TempFiles::fail_thread(). exit()
+   would run the atexit handlers and static destructors while the other threads
+   still use them, so the directories are removed and the process ends with _exit()
+
+*/
+
+class TempFiles {
+
+private:
+    static pthread_mutex_t &mutex() {
+        static pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
+        return m;
+    }
+
+    static std::vector<std::string> &directories() {
+        static std::vector<std::string> dirs;
+        return dirs;
+    }
+
+    // remove a directory with the files left in it
+    static void remove_tree(const std::string &path) {
+        DIR *dir = opendir(path.c_str());
+        if(dir) {
+            struct dirent *entry;
+            while((entry = readdir(dir)) != NULL) {
+                if(0 != strcmp(entry->d_name, ".") && 0 != strcmp(entry->d_name, ".."))
+                    unlink((path + "/" + entry->d_name).c_str());
+            }
+            closedir(dir);
+        }
+        rmdir(path.c_str());
+    }
+
+    static void remove_all() {
+        pthread_mutex_lock(&mutex());
+        std::vector<std::string> &dirs = directories();
+        for(int i = 0, l = dirs.size(); i<l; i++) {
+            remove_tree(dirs[i]);
+        }
+        dirs.clear();
+        pthread_mutex_unlock(&mutex());
+    }
+
+public:
+    // a template for mkdtemp() and mkstemp() in the temporary directory
+    static std::string pattern() {
+        const char *dir = getenv("TMPDIR");
+        if(!dir || !*dir)
+            dir = "/tmp";
+        return std::string(dir) + "/osm-history-splitter-XXXXXX";
+    }
+
+    /**
+     * create a new directory in the temporary directory, removed with all
+     * its files when the process exits if remove_at_exit is set.
+     *
+     * this method returns false if the directory can't be created.
+     */
+    static bool create_directory(std::string &path, bool remove_at_exit) {
+        std::string tmpl = pattern();
+        std::vector<char> buf(tmpl.begin(), tmpl.end());
+        buf.push_back('\0');
+        if(!mkdtemp(&buf[0]))
+            return false;
+
+        path = &buf[0];
+        if(remove_at_exit) {
+            pthread_mutex_lock(&mutex());
+            if(directories().empty())
+                atexit(&TempFiles::remove_all);
+            directories().push_back(path);
+            pthread_mutex_unlock(&mutex());
+        }
+        return true;
+    }
+
+    /**
+     * create a new empty file in the temporary directory.
+     *
+     * this method returns false if the file can't be created.
+     */
+    static bool create_file(std::string &path) {
+        std::string tmpl = pattern();
+        std::vector<char> buf(tmpl.begin(), tmpl.end());
+        buf.push_back('\0');
+        int fd = mkstemp(&buf[0]);
+        if(fd < 0)
+            return false;
+
+        close(fd);
+        path = &buf[0];
+        return true;
+    }
+
+    // remove a directory created with remove_at_exit now
+    static void remove(const std::string &path) {
+        pthread_mutex_lock(&mutex());
+        std::vector<std::string> &dirs = directories();
+        dirs.erase(std::remove(dirs.begin(), dirs.end(), path), dirs.end());
+        pthread_mutex_unlock(&mutex());
+        remove_tree(path);
+    }
+
+    // end the process from a thread that can't go on, after reporting the error
+    static void fail_thread() {
+        remove_all();
+        _exit(1);
+    }
+};
+
+#endif // SPLITTER_TEMPFILES_HPP
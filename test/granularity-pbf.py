@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+# writes test/granularity.osh.pbf, a history .pbf whose dense nodes use a
+# granularity of 170 nanodegrees and a latitude offset. the longitudes of nodes
+# 1 and 2 are -170 and 170 nanodegrees, which osmium rounds to -2 and 2 and
+# plain integer division truncates to -1 and 1 (in 1e-7 degrees).
+#
+#   python3 test/granularity-pbf.py test/granularity.osh.pbf
+#
+# no protobuf module needed, the few messages are encoded by hand.
+#
+
+import struct
+import sys
+import zlib
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7f
+        n >>= 7
+        if n:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def zigzag(n):
+    return (n << 1) ^ (n >> 63)
+
+
+def field(number, wire, payload):
+    return varint(number << 3 | wire) + payload
+
+
+def uint(number, n):
+    return field(number, 0, varint(n))
+
+
+def sint(number, n):
+    return field(number, 0, varint(zigzag(n)))
+
+
+def data(number, b):
+    return field(number, 2, varint(len(b)) + b)
+
+
+def packed(number, values, signed=False):
+    return data(number, b"".join(varint(zigzag(v) if signed else v) for v in values))
+
+
+def deltas(values):
+    last = 0
+    out = []
+    for v in values:
+        out.append(v - last)
+        last = v
+    return out
+
+
+def blob(kind, message):
+    body = uint(2, len(message)) + data(3, zlib.compress(message))
+    header = data(1, kind.encode()) + uint(3, len(body))
+    return struct.pack(">I", len(header)) + header + body
+
+
+# id, version, visible, lon in units of the granularity
+NODES = [
+    (1, 1, True, -1),
+    (2, 1, True, 1),
+    (3, 1, True, 0),
+]
+
+GRANULARITY = 170
+LAT_OFFSET = 1000000000     # every node at latitude 1
+TIMESTAMP = 1325412000      # 2012-01-01T10:00:00Z, in seconds with date_granularity 1000
+
+header = b"".join(data(4, f.encode()) for f in ("OsmSchema-V0.6", "DenseNodes", "HistoricalInformation"))
+header += data(16, b"granularity-pbf.py")
+
+info = packed(1, [n[1] for n in NODES])
+info += packed(2, deltas([TIMESTAMP] * len(NODES)), signed=True)
+info += packed(3, deltas([100] * len(NODES)), signed=True)
+info += packed(4, deltas([1000] * len(NODES)), signed=True)
+info += packed(5, deltas([1] * len(NODES)), signed=True)
+info += packed(6, [1 if n[2] else 0 for n in NODES])
+
+dense = packed(1, deltas([n[0] for n in NODES]), signed=True)
+dense += data(5, info)
+dense += packed(8, deltas([0] * len(NODES)), signed=True)
+dense += packed(9, deltas([n[3] for n in NODES]), signed=True)
+
+block = data(1, data(1, b"") + data(1, b"me"))
+block += data(2, data(2, dense))
+block += uint(17, GRANULARITY)
+block += uint(18, 1000)
+block += uint(19, LAT_OFFSET)
+
+with open(sys.argv[1], "wb") as f:
+    f.write(blob("OSMHeader", header))
+    f.write(blob("OSMData", block))
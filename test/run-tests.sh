@@ -0,0 +1,165 @@
+#!/bin/sh
+#
+# regression tests of the splitter, run by make test
+#
+# every test is a shell script test/NAME.test, run in an empty directory of its
+# own (test/_run/NAME) with the helpers below. it writes its configs there, runs
+# the splitter on the fixtures in test/ and compares the objects of its outputs
+# with the lists it expects. a test fails as soon as one of its commands fails.
+#
+#   sh test/run-tests.sh [NAME ...]
+#
+
+TESTDIR=$(cd "$(dirname "$0")" && pwd)
+SPLITTER=${SPLITTER:-$TESTDIR/../osm-history-splitter}
+
+if [ ! -x "$SPLITTER" ]; then
+    echo "no splitter at $SPLITTER, run make first" >&2
+    exit 1
+fi
+
+# run the splitter, failing the test if it fails
+split() {
+    if ! "$SPLITTER" "$@" >>splitter.log 2>&1; then
+        echo "splitter $* failed, see $(pwd)/splitter.log" >&2
+        exit 1
+    fi
+}
+
+# run the splitter, failing the test if it succeeds
+split_fails() {
+    if "$SPLITTER" "$@" >>splitter.log 2>&1; then
+        echo "splitter $* should have failed" >&2
+        exit 1
+    fi
+}
+
+# convert a file into another format by extracting the whole world
+convert() {
+    echo "$2    BBOX    -180,-90,180,90" >convert.config
+    split "$1" convert.config
+    rm -f convert.config
+}
+
+# the objects of an output, one "type id version" per line
+objects() {
+    case "$1" in
+        *.pbf)
+            convert "$1" objects.osh
+            set -- objects.osh
+            ;;
+        *.gz)
+            gzip -dc "$1" >objects.osh || exit 1
+            set -- objects.osh
+            ;;
+        *.bz2)
+            bzip2 -dc "$1" >objects.osh || exit 1
+            set -- objects.osh
+            ;;
+    esac
+
+    sed -n 's/^ *<\(node\|way\|relation\) id="\([0-9-]*\)".* version="\([0-9]*\)".*/\1 \2 \3/p' "$1"
+    rm -f objects.osh
+}
+
+# compare the objects of an output with the list on stdin
+check() {
+    cat >expected
+    objects "$1" >actual
+    if ! diff -u expected actual >&2; then
+        echo "unexpected objects in $1" >&2
+        exit 1
+    fi
+    rm -f expected actual
+}
+
+# the shared fixture: test/cut.osh cut to the north-east (BBOX 0,0,5,5) and
+# south-west (BBOX -5,-5,0,0) quadrants. tests of options which must not change
+# what is written compare their outputs with these
+check_north_east() {
+    check "$1" <<OBJECTS
+node 1 1
+node 2 1
+node 3 1
+node 4 1
+node 7 1
+node 7 2
+node 7 3
+node 8 1
+node 9 1
+node 9 2
+node 9 3
+way 10 1
+way 11 1
+way 13 1
+way 13 2
+relation 20 1
+relation 21 1
+OBJECTS
+}
+
+# deleted and moved-away versions are left out, ways keep their nodes inside
+check_north_east_hardcut() {
+    check "$1" <<OBJECTS
+node 1 1
+node 2 1
+node 3 1
+node 7 1
+node 7 2
+node 9 1
+node 9 2
+way 10 1
+relation 20 1
+OBJECTS
+}
+
+check_south_west() {
+    check "$1" <<OBJECTS
+node 5 1
+node 6 1
+way 12 1
+relation 20 1
+relation 21 1
+OBJECTS
+}
+
+# compare a file with the content on stdin
+check_file() {
+    cat >expected
+    if ! diff -u expected "$1" >&2; then
+        echo "unexpected content of $1" >&2
+        exit 1
+    fi
+    rm -f expected
+}
+
+# fail the test unless the splitter log has a line matching the pattern
+check_log() {
+    if ! grep -q -- "$1" splitter.log; then
+        echo "splitter.log has no line matching $1" >&2
+        exit 1
+    fi
+}
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$TESTDIR" && ls *.test | sed 's/\.test$//')
+fi
+
+passed=0
+failed=""
+for name in "$@"; do
+    run="$TESTDIR/_run/$name"
+    rm -rf "$run"
+    mkdir -p "$run"
+
+    if (cd "$run" && FIXTURES="$TESTDIR" && . "$TESTDIR/$name.test"); then
+        echo "ok      $name"
+        passed=$((passed + 1))
+    else
+        echo "FAILED  $name"
+        failed="$failed $name"
+    fi
+done
+
+echo "$passed passed, $(echo $failed | wc -w) failed"
+[ -z "$failed" ]
@@ -47,7 +47,20 @@ chdir("full-history");
 
 // TODO: remove old dumps
 
-if(in_array('--skip-download', $argv))
+$oshfile = str_replace('.osm', '.osh', $remote);
+$oshpath = getcwd().'/'.$oshfile;
+
+// with --stream the dump is not downloaded first but piped into the first
+// splitter run, which spools it to $oshpath for its second pass and all later runs
+$stream = in_array('--stream', $argv);
+
+if($stream)
+{
+	echo "streaming new dump from planet.osm.org into the first split\n";
+	system("wget -nc $base/$remote.md5");
+	@unlink($oshpath);
+}
+else if(in_array('--skip-download', $argv))
 {
 	echo "skipping download of new dump\n";
 }
@@ -57,7 +70,11 @@ else
 	system("wget -nc $base/$remote.md5 $base/$remote");
 }
 
-if(in_array('--skip-md5sum', $argv))
+if($stream)
+{
+	// the dump is checked after it has been spooled by the first split
+}
+else if(in_array('--skip-md5sum', $argv))
 {
 	echo "skipping md5sum check\n";
 }
@@ -73,9 +90,8 @@ else
 	}
 }
 
-$oshfile = str_replace('.osm', '.osh', $remote);
-$oshpath = getcwd().'/'.$oshfile;
-@symlink($remote, $oshfile);
+if(!$stream)
+	@symlink($remote, $oshfile);
 
 
 chdir($cwd);
@@ -111,8 +127,28 @@ foreach(glob('*.conf') as $conf)
 	echo "splitting according to $conf\n";
 
 	chdir("full-history-extracts/$date");
-	system("/usr/bin/osm-history-splitter $oshpath $conf 1>&2");
-	chdir($cwd);
+	if($stream && !file_exists($oshpath))
+	{
+		system("wget -q -O - $base/$remote | /usr/bin/osm-history-splitter --spool=$oshpath - $conf 1>&2");
+		chdir($cwd);
+
+		if(!in_array('--skip-md5sum', $argv))
+		{
+			echo "checking md5sum of spooled dump\n";
+			$md5 = preg_split('/\s+/', file_get_contents("full-history/$remote.md5"));
+			if(md5_file($oshpath) != $md5[0])
+			{
+				echo "md5sum mismatch\n";
+				echo "ending\n";
+				exit(2);
+			}
+		}
+	}
+	else
+	{
+		system("/usr/bin/osm-history-splitter --cache $oshpath $conf 1>&2");
+		chdir($cwd);
+	}
 }
 
 echo "updating latest-stamp-file and -symlink\n";
@@ -25,6 +25,12 @@ clipExtension = ".poly" # .osm
 # the desired result datatype (.osm.pbf, .osh.pbf, .osm, .osh, ...)
 dataType = ".osm.pbf"
 
+# the compression of extracts other extracts are split from (ie europe.osm.pbf
+# when clipbounds/europe/ exists). they are read again minutes later, so trading
+# disk space for less cpu on both ends pays off. use "none" for uncompressed
+# pbf-blobs, a zlib level 1-9 or "default"
+intermediateCompression = "none"
+
 # the maximum number of parallel running extracts
 # this is ( <your systems memory in GB> - 1) * 1024 / <size per extract>
 # where <size per extract> is 190 MB for Hardcut and 350 MB for Softcut
@@ -34,7 +40,8 @@ dataType = ".osm.pbf"
 # re-run the tool for some seconds, ...
 # when creating the last bit-vector takes more time then creating the
 # first vectors, the os starts to swap the bit-vectors out. reduce the
-# number by one and try again
+# number by one and try again. the splitter reports this on stderr as
+# "memory pressure: ..." and prints its peak memory when it's done
 maxParallel = 8
 
 # the number of parallel extracts is determined by the available memory.
@@ -107,6 +114,9 @@ def process(tasks):
         os.write(fp, clipType)
         os.write(fp, "\t")
         os.write(fp, clipDir + "/" + task + clipExtension)
+        if os.path.isdir(os.path.join(clipDir, task)) and dataType.endswith(".pbf"):
+            os.write(fp, "\t")
+            os.write(fp, "compression=" + intermediateCompression)
         os.write(fp, "\n")
 
     os.close(fp)
@@ -0,0 +1,252 @@
+#ifndef SPLITTER_WATCHDOG_HPP
+#define SPLITTER_WATCHDOG_HPP
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <iostream>
+#include <string>
+
+/*
+
+Memory Watchdog
+ - a thread samples once per second
+   - the resident memory of the process (/proc/self/statm)
+   - its major page faults (/proc/self/stat), pages read back from swap or disk
+   - the memory pressure of the system (/proc/pressure/memory, if the kernel has psi)
+ - the process is thrashing when it takes more than max_faults major faults per
+   second and, where psi is available, the system stalls on memory for more than
+   min_pressure percent of the time, for a few samples in a row
+ - thrashing is logged at most once a minute with what was measured, instead of
+   the split silently crawling on for days
+ - with --pressure-spill=DIR the watchdog also asks the cut to move the trackers
+   into files in DIR. the cut does so between two objects, so no set() races the
+   move. file-backed pages are written back and dropped by the kernel instead of
+   being swapped, which also works on machines without swap
+ - a SIGUSR1 asks for the move right away, without waiting for thrashing
+ - the peak memory and fault rate are printed when the watchdog stops
+
+*/
+
+class MemoryWatchdog {
+
+private:
+    // a sample above these counts as thrashing
+    static const int max_faults = 200;
+    static const int min_pressure = 10;
+
+    // samples in a row before thrashing is reported
+    static const int confirm = 3;
+
+    static const int log_interval = 60;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool running;
+
+    std::string spill_dir;
+
+    // set by the watchdog thread, read by the cut between two objects
+    volatile bool spill_requested;
+    bool spilled;
+
+    size_t peak_rss;
+    double peak_faults;
+
+    static bool read_rss(size_t &rss) {
+        FILE *fp = fopen("/proc/self/statm", "r");
+        if(!fp)
+            return false;
+
+        unsigned long size, resident;
+        bool ok = fscanf(fp, "%lu %lu", &size, &resident) == 2;
+        fclose(fp);
+
+        rss = resident * sysconf(_SC_PAGE_SIZE);
+        return ok;
+    }
+
+    static bool read_faults(unsigned long long &faults) {
+        FILE *fp = fopen("/proc/self/stat", "r");
+        if(!fp)
+            return false;
+
+        char buf[1024];
+        size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+        fclose(fp);
+        buf[len] = '\0';
+
+        // the name of the process may contain spaces, the fields start after its closing bracket
+        const char *p = strrchr(buf, ')');
+        if(!p)
+            return false;
+
+        // state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt
+        char state;
+        long ppid, pgrp, session, tty, tpgid;
+        unsigned long flags, minflt, cminflt;
+        return sscanf(p + 1, " %c %ld %ld %ld %ld %ld %lu %lu %lu %llu",
+            &state, &ppid, &pgrp, &session, &tty, &tpgid, &flags, &minflt, &cminflt, &faults) == 10;
+    }
+
+    // the percentage of time some and all tasks stalled on memory over the last 10 seconds
+    static bool read_pressure(double &some, double &full) {
+        FILE *fp = fopen("/proc/pressure/memory", "r");
+        if(!fp)
+            return false;
+
+        char kind[8];
+        double avg10;
+        some = full = 0;
+        while(fscanf(fp, "%7s avg10=%lf %*[^\n]", kind, &avg10) == 2) {
+            if(0 == strcmp(kind, "some")) some = avg10;
+            else if(0 == strcmp(kind, "full")) full = avg10;
+        }
+        fclose(fp);
+        return true;
+    }
+
+    // set by the SIGUSR1 handler, which may only touch a sig_atomic_t
+    static volatile sig_atomic_t &signalled() {
+        static volatile sig_atomic_t flag = 0;
+        return flag;
+    }
+
+    static void on_signal(int) {
+        signalled() = 1;
+    }
+
+    static double now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    static void *thread_main(void *arg) {
+        static_cast<MemoryWatchdog*>(arg)->watch();
+        return NULL;
+    }
+
+    void watch() {
+        unsigned long long faults = 0, last_faults = 0;
+        read_faults(last_faults);
+        double last_time = now(), last_log = 0;
+        int thrashing = 0;
+
+        pthread_mutex_lock(&mutex);
+        while(running) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&cond, &mutex, &deadline);
+            if(!running)
+                break;
+
+            size_t rss = 0;
+            double some = 0, full = 0;
+            read_rss(rss);
+            bool psi = read_pressure(some, full);
+            if(!read_faults(faults))
+                continue;
+
+            double t = now();
+            double rate = (faults - last_faults) / (t - last_time);
+            last_faults = faults;
+            last_time = t;
+
+            if(rss > peak_rss) peak_rss = rss;
+            if(rate > peak_faults) peak_faults = rate;
+
+            if(rate > max_faults && (!psi || full > min_pressure))
+                thrashing++;
+            else
+                thrashing = 0;
+
+            if(thrashing < confirm)
+                continue;
+
+            if(t - last_log >= log_interval) {
+                std::cerr << "memory pressure: " << (rss / (1024*1024)) << " MB resident, " << static_cast<long>(rate) << " major faults/s";
+                if(psi)
+                    std::cerr << ", stalled on memory " << some << "% (some) " << full << "% (full) of the last 10s";
+                std::cerr << std::endl;
+
+                if(spill_dir.empty())
+                    std::cerr << "memory pressure: the trackers are being swapped, split fewer extracts at once (--threads and --max-memory) or use --pressure-spill" << std::endl;
+                last_log = t;
+            }
+
+            if(!spill_dir.empty() && !spilled && !spill_requested) {
+                std::cerr << "memory pressure: moving the trackers to " << spill_dir << std::endl;
+                spill_requested = true;
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+public:
+    /**
+     * start watching the process. with a spill directory the cut is asked to
+     * move its trackers there when the process is thrashing.
+     */
+    MemoryWatchdog(const char *spill_dir) : running(true), spill_dir(spill_dir ? spill_dir : ""),
+        spill_requested(false), spilled(false), peak_rss(0), peak_faults(0) {
+
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+        pthread_create(&thread, NULL, &MemoryWatchdog::thread_main, this);
+
+        // restart interrupted reads, the input may be a pipe the signal arrives on
+        if(!this->spill_dir.empty()) {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = &MemoryWatchdog::on_signal;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            if(0 != sigaction(SIGUSR1, &action, NULL))
+                std::cerr << "unable to handle SIGUSR1: " << strerror(errno) << std::endl;
+        }
+    }
+
+    ~MemoryWatchdog() {
+        if(!spill_dir.empty())
+            signal(SIGUSR1, SIG_DFL);
+
+        pthread_mutex_lock(&mutex);
+        running = false;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+
+        std::cerr << "peak memory: " << (peak_rss / (1024*1024)) << " MB resident, " << static_cast<long>(peak_faults) << " major faults/s" << std::endl;
+
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    // should the cut move its trackers to the spill directory now
+    bool spill_pending() const {
+        return spill_requested || (signalled() && !spilled);
+    }
+
+    const std::string &directory() const {
+        return spill_dir;
+    }
+
+    // the cut moved its trackers, new segments are file-backed from now on
+    void spill_done() {
+        pthread_mutex_lock(&mutex);
+        spilled = true;
+        spill_requested = false;
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+#endif // SPLITTER_WATCHDOG_HPP
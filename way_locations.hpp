@@ -0,0 +1,163 @@
+#ifndef SPLITTER_WAY_LOCATIONS_HPP
+#define SPLITTER_WAY_LOCATIONS_HPP
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*
+
+Way Locations (locations=FILE)
+ - in the second pass of the softcut every node-version written to an extract is
+   stored in a per-extract location store before the first way arrives: its id,
+   timestamp and fixed-point coordinates, 20 bytes per version in four arrays
+ - the nodes come sorted by id and version, so the store is appended to and
+   searched with a binary search over the ids, no index is built
+ - every way-version written to the extract is written to FILE with the locations
+   of its nodes as they were at the timestamp of the way-version: the latest
+   version of the node not younger than the way. a node that was deleted at that
+   time or did not exist yet gets the undefined location
+ - the pbf-writer of osmium can't store locations on ways, so they go into a
+   file next to the extract that a consumer reads along the ways instead of
+   building a node-location index of its own
+
+File format, all numbers big-endian
+ - 8 bytes magic: OSHLOC01
+ - per way-version, in the order of the ways in the extract
+   - 8 bytes way id, 4 bytes version, 4 bytes number of nodes
+   - per node 4 bytes x and 4 bytes y, the longitude and latitude times 10^7,
+     2147483647 for both if the location is undefined
+
+*/
+
+class WayLocations {
+
+public:
+    static const int32_t undefined_coordinate = 2147483647;
+
+    // bytes of the location store per node-version, id, timestamp, x and y
+    static const int bytes_per_version = 20;
+
+private:
+    std::string filename;
+    FILE *fp;
+    bool ok;
+
+    // one entry per stored node-version, sorted by id
+    std::vector<osm_object_id_t> ids;
+    std::vector<uint32_t> timestamps;
+    std::vector<int32_t> xs;
+    std::vector<int32_t> ys;
+
+    std::vector<char> buf;
+
+    template <typename T> void put(T value) {
+        for(int i = sizeof(T) - 1; i >= 0; i--) {
+            buf.push_back(static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xff));
+        }
+    }
+
+    void flush() {
+        if(ok && !buf.empty() && fwrite(&buf[0], 1, buf.size(), fp) != buf.size()) {
+            std::cerr << "unable to write way locations to " << filename << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+        buf.clear();
+    }
+
+    // the location of the node at the time, false if it is undefined then
+    bool find(osm_object_id_t id, uint32_t timestamp, int32_t &x, int32_t &y) const {
+        std::vector<osm_object_id_t>::const_iterator it = std::upper_bound(ids.begin(), ids.end(), id);
+
+        // walk back over the versions of the node to the latest one not younger than the time
+        for(size_t i = it - ids.begin(); i > 0 && ids[i-1] == id; i--) {
+            if(timestamps[i-1] > timestamp)
+                continue;
+
+            x = xs[i-1];
+            y = ys[i-1];
+            return x != undefined_coordinate;
+        }
+        return false;
+    }
+
+public:
+    WayLocations(const std::string &filename) : filename(filename), ok(true) {
+        fp = fopen(filename.c_str(), "wb");
+        if(!fp) {
+            std::cerr << "unable to open way locations " << filename << ": " << strerror(errno) << std::endl;
+            exit(1);
+        }
+
+        buf.insert(buf.end(), "OSHLOC01", "OSHLOC01" + 8);
+    }
+
+    ~WayLocations() {
+        if(fp)
+            close();
+    }
+
+    /**
+     * write the rest of the file and close it.
+     *
+     * this method returns false if any write to the file failed.
+     */
+    bool close() {
+        flush();
+        if(0 != fclose(fp) && ok) {
+            std::cerr << "unable to close way locations " << filename << ": " << strerror(errno) << std::endl;
+            ok = false;
+        }
+        fp = NULL;
+        return ok;
+    }
+
+    // store a node-version written to the extract, nodes have to come sorted by id and version
+    void node(const shared_ptr<Osmium::OSM::Node const>& node) {
+        ids.push_back(node->id());
+        timestamps.push_back(static_cast<uint32_t>(node->timestamp()));
+        if(node->visible()) {
+            xs.push_back(node->position().x());
+            ys.push_back(node->position().y());
+        } else {
+            xs.push_back(undefined_coordinate);
+            ys.push_back(undefined_coordinate);
+        }
+    }
+
+    // write a way-version written to the extract with the locations of its nodes at its timestamp
+    void way(const shared_ptr<Osmium::OSM::Way const>& way) {
+        const Osmium::OSM::WayNodeList& waynodes = way->nodes();
+        uint32_t timestamp = static_cast<uint32_t>(way->timestamp());
+
+        put<int64_t>(way->id());
+        put<uint32_t>(way->version());
+        put<uint32_t>(waynodes.size());
+
+        for(int i = 0, l = waynodes.size(); i<l; i++) {
+            int32_t x, y;
+            if(!find(waynodes[i].ref(), timestamp, x, y))
+                x = y = undefined_coordinate;
+
+            put<int32_t>(x);
+            put<int32_t>(y);
+        }
+
+        if(buf.size() >= 1024*1024)
+            flush();
+    }
+
+    // bytes allocated by the location store
+    size_t memory_usage() const {
+        return ids.capacity() * sizeof(osm_object_id_t) + timestamps.capacity() * sizeof(uint32_t) +
+            (xs.capacity() + ys.capacity()) * sizeof(int32_t);
+    }
+};
+
+#endif // SPLITTER_WAY_LOCATIONS_HPP